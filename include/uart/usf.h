@@ -36,6 +36,7 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stddef.h>
 
 #include <uart/usf_types.h>
 #include <uart/usf_events.h>
@@ -45,7 +46,7 @@ extern "C" {
 #define USF_VERSION_MINOR(v) ((v) & 0xFFFF)
     
 #define USF_VERSION_CURRENT_MAJOR 0
-#define USF_VERSION_CURRENT_MINOR 2
+#define USF_VERSION_CURRENT_MINOR 3
 #define USF_VERSION_CURRENT (USF_VERSION(USF_VERSION_CURRENT_MAJOR,     \
 					 USF_VERSION_CURRENT_MINOR))
 
@@ -53,7 +54,10 @@ typedef uint16_t usf_version_t;
 
 enum {
     USF_COMPRESSION_NONE = 0,
-    USF_COMPRESSION_BZIP2
+    USF_COMPRESSION_BZIP2,
+    USF_COMPRESSION_ZSTD,
+    USF_COMPRESSION_LZ4,
+    USF_COMPRESSION_XZ
 };
 
 /** Compression type */
@@ -71,6 +75,39 @@ typedef uint16_t usf_compression_t;
 /** File contains instruction samples */
 #define USF_FLAG_INSTRUCTIONS (1 << 3)
 
+/**
+ * Delta compressed accesses are stored as variable length zigzag
+ * encoded deltas. Requires USF_FLAG_DELTA and USF 0.3 or newer.
+ */
+#define USF_FLAG_VARINT (1 << 8)
+
+/**
+ * Delta compress the pc, addr, len and type of accesses against the
+ * previous access of the same thread. Requires USF_FLAG_DELTA and
+ * USF 0.3 or newer.
+ */
+#define USF_FLAG_TID_CONTEXT (1 << 9)
+
+/**
+ * Predict the address of an access from the last address and stride
+ * of its pc, correctly predicted addresses take no space. Requires
+ * USF_FLAG_DELTA and USF 0.3 or newer.
+ */
+#define USF_FLAG_STRIDE (1 << 10)
+
+/**
+ * Store pcs as indexes into an adaptive dictionary of the pcs seen
+ * in the current block. Requires USF_FLAG_DELTA and USF 0.3 or newer.
+ */
+#define USF_FLAG_PC_DICT (1 << 11)
+
+/**
+ * Store the accesses of every block as one column per field, see
+ * usf_read_columns(). Only valid in trace files without
+ * USF_FLAG_DELTA, requires USF 0.3 or newer.
+ */
+#define USF_FLAG_COLUMNS (1 << 12)
+
 /**
  * Reserve two bits for the time base, note that these may not be
  * contiguous in future releases.
@@ -154,6 +191,30 @@ const char *usf_strerror(usf_error_t error);
  */
 const char *usf_strcompr(usf_compression_t compression);
 
+/**
+ * Look up a compression type by its short name, e.g. "bzip2", as
+ * used by the command line tools.
+ *
+ * \param compr Returned compression type.
+ * \param name Name of the compression type.
+ * \return USF_ERROR_OK on success, USF_ERROR_UNSUPPORTED if the
+ *         library was built without support for the compression
+ *         type and USF_ERROR_PARAM if the name is unknown.
+ */
+usf_error_t usf_parsecompr(usf_compression_t *compr, const char *name);
+
+/**
+ * Return the short name of a compression type, or NULL if the type
+ * is unknown. Valid compression types are numbered from 0 and up.
+ */
+const char *usf_namecompr(usf_compression_t compression);
+
+/**
+ * Check if the library was built with support for a compression
+ * type.
+ */
+int usf_hascompr(usf_compression_t compression);
+
 /**
  * Return a string representation of an access type. The returned
  * pointer is owned by the library.
@@ -183,6 +244,150 @@ usf_error_t usf_open(usf_file_t **file, const char *path);
 usf_error_t usf_create(usf_file_t **file,
 		       const char *path, const usf_header_t *header);
 
+/**
+ * Options for opening and creating files, a zeroed structure selects
+ * the defaults.
+ */
+typedef struct {
+    /** Number of threads compressing or decompressing blocks in
+     * parallel, 0 does all work on the calling thread. Files older
+     * than USF 0.3 are read with the help of a read-ahead thread if
+     * threads is non-zero, and written by the calling thread unless
+     * zstd uses threads compression workers. The threads are started
+     * with pthread_create(), so tools that have to create their
+     * threads through a runtime, like Pin tools, can't use them. */
+    unsigned threads;
+    /** Uncompressed size of a block in bytes, 0 selects the
+     * default (1 MiB). Ignored when reading. */
+    size_t block_size;
+    /** Codec specific compression level, 0 selects the codec's
+     * default. bzip2 and xz take levels from 1 to 9. Ignored when
+     * reading. */
+    int level;
+    /** Number of buffers of 4096 events queued for a background
+     * writer thread. Appending then only copies the events, the
+     * writer encodes, compresses and writes them. 0 does all work on
+     * the calling thread. The writer is started with
+     * pthread_create(), so tools that have to create their threads
+     * through a runtime, like Pin tools, can't use it. Ignored when
+     * reading. */
+    unsigned async;
+    /** Allow several threads to append to the file at the same
+     * time. Each thread fills its own async buffers (4 if async is
+     * 0) and the buffers are written in the order they fill up, so
+     * the events of different threads are interleaved 4096 at a
+     * time. Events of one thread keep their order, but the file is
+     * only ordered by time within each thread, see
+     * usf_seek_time(). Ignored when reading. */
+    int concurrent;
+    /** Number of batches of 4096 events a background thread
+     * decompresses and decodes ahead of the reader. Reading then
+     * only copies decoded events. 0 does all work on the calling
+     * thread. Ignored when writing. */
+    unsigned prefetch;
+    /** Size of the I/O buffer in bytes, 0 selects the default (4
+     * MiB). Rounded up to a multiple of 4 KiB. */
+    size_t io_buffer_size;
+    /** Bypass the page cache with O_DIRECT where the file system
+     * supports it. Files read with O_DIRECT aren't mapped into
+     * memory. */
+    int direct;
+    /** Number of buffers kept in flight with io_uring, each
+     * io_buffer_size bytes. 0 or 1 selects synchronous I/O, which is
+     * also used if io_uring isn't available. Files read with io_uring
+     * aren't mapped into memory. */
+    unsigned io_depth;
+    /** Store a statistics trailer, see usf_file_stats(). Only USF
+     * 0.3 and newer files can hold one. Ignored when reading. */
+    int stats;
+} usf_options_t;
+
+/**
+ * Open a file for reading like usf_open(), using the specified
+ * options.
+ *
+ * \param file Returned file object.
+ * \param path Path to file.
+ * \param options Options, NULL selects the defaults.
+ * \return USF_ERROR_OK on success.
+ */
+usf_error_t usf_open_opts(usf_file_t **file, const char *path,
+                          const usf_options_t *options);
+
+/**
+ * Creates a new file like usf_create(), using the specified
+ * options.
+ *
+ * \param file Returned file object.
+ * \param path Path to the new file
+ * \param header Header for the file
+ * \param options Creation options, NULL selects the defaults.
+ * \return USF_ERROR_OK on success.
+ */
+usf_error_t usf_create_opts(usf_file_t **file,
+                            const char *path, const usf_header_t *header,
+                            const usf_options_t *options);
+
+/**
+ * Open a file for reading from an open descriptor, starting at its
+ * current position. Pipes and sockets are read sequentially. The
+ * descriptor isn't closed by usf_close(), which leaves it positioned
+ * after the data that was read if it supports seeking.
+ *
+ * \param file Returned file object.
+ * \param fd Descriptor to read from.
+ * \param options Options, NULL selects the defaults.
+ * \return USF_ERROR_OK on success.
+ */
+usf_error_t usf_open_fd(usf_file_t **file, int fd,
+                        const usf_options_t *options);
+
+/**
+ * Open a file held in memory for reading. The memory isn't copied
+ * and must stay unchanged until the file is closed.
+ *
+ * \param file Returned file object.
+ * \param data Contents of the file.
+ * \param size Size of the file in bytes.
+ * \param options Options, NULL selects the defaults. The I/O options
+ *        are ignored.
+ * \return USF_ERROR_OK on success.
+ */
+usf_error_t usf_open_mem(usf_file_t **file, const void *data, size_t size,
+                         const usf_options_t *options);
+
+/**
+ * Creates a new file writing to an open descriptor, starting at its
+ * current position. The descriptor isn't closed by usf_close().
+ *
+ * \param file Returned file object.
+ * \param fd Descriptor to write to.
+ * \param header Header for the file
+ * \param options Creation options, NULL selects the defaults.
+ * \return USF_ERROR_OK on success.
+ */
+usf_error_t usf_create_fd(usf_file_t **file, int fd,
+                          const usf_header_t *header,
+                          const usf_options_t *options);
+
+/**
+ * Creates a new file in a memory buffer that grows as needed. Like
+ * open_memstream(), *data and *size are set to the buffer and the
+ * size of the file when it is closed. The caller frees *data, also
+ * if usf_close() fails.
+ *
+ * \param file Returned file object.
+ * \param data Returned buffer, NULL until the file is closed.
+ * \param size Returned size of the file.
+ * \param header Header for the file
+ * \param options Creation options, NULL selects the defaults. The I/O
+ *        options are ignored.
+ * \return USF_ERROR_OK on success.
+ */
+usf_error_t usf_create_mem(usf_file_t **file, void **data, size_t *size,
+                           const usf_header_t *header,
+                           const usf_options_t *options);
+
 /**
  * Close a file and deallocate all resources associated with the file.
  *
@@ -201,14 +406,77 @@ usf_error_t usf_close(usf_file_t *file);
  */
 usf_error_t usf_header(const usf_header_t **header, usf_file_t *file);
 
+/** Number of events of each type, indexed by usf_event_type_t */
+typedef struct {
+    uint64_t events[USF_EVENT_TRACE + 1];
+} usf_stats_count_t;
+
+/** Number of line sizes in usf_stats_t, see usf_line_size_mask_t */
+#define USF_STATS_LINE_SIZES 32
+
+/** Statistics stored in the trailer of a file */
+typedef struct {
+    usf_stats_count_t total;
+    /** Range of the times and addresses of all accesses, min is
+     * larger than max if the file has no accesses. */
+    usf_atime_t min_time;
+    usf_atime_t max_time;
+    usf_addr_t min_addr;
+    usf_addr_t max_addr;
+    /** Number of samples and danglings of each line size, indexed by
+     * the log2 of the line size. */
+    uint64_t line_sizes[USF_STATS_LINE_SIZES];
+    /** Events of each thread indexed by tid, bursts don't belong to
+     * a thread. */
+    size_t tids;
+    usf_stats_count_t *tid;
+    /** Events following each burst, entry 0 counts the events before
+     * the first burst. Entry i starts with the i:th burst event. */
+    size_t bursts;
+    usf_stats_count_t *burst;
+} usf_stats_t;
+
+/**
+ * Retrieves the statistics stored in the trailer of a file created
+ * with usf_options_t.stats. This only reads the end of the file, the
+ * events are left untouched. The statistics are valid until the file
+ * is closed.
+ *
+ * \param stats Pointer to the target statistics pointer.
+ * \param file Pointer to a file opened for reading.
+ * \return USF_ERROR_OK on success, USF_ERROR_UNSUPPORTED if the file
+ *         has no statistics trailer.
+ */
+usf_error_t usf_file_stats(const usf_stats_t **stats, usf_file_t *file);
+
 /**
- * Append an event to a file that has been opened for writing.
+ * Append an event to a file that has been opened for writing. Only
+ * one thread may append at a time unless the file was created with
+ * usf_options_t.concurrent.
  *
  * \param file File object opened for writing.
  * \param event Event to append to the file.
  * \return USF_ERROR_OK on success.
  */
 usf_error_t usf_append(usf_file_t *file, const usf_event_t *event);
+
+/**
+ * Append n events to a file that has been opened for writing. The
+ * result is identical to calling usf_append() for each event, but
+ * the events are encoded into a single buffer before being handed
+ * to the compression layer.
+ *
+ * The batch is validated before anything is written, no events are
+ * appended if any of them is invalid.
+ *
+ * \param file File object opened for writing.
+ * \param events Array of events to append to the file.
+ * \param n Number of events in the array.
+ * \return USF_ERROR_OK on success.
+ */
+usf_error_t usf_append_batch(usf_file_t *file, const usf_event_t *events,
+                             size_t n);
+
 /**
  * Read the next event in the file. The contents of event are
  * undefined if the procedure fails.
@@ -220,6 +488,125 @@ usf_error_t usf_append(usf_file_t *file, const usf_event_t *event);
  */
 usf_error_t usf_read(usf_file_t *file, usf_event_t *event);
 
+/**
+ * Read up to max events from a file. This is equivalent to calling
+ * usf_read() repeatedly, but avoids the per-call overhead.
+ *
+ * The number of events decoded is always stored in n, also when the
+ * procedure fails. Reaching the end of the file after at least one
+ * event has been read is not considered an error, USF_ERROR_EOF is
+ * returned by the next call instead.
+ *
+ * \param file Pointer a file.
+ * \param events Array of at least max events.
+ * \param max Maximum number of events to read.
+ * \param n Number of events read.
+ * \return USF_ERROR_OK on success, USF_ERROR_EOF on end of file,
+ *         USF_ERROR_FILE on file format errors.
+ */
+usf_error_t usf_read_batch(usf_file_t *file, usf_event_t *events,
+                           size_t max, size_t *n);
+
+/** Size of a record returned by usf_read_raw_trace() */
+#define USF_RAW_ACCESS_SIZE 29
+
+/**
+ * Get a pointer to the next records in a trace file without decoding
+ * them. Only trace files without delta compression are supported.
+ *
+ * Each record is USF_RAW_ACCESS_SIZE bytes, in the file's byte
+ * order, and contains the fields of a usf_access_t packed without
+ * padding: pc (8 bytes), addr (8), time (8), tid (2), len (2) and
+ * type (1). The records are not aligned.
+ *
+ * Uncompressed files are usually mapped into memory, in which case
+ * the pointer refers directly to the mapped file. The records are
+ * valid until the next call that reads from the file.
+ *
+ * \param file Pointer to a trace file.
+ * \param records Returned pointer to the first record.
+ * \param max Maximum number of records to return.
+ * \param n Number of records available at records.
+ * \return USF_ERROR_OK on success, USF_ERROR_EOF on end of file,
+ *         USF_ERROR_UNSUPPORTED if the file isn't a plain trace or
+ *         is decoded ahead (usf_options_t.prefetch).
+ */
+usf_error_t usf_read_raw_trace(usf_file_t *file, const void **records,
+                               size_t max, size_t *n);
+
+/** Destination arrays for usf_read_columns(), NULL to skip a field */
+typedef struct {
+    usf_addr_t *pc;
+    usf_addr_t *addr;
+    usf_atime_t *time;
+    usf_tid_t *tid;
+    usf_alen_t *len;
+    usf_atype_t *type;
+} usf_columns_t;
+
+/**
+ * Read up to max accesses from a trace file into one array per
+ * field. Fields whose array is NULL are skipped, in files with
+ * USF_FLAG_COLUMNS they aren't even decoded.
+ *
+ * Fewer than max accesses may be returned, e.g. at the end of a
+ * block. Calls may be mixed with the other read functions.
+ *
+ * \param file Pointer to a trace file.
+ * \param columns Arrays of at least max elements.
+ * \param max Maximum number of accesses to read.
+ * \param n Number of accesses read.
+ * \return USF_ERROR_OK on success, USF_ERROR_EOF on end of file,
+ *         USF_ERROR_UNSUPPORTED if the file isn't a trace.
+ */
+usf_error_t usf_read_columns(usf_file_t *file, const usf_columns_t *columns,
+                             size_t max, size_t *n);
+
+/**
+ * Position a file that has been opened for reading so that the next
+ * read returns the first event with a time greater than or equal to
+ * time. The time of an event is the time of its first access, or
+ * the begin time of a burst. Events are assumed to be stored in time
+ * order. Files written with usf_options_t.concurrent are only
+ * ordered within each thread, the first event in file order with a
+ * time greater than or equal to time is returned for them.
+ *
+ * Files with a block index (USF 0.3 and newer) only decode the block
+ * containing the target event. Older files are scanned from the
+ * beginning, which requires the file to be seekable unless nothing
+ * has been read from it yet. Events decoded ahead of the reader
+ * (usf_options_t.prefetch) are discarded and count as read.
+ *
+ * \param file Pointer to a file opened for reading.
+ * \param time Access time to seek to.
+ * \return USF_ERROR_OK on success, USF_ERROR_EOF if all events in
+ *         the file are older than time, USF_ERROR_UNSUPPORTED if the
+ *         file can't be repositioned.
+ */
+usf_error_t usf_seek_time(usf_file_t *file, usf_atime_t time);
+
+/**
+ * Get the current position in a file, i.e. the number of events
+ * preceding the next event to be read, or the number of events
+ * appended so far for files opened for writing.
+ *
+ * \param file Pointer to a file.
+ * \param pos Returned position.
+ * \return USF_ERROR_OK on success.
+ */
+usf_error_t usf_tell(usf_file_t *file, uint64_t *pos);
+
+/**
+ * Get the number of times an append had to wait for the background
+ * writer because all of its buffers were full. Always 0 unless the
+ * file was created with usf_options_t.async.
+ *
+ * \param file Pointer to a file opened for writing.
+ * \param stalls Returned number of stalls.
+ * \return USF_ERROR_OK on success.
+ */
+usf_error_t usf_write_stalls(usf_file_t *file, uint64_t *stalls);
+
 #ifdef __cplusplus
 }
 #endif
@@ -68,10 +68,10 @@
     } while (0)
 
 
-#define E_IF_IO(file, expr)                                     \
+#define E_IF_IO(io, expr)                                       \
     do {                                                        \
         if (expr) {                                             \
-	    error = feof(file) ? USF_ERROR_EOF : USF_ERROR_SYS; \
+	    error = usf_io_eof(io) ? USF_ERROR_EOF : USF_ERROR_SYS; \
             DBGLOG(error, #expr);                               \
 	    goto ret_err;                                       \
         }                                                       \
@@ -0,0 +1,487 @@
+/*
+ * Copyright (C) 2009-2011, Andreas Sandberg
+ * Copyright (C) 2009-2011, David Eklov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "usf_priv.h"
+#include "usf_internal.h"
+#include "usf_async.h"
+#include "usf_events.h"
+#include "error.h"
+
+/* Number of events per buffer */
+#define BUFFER_EVENTS 4096
+/* Buffers per producer when appends are concurrent and no number of
+ * buffers was specified */
+#define DEFAULT_BUFFERS 4
+
+typedef struct producer_s producer_t;
+
+typedef struct buffer_s {
+    usf_event_t *events;
+    size_t len;
+    producer_t *owner;
+    /* Next buffer in the writer's queue */
+    struct buffer_s *next;
+} buffer_t;
+
+/* Ring of buffers filled by one appending thread */
+struct producer_s {
+    buffer_t *buffer;
+    /* Number of buffers written and queued so far. The writer owns
+     * head and the producer owns tail, the buffers in between are
+     * waiting to be written. */
+    uint64_t head;
+    uint64_t tail;
+    /* Events in the buffer being filled */
+    size_t fill;
+
+    pthread_cond_t drained;
+    int waiting;
+
+    /* Statistics, only updated by the producer */
+    uint64_t events;
+    uint64_t stalls;
+
+    producer_t *next;
+};
+
+struct usf_async_s {
+    usf_file_t *file;
+    pthread_t thread;
+    /* Event writer of the file, only used by the writer thread */
+    const usf_event_ops_t *ops;
+    usf_event_ops_t async_ops;
+
+    /* Buffers per producer */
+    unsigned buffers;
+    /* All producers, new ones are added under lock. There is only
+     * one unless appends are concurrent, the others are found
+     * through key. */
+    producer_t *producers;
+    int concurrent;
+    pthread_key_t key;
+
+    /* Full buffers in the order they were queued. Producers push at
+     * the head, the writer pops at the tail. */
+    buffer_t *queue_head;
+    buffer_t *queue_tail;
+    buffer_t stub;
+    /* Number of buffers queued and written so far */
+    uint64_t queued;
+    uint64_t written;
+
+    /* Only used to sleep and wake up, set the waiting flag before
+     * sleeping and check the flag of the other side after updating
+     * the queue or a ring. */
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    int writer_waiting;
+
+    /* First error reported by the writer thread */
+    usf_error_t error;
+    int stop;
+};
+
+#define LOAD(p) __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define STORE(p, v) __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+/* Statistics are read by other threads, but don't order anything */
+#define LOAD_STAT(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define STORE_STAT(p, v) __atomic_store_n(p, v, __ATOMIC_RELAXED)
+
+static void
+wake(usf_async_t *aw, int *waiting, pthread_cond_t *cond)
+{
+    if (LOAD(waiting)) {
+        pthread_mutex_lock(&aw->lock);
+        pthread_cond_signal(cond);
+        pthread_mutex_unlock(&aw->lock);
+    }
+}
+
+/** Add a buffer to the writer's queue, safe for several producers */
+static void
+push(usf_async_t *aw, buffer_t *b)
+{
+    buffer_t *prev;
+
+    STORE(&b->next, NULL);
+    prev = __atomic_exchange_n(&aw->queue_head, b, __ATOMIC_SEQ_CST);
+    STORE(&prev->next, b);
+}
+
+/**
+ * Take the oldest buffer from the queue. Returns NULL if the queue
+ * is empty or a producer hasn't finished pushing the next buffer.
+ */
+static buffer_t *
+pop(usf_async_t *aw)
+{
+    buffer_t *tail = aw->queue_tail;
+    buffer_t *next = LOAD(&tail->next);
+
+    if (tail == &aw->stub) {
+        if (!next)
+            return NULL;
+        aw->queue_tail = tail = next;
+        next = LOAD(&next->next);
+    }
+
+    if (!next) {
+        /* The last buffer can only be unlinked by putting the stub
+         * behind it */
+        if (tail != LOAD(&aw->queue_head))
+            return NULL;
+        push(aw, &aw->stub);
+        if (!(next = LOAD(&tail->next)))
+            return NULL;
+    }
+
+    aw->queue_tail = next;
+    return tail;
+}
+
+static void *
+writer(void *arg)
+{
+    usf_async_t *aw = arg;
+    usf_error_t error = USF_ERROR_OK;
+
+    for (;;) {
+        const int stop = LOAD(&aw->stop);
+        producer_t *p;
+        buffer_t *b;
+
+        if (aw->written == LOAD(&aw->queued)) {
+            /* Producers queue their last buffers before stopping */
+            if (stop)
+                break;
+
+            pthread_mutex_lock(&aw->lock);
+            STORE(&aw->writer_waiting, 1);
+            while (aw->written == LOAD(&aw->queued) && !LOAD(&aw->stop))
+                pthread_cond_wait(&aw->filled, &aw->lock);
+            STORE(&aw->writer_waiting, 0);
+            pthread_mutex_unlock(&aw->lock);
+            continue;
+        }
+
+        /* The buffer has been counted, the producer is about to
+         * link it */
+        if (!(b = pop(aw))) {
+            sched_yield();
+            continue;
+        }
+
+        /* Keep draining after errors, the producers would wait for
+         * free buffers forever otherwise */
+        if (error == USF_ERROR_OK) {
+            error = aw->ops->append(aw->file, b->events, b->len);
+            if (error != USF_ERROR_OK)
+                STORE(&aw->error, error);
+        }
+
+        aw->written++;
+        p = b->owner;
+        STORE(&p->head, p->head + 1);
+        wake(aw, &p->waiting, &p->drained);
+    }
+
+    return NULL;
+}
+
+/** Hand the buffer being filled to the writer */
+static void
+queue_buffer(usf_async_t *aw, producer_t *p)
+{
+    buffer_t *b = &p->buffer[p->tail % aw->buffers];
+
+    b->len = p->fill;
+    p->fill = 0;
+    p->tail++;
+    push(aw, b);
+    __atomic_add_fetch(&aw->queued, 1, __ATOMIC_SEQ_CST);
+    wake(aw, &aw->writer_waiting, &aw->filled);
+}
+
+/** Wait until the writer has freed the buffer at the tail */
+static void
+wait_buffer(usf_async_t *aw, producer_t *p)
+{
+    if (p->tail - LOAD(&p->head) < aw->buffers)
+        return;
+
+    STORE_STAT(&p->stalls, p->stalls + 1);
+    pthread_mutex_lock(&aw->lock);
+    STORE(&p->waiting, 1);
+    while (p->tail - LOAD(&p->head) >= aw->buffers)
+        pthread_cond_wait(&p->drained, &aw->lock);
+    STORE(&p->waiting, 0);
+    pthread_mutex_unlock(&aw->lock);
+}
+
+static void
+free_producer(usf_async_t *aw, producer_t *p)
+{
+    if (p->buffer) {
+        for (unsigned i = 0; i < aw->buffers; i++)
+            free(p->buffer[i].events);
+        free(p->buffer);
+    }
+
+    pthread_cond_destroy(&p->drained);
+    free(p);
+}
+
+static producer_t *
+add_producer(usf_async_t *aw)
+{
+    producer_t *p;
+
+    if (!(p = calloc(1, sizeof(*p))))
+        return NULL;
+    pthread_cond_init(&p->drained, NULL);
+
+    if (!(p->buffer = calloc(aw->buffers, sizeof(*p->buffer)))) {
+        free_producer(aw, p);
+        return NULL;
+    }
+    for (unsigned i = 0; i < aw->buffers; i++) {
+        p->buffer[i].owner = p;
+        p->buffer[i].events = malloc(BUFFER_EVENTS * sizeof(usf_event_t));
+        if (!p->buffer[i].events) {
+            free_producer(aw, p);
+            return NULL;
+        }
+    }
+
+    pthread_mutex_lock(&aw->lock);
+    p->next = aw->producers;
+    aw->producers = p;
+    pthread_mutex_unlock(&aw->lock);
+    return p;
+}
+
+/** Find the producer of the calling thread */
+static producer_t *
+producer(usf_async_t *aw)
+{
+    producer_t *p;
+
+    if (!aw->concurrent)
+        return aw->producers;
+
+    if (!(p = pthread_getspecific(aw->key)) && (p = add_producer(aw)))
+        pthread_setspecific(aw->key, p);
+    return p;
+}
+
+static usf_error_t
+async_append(usf_file_t *file, const usf_event_t *events, size_t n)
+{
+    usf_async_t *aw = file->async;
+    usf_error_t error;
+    producer_t *p;
+
+    /* Report write errors as early as possible */
+    if ((error = LOAD(&aw->error)) != USF_ERROR_OK)
+        return error;
+    if (!(p = producer(aw)))
+        return USF_ERROR_MEM;
+
+    STORE_STAT(&p->events, p->events + n);
+    while (n) {
+        buffer_t *b;
+        size_t k;
+
+        if (!p->fill)
+            wait_buffer(aw, p);
+
+        b = &p->buffer[p->tail % aw->buffers];
+        k = BUFFER_EVENTS - p->fill < n ? BUFFER_EVENTS - p->fill : n;
+        memcpy(b->events + p->fill, events, k * sizeof(*events));
+        p->fill += k;
+        events += k;
+        n -= k;
+
+        if (p->fill == BUFFER_EVENTS)
+            queue_buffer(aw, p);
+    }
+
+    return USF_ERROR_OK;
+}
+
+static usf_error_t
+async_read(usf_file_t *file, usf_event_t *events, size_t max, size_t *n)
+{
+    /* Files being written can't be read */
+    (void)file;
+    (void)events;
+    (void)max;
+    *n = 0;
+    return USF_ERROR_PARAM;
+}
+
+static void
+free_async(usf_async_t *aw)
+{
+    while (aw->producers) {
+        producer_t *p = aw->producers;
+
+        aw->producers = p->next;
+        free_producer(aw, p);
+    }
+
+    if (aw->concurrent)
+        pthread_key_delete(aw->key);
+    pthread_cond_destroy(&aw->filled);
+    pthread_mutex_destroy(&aw->lock);
+    free(aw);
+}
+
+/**
+ * Start writing in the background, queueing at most buffers buffers
+ * of events per appending thread. Any number of threads may append
+ * at the same time if concurrent is set.
+ */
+usf_error_t
+usf_async_start(usf_file_t *file, unsigned buffers, int concurrent)
+{
+    usf_error_t error = USF_ERROR_OK;
+    usf_async_t *aw;
+
+    assert(file->mode == USF_MODE_WRITE && !file->async);
+    E_NULL(aw = calloc(1, sizeof(*aw)), USF_ERROR_MEM);
+    aw->file = file;
+    aw->ops = file->event_ops;
+    aw->async_ops.read = async_read;
+    aw->async_ops.append = async_append;
+    aw->buffers = buffers ? buffers : DEFAULT_BUFFERS;
+    aw->queue_head = aw->queue_tail = &aw->stub;
+    pthread_mutex_init(&aw->lock, NULL);
+    pthread_cond_init(&aw->filled, NULL);
+
+    if (concurrent) {
+        if (pthread_key_create(&aw->key, NULL)) {
+            free_async(aw);
+            return USF_ERROR_SYS;
+        }
+        aw->concurrent = 1;
+    } else if (!add_producer(aw)) {
+        free_async(aw);
+        return USF_ERROR_MEM;
+    }
+
+    if (pthread_create(&aw->thread, NULL, writer, aw)) {
+        free_async(aw);
+        return USF_ERROR_SYS;
+    }
+
+    file->async = aw;
+    file->event_ops = &aw->async_ops;
+
+ret_err:
+    return error;
+}
+
+/**
+ * Write all queued events and stop the background thread. Returns
+ * the first error the thread ran into. No thread may append while
+ * the writer is being stopped.
+ */
+usf_error_t
+usf_async_stop(usf_file_t *file)
+{
+    usf_async_t *aw = file->async;
+    usf_error_t error;
+    producer_t *p;
+
+    if (!aw)
+        return USF_ERROR_OK;
+
+    /* The buffers being filled have already been waited for */
+    pthread_mutex_lock(&aw->lock);
+    p = aw->producers;
+    pthread_mutex_unlock(&aw->lock);
+    for (; p; p = p->next) {
+        if (p->fill)
+            queue_buffer(aw, p);
+    }
+    STORE(&aw->stop, 1);
+    wake(aw, &aw->writer_waiting, &aw->filled);
+    pthread_join(aw->thread, NULL);
+
+    error = aw->error;
+    file->event_ops = aw->ops;
+    file->async = NULL;
+    free_async(aw);
+    return error;
+}
+
+/** Number of events appended by all threads so far */
+uint64_t
+usf_async_events(const usf_file_t *file)
+{
+    usf_async_t *aw = file->async;
+    uint64_t events = 0;
+
+    pthread_mutex_lock(&aw->lock);
+    for (producer_t *p = aw->producers; p; p = p->next)
+        events += LOAD_STAT(&p->events);
+    pthread_mutex_unlock(&aw->lock);
+    return events;
+}
+
+/** Number of times a producer had to wait for a free buffer */
+uint64_t
+usf_async_stalls(const usf_file_t *file)
+{
+    usf_async_t *aw = file->async;
+    uint64_t stalls = 0;
+
+    pthread_mutex_lock(&aw->lock);
+    for (producer_t *p = aw->producers; p; p = p->next)
+        stalls += LOAD_STAT(&p->stalls);
+    pthread_mutex_unlock(&aw->lock);
+    return stalls;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2009-2011, Andreas Sandberg
+ * Copyright (C) 2009-2011, David Eklov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef USF_ASYNC_H
+#define USF_ASYNC_H
+
+#include "usf_priv.h"
+
+/**
+ * Asynchronous writing (usf_options_t.async and concurrent).
+ *
+ * usf_append() and usf_append_batch() only copy events into a ring
+ * of event buffers owned by the appending thread. Full buffers are
+ * pushed to a lock-free queue shared by all producers. A background
+ * thread takes buffers from the queue in the order they were pushed
+ * and encodes, compresses and writes them using the event writer of
+ * the file. The threads only synchronize through a lock when one of
+ * them has to sleep because a ring is full or the queue is
+ * empty. Appends block while the thread's ring is full, every such
+ * stall is counted.
+ *
+ * Events of one thread are written in the order they were appended,
+ * events of different threads are interleaved a buffer at a time.
+ *
+ * The background thread owns all of the file's write state while it
+ * is running, it has to be stopped before the file is closed.
+ */
+usf_error_t usf_async_start(usf_file_t *file, unsigned buffers,
+                            int concurrent);
+usf_error_t usf_async_stop(usf_file_t *file);
+uint64_t usf_async_events(const usf_file_t *file);
+uint64_t usf_async_stalls(const usf_file_t *file);
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
@@ -0,0 +1,980 @@
+/*
+ * Copyright (C) 2009-2011, Andreas Sandberg
+ * Copyright (C) 2009-2011, David Eklov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "usf_priv.h"
+#include "usf_internal.h"
+#include "usf_block.h"
+#include "usf_io.h"
+#include "usf_columns.h"
+#include "usf_pool.h"
+#include "usf_stats.h"
+#include "error.h"
+
+/* A block that is being compressed or decompressed by the worker
+ * pool */
+typedef struct usf_block_job_s {
+    usf_pool_job_t job;
+
+    const usf_io_methods_t *methods;
+    int level;
+    /* Set if the encoded events are converted to columns before
+     * they are compressed, cols is the buffer used for that */
+    int columns;
+    char *cols;
+    size_t cols_size;
+
+    /* Encoded events, raw_size is the size of the buffer */
+    char *raw;
+    size_t raw_len;
+    size_t raw_size;
+    /* Compressed data, data_size is the size of the buffer */
+    char *data;
+    size_t data_len;
+    size_t data_size;
+    /* Data to decompress, points to data or into the file mapping */
+    const char *src;
+
+    /* Index entry without the offset, which isn't known until the
+     * block is written. */
+    usf_block_index_t entry;
+    uint32_t events;
+} usf_block_job_t;
+
+static usf_error_t
+write_bytes(usf_file_t *file, const void *data, size_t size)
+{
+    usf_error_t error;
+
+    if ((error = usf_io_write(file->io, data, size)) != USF_ERROR_OK)
+        return error;
+
+    file->offset += size;
+    return USF_ERROR_OK;
+}
+
+/** Grow a buffer to at least size bytes */
+static usf_error_t
+reserve(char **buf, size_t *buf_size, size_t size)
+{
+    char *p;
+
+    if (*buf_size >= size)
+        return USF_ERROR_OK;
+
+    if (!(p = realloc(*buf, size)))
+        return USF_ERROR_MEM;
+
+    *buf = p;
+    *buf_size = size;
+    return USF_ERROR_OK;
+}
+
+/**
+ * Read size bytes into dst, from the mapping if the file is mapped
+ * and through the I/O buffer otherwise. Returns USF_ERROR_EOF if the file
+ * ends before the first byte.
+ */
+static usf_error_t
+read_copy(usf_file_t *file, void *dst, size_t size)
+{
+    size_t len;
+
+    if (file->map) {
+        if (file->map_pos == file->map_size)
+            return USF_ERROR_EOF;
+        else if (file->map_size - file->map_pos < size)
+            return USF_ERROR_FILE;
+
+        memcpy(dst, (char *)file->map + file->map_pos, size);
+        file->map_pos += size;
+        return USF_ERROR_OK;
+    }
+
+    len = usf_io_read(file->io, dst, size);
+    if (len == size)
+        return USF_ERROR_OK;
+    else if (usf_io_error(file->io))
+        return USF_ERROR_SYS;
+    else
+        return len ? USF_ERROR_FILE : USF_ERROR_EOF;
+}
+
+/**
+ * Get a pointer to the next size bytes in the file. Mapped files
+ * return a pointer into the mapping, other files are read into the
+ * compressed data buffer.
+ */
+static usf_error_t
+read_ref(usf_file_t *file, size_t size, const char **data)
+{
+    usf_error_t error = USF_ERROR_OK;
+
+    if (file->map) {
+        E_IF(file->map_size - file->map_pos < size, USF_ERROR_FILE);
+        *data = (const char *)file->map + file->map_pos;
+        file->map_pos += size;
+        return USF_ERROR_OK;
+    }
+
+    E_ERROR(reserve(&file->cbuf, &file->cbuf_size, size));
+    error = read_copy(file, file->cbuf, size);
+    E_IF(error == USF_ERROR_EOF, USF_ERROR_FILE);
+    E_ERROR(error);
+    *data = file->cbuf;
+
+ret_err:
+    return error;
+}
+
+static usf_error_t
+index_append(usf_file_t *file, const usf_block_index_t *entry)
+{
+    usf_error_t error = USF_ERROR_OK;
+    usf_block_index_t *e;
+
+    if (file->index_len == file->index_size) {
+        size_t size = file->index_size ? 2 * file->index_size : 64;
+        usf_block_index_t *index;
+
+        E_NULL(index = realloc(file->index, size * sizeof(*index)),
+               USF_ERROR_MEM);
+        file->index = index;
+        file->index_size = size;
+    }
+
+    e = &file->index[file->index_len++];
+    *e = *entry;
+    e->offset = file->offset;
+
+ret_err:
+    return error;
+}
+
+/** Index entry for the current block, without the offset */
+static void
+current_entry(usf_file_t *file, usf_block_index_t *entry)
+{
+    entry->offset = 0;
+    entry->first_event = file->block_first_event;
+    entry->min_time = file->block_min_time;
+    entry->max_time = file->block_max_time;
+}
+
+static usf_error_t
+emit_block(usf_file_t *file, const usf_block_index_t *entry,
+           uint32_t events, size_t raw_len,
+           const char *data, size_t data_len)
+{
+    usf_error_t error = USF_ERROR_OK;
+    usf_block_header_t bh;
+
+    E_ERROR(index_append(file, entry));
+
+    memset(&bh, 0, sizeof(bh));
+    bh.raw_size = raw_len;
+    bh.data_size = data_len;
+    bh.events = events;
+    E_ERROR(write_bytes(file, &bh, sizeof(bh)));
+    E_ERROR(write_bytes(file, data, data_len));
+
+ret_err:
+    return error;
+}
+
+static usf_error_t
+compress_job(usf_pool_job_t *job)
+{
+    usf_error_t error = USF_ERROR_OK;
+    usf_block_job_t *j = (usf_block_job_t *)job;
+    const char *src = j->raw;
+
+    if (j->columns) {
+        E_ERROR(reserve(&j->cols, &j->cols_size,
+                        USF_COLUMNS_BOUND(j->events)));
+        usf_columns_encode(j->cols, &j->raw_len, j->raw, j->events);
+        src = j->cols;
+    }
+
+    j->data_len = j->data_size;
+    E_ERROR(j->methods->compress(j->data, &j->data_len,
+                                 src, j->raw_len, j->level));
+
+ret_err:
+    return error;
+}
+
+static usf_error_t
+decompress_job(usf_pool_job_t *job)
+{
+    usf_block_job_t *j = (usf_block_job_t *)job;
+    size_t len = j->raw_len;
+    usf_error_t error;
+
+    error = j->methods->decompress(j->raw, &len, j->src, j->data_len);
+    if (error == USF_ERROR_OK && len != j->raw_len)
+        error = USF_ERROR_FILE;
+
+    return error;
+}
+
+/** Wait for the oldest job in the pool and write its block. */
+static usf_error_t
+write_job(usf_file_t *file)
+{
+    usf_error_t error = USF_ERROR_OK;
+    usf_block_job_t *j = &file->jobs[file->jobs_head % file->jobs_len];
+
+    E_ERROR(usf_pool_wait(file->pool, &j->job));
+    E_ERROR(emit_block(file, &j->entry, j->events, j->raw_len,
+                       j->data, j->data_len));
+    file->jobs_head++;
+
+ret_err:
+    return error;
+}
+
+/**
+ * Hand the staging buffer to the worker pool. The staging buffer is
+ * swapped for the job's buffer, so the caller can continue encoding
+ * while the block is being compressed. Blocks are written in order
+ * as soon as they have been compressed.
+ */
+static usf_error_t
+submit_job(usf_file_t *file)
+{
+    usf_error_t error = USF_ERROR_OK;
+    usf_block_job_t *j;
+    char *raw;
+
+    if (file->jobs_tail - file->jobs_head == file->jobs_len)
+        E_ERROR(write_job(file));
+
+    j = &file->jobs[file->jobs_tail % file->jobs_len];
+    raw = j->raw;
+    j->raw = file->buf_mem;
+    j->raw_len = file->buf_len;
+    current_entry(file, &j->entry);
+    j->events = file->block_events;
+    file->buf_mem = raw;
+    file->buf = raw;
+
+    usf_pool_submit(file->pool, &j->job);
+    file->jobs_tail++;
+
+    while (file->jobs_head != file->jobs_tail &&
+           usf_pool_done(file->pool,
+                         &file->jobs[file->jobs_head % file->jobs_len].job))
+        E_ERROR(write_job(file));
+
+ret_err:
+    return error;
+}
+
+/**
+ * Set up a worker pool to compress or decompress blocks on threads
+ * threads. The staging buffer must have been allocated.
+ */
+usf_error_t
+usf_block_init_pool(usf_file_t *file, unsigned threads)
+{
+    usf_error_t error = USF_ERROR_OK;
+
+    if (!threads || !file->io_methods->compress)
+        return USF_ERROR_OK;
+
+    /* Keep a couple of blocks in flight per thread to avoid stalling
+     * the workers while the caller fills the next block. */
+    file->jobs_len = 2 * threads;
+    E_NULL(file->jobs = calloc(file->jobs_len, sizeof(*file->jobs)),
+           USF_ERROR_MEM);
+
+    for (size_t i = 0; i < file->jobs_len; i++) {
+        usf_block_job_t *j = &file->jobs[i];
+
+        j->methods = file->io_methods;
+        j->level = file->level;
+        j->columns = !!(file->header->flags & USF_FLAG_COLUMNS);
+        j->raw_size = file->buf_size;
+        E_NULL(j->raw = malloc(j->raw_size), USF_ERROR_MEM);
+
+        /* Readers allocate compressed data buffers on demand, they
+         * aren't needed for mapped files. */
+        if (file->mode == USF_MODE_WRITE) {
+            j->job.run = compress_job;
+            j->data_size = file->io_methods->bound(
+                file->buf_size + (j->columns ? USF_COLUMNS_OVERHEAD : 0));
+            E_NULL(j->data = malloc(j->data_size), USF_ERROR_MEM);
+        } else
+            j->job.run = decompress_job;
+    }
+
+    E_ERROR(usf_pool_create(&file->pool, threads));
+
+ret_err:
+    return error;
+}
+
+/** Stop the worker pool and free all jobs. */
+void
+usf_block_free_pool(usf_file_t *file)
+{
+    /* Destroying the pool completes all outstanding jobs */
+    usf_pool_destroy(file->pool);
+    file->pool = NULL;
+
+    for (size_t i = 0; file->jobs && i < file->jobs_len; i++) {
+        free(file->jobs[i].raw);
+        free(file->jobs[i].data);
+        free(file->jobs[i].cols);
+    }
+    free(file->jobs);
+    file->jobs = NULL;
+}
+
+/**
+ * Compress the staging buffer and write it to the file as a new
+ * block.
+ */
+usf_error_t
+usf_block_write(usf_file_t *file)
+{
+    usf_error_t error = USF_ERROR_OK;
+    usf_block_index_t entry;
+    const char *raw = file->buf;
+    size_t raw_len = file->buf_len;
+    const char *data;
+    size_t data_len;
+
+    if (!file->buf_len)
+        return USF_ERROR_OK;
+
+    if (file->pool) {
+        E_ERROR(submit_job(file));
+    } else {
+        if (file->header->flags & USF_FLAG_COLUMNS) {
+            E_ERROR(reserve(&file->cols_mem, &file->cols_size,
+                            USF_COLUMNS_BOUND(file->block_events)));
+            usf_columns_encode(file->cols_mem, &raw_len,
+                               file->buf, file->block_events);
+            raw = file->cols_mem;
+        }
+
+        data = raw;
+        data_len = raw_len;
+        if (file->io_methods->compress) {
+            data_len = file->cbuf_size;
+            E_ERROR(file->io_methods->compress(file->cbuf, &data_len,
+                                               raw, raw_len, file->level));
+            data = file->cbuf;
+        }
+
+        current_entry(file, &entry);
+        E_ERROR(emit_block(file, &entry, file->block_events,
+                           raw_len, data, data_len));
+    }
+
+    file->buf_len = 0;
+    usf_block_begin(file);
+
+ret_err:
+    return error;
+}
+
+/** Write the statistics gathered by usf_stats_add() */
+static usf_error_t
+write_stats(usf_file_t *file, usf_block_footer_t *footer)
+{
+    usf_error_t error = USF_ERROR_OK;
+    const usf_stats_t *stats = file->stats;
+    usf_block_stats_t bs;
+
+    memset(&bs, 0, sizeof(bs));
+    bs.total = stats->total;
+    bs.min_time = stats->min_time;
+    bs.max_time = stats->max_time;
+    bs.min_addr = stats->min_addr;
+    bs.max_addr = stats->max_addr;
+    memcpy(bs.line_sizes, stats->line_sizes, sizeof(bs.line_sizes));
+    bs.tids = stats->tids;
+    bs.bursts = stats->bursts;
+
+    footer->stats_offset = file->offset;
+    E_ERROR(write_bytes(file, &bs, sizeof(bs)));
+    E_ERROR(write_bytes(file, stats->tid, stats->tids * sizeof(*stats->tid)));
+    E_ERROR(write_bytes(file, stats->burst,
+                        stats->bursts * sizeof(*stats->burst)));
+    footer->stats_size = file->offset - footer->stats_offset;
+
+ret_err:
+    return error;
+}
+
+/**
+ * Terminate the block stream and write the block index, statistics,
+ * footer and trailer. The staging buffer must have been flushed.
+ */
+usf_error_t
+usf_block_finish(usf_file_t *file)
+{
+    usf_error_t error = USF_ERROR_OK;
+    usf_block_header_t bh;
+    usf_block_footer_t footer;
+    usf_block_trailer_t trailer;
+
+    assert(file->buf_len == 0);
+
+    while (file->jobs_head != file->jobs_tail)
+        E_ERROR(write_job(file));
+
+    memset(&bh, 0, sizeof(bh));
+    E_ERROR(write_bytes(file, &bh, sizeof(bh)));
+
+    memset(&footer, 0, sizeof(footer));
+    footer.index_offset = file->offset;
+    footer.blocks = file->index_len;
+    E_ERROR(write_bytes(file, file->index,
+                        file->index_len * sizeof(*file->index)));
+    if (file->stats)
+        E_ERROR(write_stats(file, &footer));
+
+    E_ERROR(write_bytes(file, &footer, sizeof(footer)));
+
+    trailer.footer_size = sizeof(footer);
+    memcpy(trailer.magic, USF_BLOCK_MAGIC, sizeof(trailer.magic));
+    E_ERROR(write_bytes(file, &trailer, sizeof(trailer)));
+
+ret_err:
+    return error;
+}
+
+/**
+ * Read the next block header. Sets blocks_eof and returns
+ * USF_ERROR_EOF at the end of the block stream.
+ */
+static usf_error_t
+read_header(usf_file_t *file, usf_block_header_t *bh)
+{
+    usf_error_t error = USF_ERROR_OK;
+
+    if (file->blocks_eof)
+        return USF_ERROR_EOF;
+
+    /* Files that were never closed properly lack the terminating
+     * block, treat the end of the file as the end of the stream. */
+    error = read_copy(file, bh, sizeof(*bh));
+    if (error == USF_ERROR_EOF ||
+        (error == USF_ERROR_OK &&
+         bh->raw_size == 0 && bh->data_size == 0 && bh->events == 0)) {
+        file->blocks_eof = 1;
+        return USF_ERROR_EOF;
+    }
+    E_ERROR(error);
+
+    E_IF(bh->raw_size == 0 || bh->raw_size > USF_BLOCK_MAX_SIZE,
+         USF_ERROR_FILE);
+
+ret_err:
+    return error;
+}
+
+/** Start decoding the len bytes of columns at data */
+static usf_error_t
+load_columns(usf_file_t *file, const char *data, size_t len,
+             uint32_t events)
+{
+    usf_error_t error = USF_ERROR_OK;
+
+    /* The records have to fit in a block */
+    E_IF(events > USF_BLOCK_MAX_SIZE / USF_RAW_ACCESS_SIZE,
+         USF_ERROR_FILE);
+
+    usf_block_begin(file);
+    file->block_events = events;
+    file->buf_pos = 0;
+    file->buf_len = 0;
+    file->col_events = 0;
+    file->col_pos = 0;
+    E_ERROR(usf_columns_init(file->col, data, len, events));
+    file->col_events = events;
+
+ret_err:
+    return error;
+}
+
+/**
+ * Queue blocks for decompression until all jobs are busy or the end
+ * of the file is reached.
+ */
+static usf_error_t
+submit_reads(usf_file_t *file)
+{
+    usf_error_t error = USF_ERROR_OK;
+    usf_block_header_t bh;
+
+    while (file->jobs_tail - file->jobs_head < file->jobs_len) {
+        usf_block_job_t *j = &file->jobs[file->jobs_tail % file->jobs_len];
+
+        error = read_header(file, &bh);
+        if (error == USF_ERROR_EOF)
+            return USF_ERROR_OK;
+        E_ERROR(error);
+
+        E_ERROR(reserve(&j->raw, &j->raw_size, bh.raw_size));
+        j->raw_len = bh.raw_size;
+        j->data_len = bh.data_size;
+        j->events = bh.events;
+
+        if (file->map) {
+            E_ERROR(read_ref(file, bh.data_size, &j->src));
+        } else {
+            E_ERROR(reserve(&j->data, &j->data_size, bh.data_size));
+            error = read_copy(file, j->data, bh.data_size);
+            E_IF(error == USF_ERROR_EOF, USF_ERROR_FILE);
+            E_ERROR(error);
+            j->src = j->data;
+        }
+
+        usf_pool_submit(file->pool, &j->job);
+        file->jobs_tail++;
+    }
+
+ret_err:
+    return error;
+}
+
+/**
+ * Load the next block decompressed by the worker pool into the
+ * staging buffer.
+ */
+static usf_error_t
+read_parallel(usf_file_t *file)
+{
+    usf_error_t error = USF_ERROR_OK;
+    usf_block_job_t *j;
+    char *raw;
+    size_t raw_size;
+
+    E_ERROR(submit_reads(file));
+    if (file->jobs_head == file->jobs_tail)
+        return USF_ERROR_EOF;
+
+    j = &file->jobs[file->jobs_head % file->jobs_len];
+    E_ERROR(usf_pool_wait(file->pool, &j->job));
+    file->jobs_head++;
+
+    /* The staging buffer, or the column buffer, has been fully
+     * decoded, so hand it to the job for a future block. */
+    raw = j->raw;
+    raw_size = j->raw_size;
+    if (file->header->flags & USF_FLAG_COLUMNS) {
+        j->raw = file->cols_mem;
+        j->raw_size = file->cols_size;
+        file->cols_mem = raw;
+        file->cols_size = raw_size;
+        E_ERROR(load_columns(file, raw, j->raw_len, j->events));
+    } else {
+        j->raw = file->buf_mem;
+        j->raw_size = file->buf_size;
+        file->buf_mem = raw;
+        file->buf_size = raw_size;
+        file->buf = raw;
+
+        usf_block_begin(file);
+        file->block_events = j->events;
+        file->buf_pos = 0;
+        file->buf_len = j->raw_len;
+    }
+
+ret_err:
+    return error;
+}
+
+/**
+ * Load the next block into the staging buffer, or into the column
+ * buffer in columnar files. Returns USF_ERROR_EOF after the last
+ * block.
+ */
+static usf_error_t
+load_block(usf_file_t *file)
+{
+    usf_error_t error = USF_ERROR_OK;
+    const int columns = file->header->flags & USF_FLAG_COLUMNS;
+    usf_block_header_t bh;
+    const char *data;
+    char **mem = columns ? &file->cols_mem : &file->buf_mem;
+    size_t *size = columns ? &file->cols_size : &file->buf_size;
+    char *raw;
+
+    if (file->pool)
+        return read_parallel(file);
+
+    E_ERROR(read_header(file, &bh));
+
+    E_ERROR(reserve(mem, size, bh.raw_size));
+
+    if (file->io_methods->decompress) {
+        size_t len = bh.raw_size;
+
+        E_ERROR(read_ref(file, bh.data_size, &data));
+        E_ERROR(file->io_methods->decompress(*mem, &len,
+                                             data, bh.data_size));
+        E_IF(len != bh.raw_size, USF_ERROR_FILE);
+        raw = *mem;
+    } else if (file->map) {
+        E_IF(bh.data_size != bh.raw_size, USF_ERROR_FILE);
+        E_ERROR(read_ref(file, bh.data_size, &data));
+        raw = (char *)data;
+    } else {
+        E_IF(bh.data_size != bh.raw_size, USF_ERROR_FILE);
+        error = read_copy(file, *mem, bh.data_size);
+        E_IF(error == USF_ERROR_EOF, USF_ERROR_FILE);
+        E_ERROR(error);
+        raw = *mem;
+    }
+
+    if (columns) {
+        E_ERROR(load_columns(file, raw, bh.raw_size, bh.events));
+    } else {
+        usf_block_begin(file);
+        file->block_events = bh.events;
+        file->buf = raw;
+        file->buf_pos = 0;
+        file->buf_len = bh.raw_size;
+    }
+
+ret_err:
+    return error;
+}
+
+/**
+ * Load the next block into the staging buffer. Returns USF_ERROR_EOF
+ * after the last block.
+ */
+usf_error_t
+usf_block_read(usf_file_t *file)
+{
+    usf_error_t error = USF_ERROR_OK;
+
+    E_ERROR(load_block(file));
+    if (file->header->flags & USF_FLAG_COLUMNS)
+        E_ERROR(usf_block_records(file));
+
+ret_err:
+    return error;
+}
+
+/**
+ * Load the next block of a columnar file without moving it to the
+ * staging buffer. Returns USF_ERROR_EOF after the last block.
+ */
+usf_error_t
+usf_block_read_columns(usf_file_t *file)
+{
+    assert(file->header->flags & USF_FLAG_COLUMNS);
+    return load_block(file);
+}
+
+/**
+ * Move the accesses of the current column block that haven't been
+ * read yet to the staging buffer.
+ */
+usf_error_t
+usf_block_records(usf_file_t *file)
+{
+    usf_error_t error = USF_ERROR_OK;
+    size_t n = file->col_events - file->col_pos;
+
+    assert(file->buf_pos == file->buf_len);
+    E_ERROR(reserve(&file->buf_mem, &file->buf_size,
+                    n * USF_RAW_ACCESS_SIZE));
+    usf_columns_records(file->col, file->buf_mem, file->col_pos, n);
+
+    file->col_pos = file->col_events;
+    file->buf = file->buf_mem;
+    file->buf_pos = 0;
+    file->buf_len = n * USF_RAW_ACCESS_SIZE;
+
+ret_err:
+    return error;
+}
+
+/**
+ * Read size bytes at offset into dst without touching the mapping
+ * position. Moves the I/O position of unmapped files.
+ */
+static usf_error_t
+read_at(usf_file_t *file, uint64_t offset, void *dst, size_t size)
+{
+    if (file->map) {
+        if (offset > file->map_size || file->map_size - offset < size)
+            return USF_ERROR_FILE;
+
+        memcpy(dst, (char *)file->map + offset, size);
+        return USF_ERROR_OK;
+    }
+
+    if (usf_io_seek(file->io, offset) != USF_ERROR_OK)
+        return USF_ERROR_SYS;
+    if (usf_io_read(file->io, dst, size) != size)
+        return usf_io_error(file->io) ? USF_ERROR_SYS : USF_ERROR_FILE;
+
+    return USF_ERROR_OK;
+}
+
+static usf_error_t
+file_size(usf_file_t *file, uint64_t *size)
+{
+    if (file->map) {
+        *size = file->map_size;
+        return USF_ERROR_OK;
+    }
+
+    return usf_io_size(file->io, size) == USF_ERROR_OK ?
+        USF_ERROR_OK : USF_ERROR_UNSUPPORTED;
+}
+
+static usf_error_t
+load_index(usf_file_t *file)
+{
+    usf_error_t error = USF_ERROR_OK;
+    usf_block_trailer_t trailer;
+    usf_block_footer_t footer;
+    uint64_t size, footer_offset, index_size;
+    usf_block_index_t *index = NULL;
+
+    E_ERROR(file_size(file, &size));
+    E_IF(size < file->data_offset + sizeof(trailer), USF_ERROR_FILE);
+    E_ERROR(read_at(file, size - sizeof(trailer), &trailer,
+                    sizeof(trailer)));
+    E_IF(memcmp(trailer.magic, USF_BLOCK_MAGIC, sizeof(trailer.magic)),
+         USF_ERROR_FILE);
+    E_IF(size - sizeof(trailer) - file->data_offset < trailer.footer_size,
+         USF_ERROR_FILE);
+
+    /* Footers written by older versions may be shorter */
+    footer_offset = size - sizeof(trailer) - trailer.footer_size;
+    memset(&footer, 0, sizeof(footer));
+    E_ERROR(read_at(file, footer_offset, &footer,
+                    trailer.footer_size < sizeof(footer) ?
+                    trailer.footer_size : sizeof(footer)));
+
+    E_IF(footer.blocks > (footer_offset - file->data_offset) /
+         sizeof(*index), USF_ERROR_FILE);
+    index_size = footer.blocks * sizeof(*index);
+    E_IF(footer.index_offset < file->data_offset ||
+         footer.index_offset > footer_offset - index_size,
+         USF_ERROR_FILE);
+
+    E_IF(footer.stats_size &&
+         (footer.stats_offset < footer.index_offset + index_size ||
+          footer.stats_offset > footer_offset ||
+          footer.stats_size > footer_offset - footer.stats_offset),
+         USF_ERROR_FILE);
+
+    if (footer.blocks) {
+        E_NULL(index = malloc(index_size), USF_ERROR_MEM);
+        E_ERROR(read_at(file, footer.index_offset, index, index_size));
+        for (uint64_t i = 0; i < footer.blocks; i++) {
+            E_IF(index[i].offset < file->data_offset ||
+                 index[i].offset >= footer.index_offset,
+                 USF_ERROR_FILE);
+        }
+    }
+
+    free(file->index);
+    file->index = index;
+    file->index_len = footer.blocks;
+    file->index_size = footer.blocks;
+    file->stats_offset = footer.stats_offset;
+    file->stats_bytes = footer.stats_size;
+    return USF_ERROR_OK;
+
+ret_err:
+    free(index);
+    return error;
+}
+
+/**
+ * Load the block index of a file opened for reading. Files without
+ * a usable index, e.g. files that were never closed or that can't be
+ * seeked, get an empty index. The read position is left unchanged.
+ */
+usf_error_t
+usf_block_read_index(usf_file_t *file)
+{
+    usf_error_t error;
+    uint64_t pos = 0;
+
+    if (file->index_read)
+        return USF_ERROR_OK;
+
+    if (!file->map)
+        pos = usf_io_tell(file->io);
+    error = load_index(file);
+
+    if (!file->map && usf_io_seek(file->io, pos) != USF_ERROR_OK)
+        return USF_ERROR_SYS;
+
+    switch (error) {
+    case USF_ERROR_OK:
+        break;
+    case USF_ERROR_FILE:
+    case USF_ERROR_UNSUPPORTED:
+        file->index_len = 0;
+        break;
+    default:
+        return error;
+    }
+
+    file->index_read = 1;
+    return USF_ERROR_OK;
+}
+
+static usf_error_t
+load_stats(usf_file_t *file)
+{
+    usf_error_t error = USF_ERROR_OK;
+    const size_t count_size = sizeof(usf_stats_count_t);
+    usf_block_stats_t bs;
+    usf_stats_t *stats = NULL;
+    uint64_t tables;
+
+    E_IF(file->stats_bytes < sizeof(bs), USF_ERROR_FILE);
+    E_ERROR(read_at(file, file->stats_offset, &bs, sizeof(bs)));
+    tables = (file->stats_bytes - sizeof(bs)) / count_size;
+    E_IF(bs.tids > tables || bs.bursts != tables - bs.tids,
+         USF_ERROR_FILE);
+
+    E_NULL(stats = calloc(1, sizeof(*stats)), USF_ERROR_MEM);
+    stats->total = bs.total;
+    stats->min_time = bs.min_time;
+    stats->max_time = bs.max_time;
+    stats->min_addr = bs.min_addr;
+    stats->max_addr = bs.max_addr;
+    memcpy(stats->line_sizes, bs.line_sizes, sizeof(stats->line_sizes));
+    stats->tids = bs.tids;
+    stats->bursts = bs.bursts;
+    if (bs.tids) {
+        E_NULL(stats->tid = malloc(bs.tids * count_size), USF_ERROR_MEM);
+        E_ERROR(read_at(file, file->stats_offset + sizeof(bs), stats->tid,
+                        bs.tids * count_size));
+    }
+    if (bs.bursts) {
+        E_NULL(stats->burst = malloc(bs.bursts * count_size),
+               USF_ERROR_MEM);
+        E_ERROR(read_at(file,
+                        file->stats_offset + sizeof(bs) +
+                        bs.tids * count_size,
+                        stats->burst, bs.bursts * count_size));
+    }
+
+    file->stats = stats;
+    return USF_ERROR_OK;
+
+ret_err:
+    usf_stats_free(stats);
+    return error;
+}
+
+/**
+ * Load the statistics of a file opened for reading, stats is left
+ * NULL if the file has none. The read position is left unchanged.
+ */
+usf_error_t
+usf_block_read_stats(usf_file_t *file)
+{
+    usf_error_t error;
+    uint64_t pos = 0;
+
+    if (file->stats_read)
+        return USF_ERROR_OK;
+
+    if ((error = usf_block_read_index(file)) != USF_ERROR_OK)
+        return error;
+
+    if (file->stats_bytes) {
+        if (!file->map)
+            pos = usf_io_tell(file->io);
+        error = load_stats(file);
+
+        if (!file->map && usf_io_seek(file->io, pos) != USF_ERROR_OK)
+            return USF_ERROR_SYS;
+        if (error != USF_ERROR_OK && error != USF_ERROR_FILE)
+            return error;
+    }
+
+    file->stats_read = 1;
+    return USF_ERROR_OK;
+}
+
+/**
+ * Continue reading at the block starting at offset, first_event is
+ * the ordinal of the first event in that block.
+ */
+usf_error_t
+usf_block_seek(usf_file_t *file, uint64_t offset, uint64_t first_event)
+{
+    /* Discard blocks that are being decompressed */
+    for (; file->jobs_head != file->jobs_tail; file->jobs_head++) {
+        usf_pool_wait(file->pool,
+                      &file->jobs[file->jobs_head % file->jobs_len].job);
+    }
+
+    if (file->map) {
+        if (offset > file->map_size)
+            return USF_ERROR_FILE;
+        file->map_pos = offset;
+    } else if (usf_io_seek(file->io, offset) != USF_ERROR_OK)
+        return USF_ERROR_UNSUPPORTED;
+
+    file->blocks_eof = 0;
+    file->buf_pos = 0;
+    file->buf_len = 0;
+    file->col_events = 0;
+    file->col_pos = 0;
+    file->block_first_event = first_event;
+    file->block_events = 0;
+    file->events = first_event;
+    return USF_ERROR_OK;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2009-2011, Andreas Sandberg
+ * Copyright (C) 2009-2011, David Eklov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef USF_BLOCK_H
+#define USF_BLOCK_H
+
+#include <string.h>
+
+#include "usf_priv.h"
+
+/*
+ * Block container (USF 0.3 and newer)
+ *
+ * The event stream following the header is split into blocks that
+ * can be decoded independently of each other. Each block starts with
+ * a usf_block_header_t followed by data_size bytes of compressed
+ * data that decompress to raw_size bytes of encoded events. No event
+ * crosses a block boundary and the delta compression state is reset
+ * at the start of every block.
+ *
+ * The last block is followed by an empty block header (all fields
+ * 0), the block index (one usf_block_index_t per block), optional
+ * statistics (usf_block_stats_t followed by its tables), the footer
+ * and the trailer. The trailer is always the last thing in the file
+ * and tells the reader where the footer starts. Fields may be added
+ * to the end of the footer, readers treat missing fields as 0.
+ *
+ * Everything is stored in native byte order.
+ */
+
+typedef struct {
+    uint32_t raw_size;
+    uint32_t data_size;
+    uint32_t events;
+    uint32_t reserved;
+} usf_block_header_t;
+
+typedef struct {
+    /* File offset of the block index */
+    uint64_t index_offset;
+    /* Number of entries in the block index */
+    uint64_t blocks;
+    /* File offset and size of the statistics, 0 if there are none */
+    uint64_t stats_offset;
+    uint64_t stats_size;
+} usf_block_footer_t;
+
+/* Statistics, followed by tids usf_stats_count_t per thread and
+ * bursts usf_stats_count_t per burst */
+typedef struct {
+    usf_stats_count_t total;
+    uint64_t min_time;
+    uint64_t max_time;
+    uint64_t min_addr;
+    uint64_t max_addr;
+    uint64_t line_sizes[USF_STATS_LINE_SIZES];
+    uint64_t tids;
+    uint64_t bursts;
+} usf_block_stats_t;
+
+typedef struct {
+    /* Size of the footer preceding the trailer */
+    uint32_t footer_size;
+    char magic[4];
+} usf_block_trailer_t;
+
+#define USF_BLOCK_MAGIC "USFI"
+
+/* Upper limit on the decompressed size of a block, protects readers
+ * from corrupt block headers. */
+#define USF_BLOCK_MAX_SIZE (256 * 1024 * 1024)
+/* Lower limit on the block size requested by writers */
+#define USF_BLOCK_MIN_SIZE (4 * 1024)
+
+usf_error_t usf_block_init_pool(usf_file_t *file, unsigned threads);
+void usf_block_free_pool(usf_file_t *file);
+usf_error_t usf_block_write(usf_file_t *file);
+usf_error_t usf_block_finish(usf_file_t *file);
+usf_error_t usf_block_read(usf_file_t *file);
+usf_error_t usf_block_read_columns(usf_file_t *file);
+usf_error_t usf_block_records(usf_file_t *file);
+usf_error_t usf_block_read_index(usf_file_t *file);
+usf_error_t usf_block_read_stats(usf_file_t *file);
+usf_error_t usf_block_seek(usf_file_t *file, uint64_t offset,
+                           uint64_t first_event);
+
+/** Reset the per-block state, called at the start of every block. */
+static inline void
+usf_block_begin(usf_file_t *file)
+{
+    file->block_first_event += file->block_events;
+    file->block_events = 0;
+    file->block_min_time = (usf_atime_t)-1;
+    file->block_max_time = 0;
+    memset(&file->last_access, 0, sizeof(file->last_access));
+    file->ctx_generation++;
+    if (file->stride)
+        memset(file->stride, 0, USF_STRIDE_SIZE * sizeof(*file->stride));
+    if (file->pcdict_hash && file->pcdict_len)
+        memset(file->pcdict_hash, 0,
+               USF_PCDICT_HASH_SIZE * sizeof(*file->pcdict_hash));
+    file->pcdict_len = 0;
+}
+
+/** Account for an event appended to the current block. */
+static inline void
+usf_block_add_event(usf_file_t *file, usf_atime_t time)
+{
+    file->block_events++;
+    if (time < file->block_min_time)
+        file->block_min_time = time;
+    if (time > file->block_max_time)
+        file->block_max_time = time;
+}
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
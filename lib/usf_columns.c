@@ -0,0 +1,450 @@
+/*
+ * Copyright (C) 2009-2011, Andreas Sandberg
+ * Copyright (C) 2009-2011, David Eklov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <assert.h>
+
+#include "usf_priv.h"
+#include "usf_columns.h"
+#include "usf_simd.h"
+#include "error.h"
+
+/* Values are decoded in chunks of this many values when they are
+ * moved into records */
+#define CHUNK 256
+
+/* Location of the fields in a plain record, in column order */
+static const struct {
+    size_t offset;
+    unsigned size;
+} fields[USF_COLUMNS] = {
+    { 0, sizeof(usf_addr_t) },
+    { 8, sizeof(usf_addr_t) },
+    { 16, sizeof(usf_atime_t) },
+    { 24, sizeof(usf_tid_t) },
+    { 26, sizeof(usf_alen_t) },
+    { 28, sizeof(usf_atype_t) },
+};
+
+static inline uint64_t
+load_value(const char *p, unsigned size)
+{
+    uint8_t v8;
+    uint16_t v16;
+    uint32_t v32;
+    uint64_t v64;
+
+    switch (size) {
+    case 1:
+        memcpy(&v8, p, 1);
+        return v8;
+    case 2:
+        memcpy(&v16, p, 2);
+        return v16;
+    case 4:
+        memcpy(&v32, p, 4);
+        return v32;
+    default:
+        memcpy(&v64, p, 8);
+        return v64;
+    }
+}
+
+static inline void
+store_value(char *p, uint64_t v, unsigned size)
+{
+    uint8_t v8 = (uint8_t)v;
+    uint16_t v16 = (uint16_t)v;
+    uint32_t v32 = (uint32_t)v;
+
+    switch (size) {
+    case 1:
+        memcpy(p, &v8, 1);
+        break;
+    case 2:
+        memcpy(p, &v16, 2);
+        break;
+    case 4:
+        memcpy(p, &v32, 4);
+        break;
+    default:
+        memcpy(p, &v, 8);
+        break;
+    }
+}
+
+/** Sign extend the size byte value v */
+static inline int64_t
+sign_extend(uint64_t v, unsigned size)
+{
+    unsigned shift = 64 - 8 * size;
+
+    return (int64_t)(v << shift) >> shift;
+}
+
+/** Number of bytes needed to store the signed value v */
+static inline unsigned
+delta_width(int64_t v)
+{
+    if (v >= INT8_MIN && v <= INT8_MAX)
+        return 1;
+    else if (v >= INT16_MIN && v <= INT16_MAX)
+        return 2;
+    else if (v >= INT32_MIN && v <= INT32_MAX)
+        return 4;
+    else
+        return 8;
+}
+
+/** Number of bytes of the varint encoding of z */
+static inline unsigned
+varint_len(uint64_t z)
+{
+    return z ? (63 - __builtin_clzll(z)) / 7 + 1 : 1;
+}
+
+/**
+ * Encode the field of size bytes at src in events records into dst,
+ * using the encoding that needs the least space. Returns a pointer
+ * to the end of the column.
+ */
+static char *
+encode_column(char *dst, const char *src, unsigned size, size_t events)
+{
+    const uint64_t mask = size == 8 ? ~0ULL : (1ULL << 8 * size) - 1;
+    usf_column_header_t h;
+    char *cur = dst + sizeof(h);
+    uint64_t prev = 0, step = 0, v;
+    size_t runs = 0, varint_size = 0, seq_size, rle_size, delta_size;
+    unsigned width = 1;
+    int seq = events > 0;
+
+    for (size_t i = 0; i < events; i++) {
+        uint64_t d;
+
+        v = load_value(src + i * USF_RAW_ACCESS_SIZE, size);
+        d = (v - prev) & mask;
+        if (i == 1)
+            step = d;
+        else if (i > 1 && d != step)
+            seq = 0;
+        if (i == 0 || v != prev)
+            runs++;
+        varint_size += varint_len(zigzag(sign_extend(d, size)));
+        if (width < size) {
+            unsigned w = delta_width(sign_extend(d, size));
+            width = w > width ? w : width;
+        }
+        prev = v;
+    }
+
+    seq_size = 2 * sizeof(uint64_t);
+    rle_size = runs * (size + sizeof(uint32_t));
+    delta_size = events * width;
+
+    memset(&h, 0, sizeof(h));
+    if (seq && seq_size <= rle_size && seq_size <= delta_size &&
+        seq_size <= varint_size) {
+        h.encoding = USF_COLUMN_SEQ;
+        h.width = sizeof(uint64_t);
+        v = load_value(src, size);
+        memcpy(cur, &v, sizeof(v));
+        memcpy(cur + sizeof(v), &step, sizeof(step));
+        cur += seq_size;
+    } else if (rle_size <= delta_size && rle_size <= varint_size) {
+        uint32_t run = 0;
+
+        h.encoding = USF_COLUMN_RLE;
+        h.width = size;
+        for (size_t i = 0; i < events; i++) {
+            v = load_value(src + i * USF_RAW_ACCESS_SIZE, size);
+            if (run && v != prev) {
+                memcpy(cur - sizeof(run), &run, sizeof(run));
+                run = 0;
+            }
+            if (!run) {
+                store_value(cur, v, size);
+                cur += size + sizeof(run);
+            }
+            run++;
+            prev = v;
+        }
+        if (run)
+            memcpy(cur - sizeof(run), &run, sizeof(run));
+    } else if (delta_size <= varint_size) {
+        h.encoding = USF_COLUMN_DELTA;
+        h.width = width;
+        prev = 0;
+        for (size_t i = 0; i < events; i++) {
+            v = load_value(src + i * USF_RAW_ACCESS_SIZE, size);
+            store_value(cur, (uint64_t)sign_extend((v - prev) & mask, size),
+                        width);
+            cur += width;
+            prev = v;
+        }
+    } else {
+        h.encoding = USF_COLUMN_VARINT;
+        prev = 0;
+        for (size_t i = 0; i < events; i++) {
+            uint64_t z;
+
+            v = load_value(src + i * USF_RAW_ACCESS_SIZE, size);
+            z = zigzag(sign_extend((v - prev) & mask, size));
+            while (z >= 0x80) {
+                *cur++ = (char)(z | 0x80);
+                z >>= 7;
+            }
+            *cur++ = (char)z;
+            prev = v;
+        }
+    }
+
+    h.size = cur - dst - sizeof(h);
+    memcpy(dst, &h, sizeof(h));
+    return cur;
+}
+
+/**
+ * Convert events plain records to columns. dst must have room for
+ * USF_COLUMNS_BOUND(events) bytes.
+ */
+void
+usf_columns_encode(char *dst, size_t *dst_len,
+                   const char *records, size_t events)
+{
+    char *cur = dst;
+
+    for (int f = 0; f < USF_COLUMNS; f++)
+        cur = encode_column(cur, records + fields[f].offset,
+                            fields[f].size, events);
+
+    *dst_len = cur - dst;
+}
+
+/**
+ * Validate the len bytes of columns at data, holding events
+ * accesses, and prepare to decode them.
+ */
+usf_error_t
+usf_columns_init(usf_column_t *columns,
+                 const char *data, size_t len, size_t events)
+{
+    usf_error_t error = USF_ERROR_OK;
+    const char *end = data + len;
+
+    for (int f = 0; f < USF_COLUMNS; f++) {
+        const unsigned size = fields[f].size;
+        usf_column_t *c = &columns[f];
+        usf_column_header_t h;
+        size_t total = 0;
+
+        E_IF((size_t)(end - data) < sizeof(h), USF_ERROR_FILE);
+        memcpy(&h, data, sizeof(h));
+        data += sizeof(h);
+        E_IF((size_t)(end - data) < h.size, USF_ERROR_FILE);
+
+        memset(c, 0, sizeof(*c));
+        c->encoding = h.encoding;
+        c->width = h.width;
+        c->field_size = size;
+        c->data = data;
+
+        switch (h.encoding) {
+        case USF_COLUMN_SEQ:
+            E_IF(h.size != 2 * sizeof(uint64_t), USF_ERROR_FILE);
+            memcpy(&c->value, data, sizeof(c->value));
+            memcpy(&c->step, data + sizeof(c->value), sizeof(c->step));
+            break;
+
+        case USF_COLUMN_RLE:
+            E_IF(h.width != size || h.size % (size + sizeof(uint32_t)),
+                 USF_ERROR_FILE);
+            /* Runs must add up, the decoder trusts them */
+            for (const char *p = data; p < data + h.size;
+                 p += size + sizeof(uint32_t)) {
+                uint32_t run;
+
+                memcpy(&run, p + size, sizeof(run));
+                E_IF(!run, USF_ERROR_FILE);
+                total += run;
+            }
+            E_IF(total != events, USF_ERROR_FILE);
+            break;
+
+        case USF_COLUMN_DELTA:
+            E_IF((h.width != 1 && h.width != 2 && h.width != 4 &&
+                  h.width != 8) || h.width > size ||
+                 h.size != events * h.width, USF_ERROR_FILE);
+            break;
+
+        case USF_COLUMN_VARINT: {
+            const unsigned char *p = (const unsigned char *)data;
+            unsigned len = 0;
+
+            E_IF(h.width, USF_ERROR_FILE);
+            /* Every value must end within the column and fit in 64
+             * bits, the decoder doesn't check */
+            for (uint32_t i = 0; i < h.size; i++) {
+                if (p[i] & 0x80) {
+                    len++;
+                    E_IF(len > 9, USF_ERROR_FILE);
+                } else {
+                    len = 0;
+                    total++;
+                }
+            }
+            E_IF(len || total != events, USF_ERROR_FILE);
+            break;
+        }
+
+        default:
+            E_ERROR(USF_ERROR_FILE);
+        }
+
+        data += h.size;
+    }
+
+    E_IF(data != end, USF_ERROR_FILE);
+
+ret_err:
+    return error;
+}
+
+/**
+ * Decode the next n values of a column into values, or skip them if
+ * values is NULL. Only the low field size bytes of the values are
+ * significant.
+ */
+void
+usf_column_read(usf_column_t *c, uint64_t *values, size_t n)
+{
+    switch (c->encoding) {
+    case USF_COLUMN_SEQ:
+        for (size_t i = 0; values && i < n; i++)
+            values[i] = c->value + (c->pos + i) * c->step;
+        break;
+
+    case USF_COLUMN_RLE:
+        for (size_t i = 0; i < n;) {
+            size_t k;
+
+            if (!c->run) {
+                c->value = load_value(c->data, c->field_size);
+                memcpy(&c->run, c->data + c->field_size, sizeof(c->run));
+                c->data += c->field_size + sizeof(c->run);
+            }
+
+            k = n - i < c->run ? n - i : c->run;
+            for (size_t j = 0; values && j < k; j++)
+                values[i + j] = c->value;
+            c->run -= k;
+            i += k;
+        }
+        break;
+
+    case USF_COLUMN_DELTA: {
+        const usf_simd_kernels_t *k = usf_simd_best();
+        const int w = USF_SIMD_WIDTH_INDEX(c->width);
+
+        if (values)
+            c->value = k->prefix_sum[w](values, c->data, n, c->value);
+        else
+            c->value = k->sum[w](c->data, n, c->value);
+        c->data += n * c->width;
+        break;
+    }
+
+    case USF_COLUMN_VARINT: {
+        const unsigned char *p = (const unsigned char *)c->data;
+
+        for (size_t i = 0; i < n; i++) {
+            uint64_t z = 0;
+            unsigned shift = 0;
+
+            while (*p & 0x80) {
+                z |= (uint64_t)(*p++ & 0x7f) << shift;
+                shift += 7;
+            }
+            z |= (uint64_t)*p++ << shift;
+            c->value += unzigzag(z);
+            if (values)
+                values[i] = c->value;
+        }
+        c->data = (const char *)p;
+        break;
+    }
+    }
+
+    c->pos += n;
+}
+
+/** Skip values up to value pos of a column */
+void
+usf_column_skip(usf_column_t *c, size_t pos)
+{
+    assert(c->pos <= pos);
+    if (c->pos < pos)
+        usf_column_read(c, NULL, pos - c->pos);
+}
+
+/**
+ * Decode n accesses starting at access pos into plain records. The
+ * columns must not have been decoded beyond pos.
+ */
+void
+usf_columns_records(usf_column_t *columns, char *records,
+                    size_t pos, size_t n)
+{
+    uint64_t values[CHUNK];
+
+    for (int f = 0; f < USF_COLUMNS; f++) {
+        usf_column_t *c = &columns[f];
+        char *dst = records + fields[f].offset;
+
+        usf_column_skip(c, pos);
+        for (size_t i = 0; i < n; i += CHUNK) {
+            size_t k = n - i < CHUNK ? n - i : CHUNK;
+
+            usf_column_read(c, values, k);
+            for (size_t j = 0; j < k; j++, dst += USF_RAW_ACCESS_SIZE)
+                store_value(dst, values[j], fields[f].size);
+        }
+    }
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
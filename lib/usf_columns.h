@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2009-2011, Andreas Sandberg
+ * Copyright (C) 2009-2011, David Eklov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef USF_COLUMNS_H
+#define USF_COLUMNS_H
+
+#include "usf_priv.h"
+
+/*
+ * Columnar trace blocks (USF_FLAG_COLUMNS)
+ *
+ * Blocks in files with USF_FLAG_COLUMNS store every field of the
+ * accesses in the block as a column of its own instead of storing
+ * one record per access. The columns follow each other in field
+ * order, pc, addr, time, tid, len and type, each preceded by a
+ * usf_column_header_t. A column uses one of these encodings:
+ *
+ *   USF_COLUMN_SEQ    An arithmetic sequence, the first value and
+ *                     the step as two 64-bit values.
+ *   USF_COLUMN_RLE    Runs of equal values, one field sized value
+ *                     followed by a 32-bit run length per run.
+ *   USF_COLUMN_DELTA  The difference to the previous value (0 before
+ *                     the first value) of every value, stored as
+ *                     signed width byte integers.
+ *   USF_COLUMN_VARINT The same differences, zigzag encoded and stored
+ *                     as LEB128 varints (7 bits per byte, the high
+ *                     bit set on all but the last byte). The width
+ *                     is 0.
+ *
+ * Fixed width deltas are decoded with the SIMD kernels, but a single
+ * large jump widens every value of the column. Writers use varints
+ * whenever they are smaller.
+ *
+ * Value arithmetic wraps at the size of the field. Writers stage
+ * plain records and convert them to columns when a block is
+ * compressed. Readers convert blocks back to records on demand,
+ * columns read with usf_read_columns() are decoded straight from the
+ * block and columns that aren't read aren't decoded at all.
+ */
+
+typedef struct {
+    uint8_t encoding;
+    /* Size of the values in the column data */
+    uint8_t width;
+    uint16_t reserved;
+    /* Size of the column data following the header */
+    uint32_t size;
+} usf_column_header_t;
+
+enum {
+    USF_COLUMN_SEQ = 0,
+    USF_COLUMN_RLE,
+    USF_COLUMN_DELTA,
+    USF_COLUMN_VARINT,
+};
+
+/* Upper limit on the size of the columns of events accesses */
+#define USF_COLUMNS_BOUND(events)                               \
+    ((events) * USF_RAW_ACCESS_SIZE + USF_COLUMNS_OVERHEAD)
+
+/* Column headers added on top of the plain records */
+#define USF_COLUMNS_OVERHEAD (USF_COLUMNS * sizeof(usf_column_header_t))
+
+void usf_columns_encode(char *dst, size_t *dst_len,
+                        const char *records, size_t events);
+usf_error_t usf_columns_init(usf_column_t *columns,
+                             const char *data, size_t len, size_t events);
+void usf_column_read(usf_column_t *column, uint64_t *values, size_t n);
+void usf_column_skip(usf_column_t *column, size_t pos);
+void usf_columns_records(usf_column_t *columns, char *records,
+                         size_t pos, size_t n);
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
@@ -30,16 +30,27 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "usf_priv.h"
 #include "usf_internal.h"
+#include "usf_block.h"
+#include "usf_columns.h"
+#include "usf_events.h"
+#include "usf_prefetch.h"
+#include "usf_stats.h"
 #include "error.h"
 
-typedef struct {
-    usf_error_t (*write)(usf_file_t *file, const usf_event_t *event);
-    usf_error_t (*read)(usf_file_t *file, usf_event_t *event);
-} event_io_t;
+/* The encoders and decoders below take the file flags as an argument
+ * and are instantiated with constant flags by the specialized event
+ * readers and writers, see usf_events_select(). Forcing them inline
+ * makes sure the flag tests are resolved at compile time. */
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+/* Number of event types */
+#define EVENT_TYPES (USF_EVENT_TRACE + 1)
 
 
 /* ********************************************************************** */
@@ -50,46 +61,69 @@ typedef struct {
 			 sizeof(usf_alen_t) +   \
 			 sizeof(usf_atype_t))
 
+/* Worst case size of an encoded access, i.e. a varint delta access
+ * with two control bytes and full size fields. */
+#define MAX_LEN_ACCESS (DATA_LEN_ACCESS + 2)
+
+/* The varint encoder stores whole 64-bit words and may write up to
+ * this many bytes past the end of an access. */
+#define VARINT_SLACK 8
+
+/* Worst case size of an encoded event, i.e. a sample with two worst
+ * case accesses, including scratch space for the encoder. */
+#define MAX_LEN_EVENT (sizeof(usf_event_type_t) +        \
+                       2 * MAX_LEN_ACCESS +              \
+                       sizeof(usf_line_size_2_t) +       \
+                       VARINT_SLACK)
+
+#define ENCODE_RAW(buf, val)                    \
+    do {                                        \
+        memcpy(*(buf), &(val), sizeof(val));    \
+        *(buf) += sizeof(val);                  \
+    } while (0)
+
 #define D_DELTA_pc (1 << 0)
 #define D_DELTA_addr (1 << 1)
 #define D_DELTA_time (1 << 2)
+#define D_PRED_addr (1 << 3)
 
 #define D_CONST_tid (1 << 4)
 #define D_CONST_len (1 << 5)
 #define D_CONST_type (1 << 6)
+#define D_DICT_pc (1 << 7)
 
-#define PACK_UINT64(file, flags, buf, a, field)                         \
+#define PACK_UINT64(ctx, flags, buf, a, field)                         \
     pack_uint64(flags, buf,                                             \
-		&file->last_access.field, a->field, D_DELTA_ ## field)
+		&(ctx)->field, a->field, D_DELTA_ ## field)
 
-#define PACK_UINT16(file, flags, buf, a, field)                         \
+#define PACK_UINT16(ctx, flags, buf, a, field)                         \
     pack_uint16(flags, buf,                                             \
-		&file->last_access.field, a->field, D_CONST_ ## field)
+		&(ctx)->field, a->field, D_CONST_ ## field)
 
-#define PACK_UINT8(file, flags, buf, a, field)                          \
+#define PACK_UINT8(ctx, flags, buf, a, field)                          \
     pack_uint8(flags, buf,                                              \
-               &file->last_access.field, a->field, D_CONST_ ## field)
+               &(ctx)->field, a->field, D_CONST_ ## field)
 
 
-#define UNPACK_UINT64(file, flags, buf, a, field)			\
+#define UNPACK_UINT64(ctx, flags, buf, a, field)			\
     (a->field = unpack_uint64(flags, buf,				\
-			      &file->last_access.field, D_DELTA_ ## field))
+			      &(ctx)->field, D_DELTA_ ## field))
 
-#define UNPACK_UINT16(file, flags, buf, a, field)			\
+#define UNPACK_UINT16(ctx, flags, buf, a, field)			\
     (a->field = unpack_uint16(flags, buf,				\
-			      &file->last_access.field, D_CONST_ ## field))
+			      &(ctx)->field, D_CONST_ ## field))
 
-#define UNPACK_UINT8(file, flags, buf, a, field)			\
+#define UNPACK_UINT8(ctx, flags, buf, a, field)			\
     (a->field = unpack_uint8(flags, buf,				\
-			     &file->last_access.field, D_CONST_ ## field))
+			     &(ctx)->field, D_CONST_ ## field))
 
 static inline size_t
 delta_data_size(uint8_t flags)
 {
     size_t s = 0;
 
-    s += flags & D_DELTA_pc ? 1 : 8;
-    s += flags & D_DELTA_addr ? 1 : 8;
+    s += flags & D_DELTA_pc ? 1 : flags & D_DICT_pc ? 2 : 8;
+    s += flags & D_PRED_addr ? 0 : flags & D_DELTA_addr ? 1 : 8;
     s += flags & D_DELTA_time ? 1 : 8;
 
     s += flags & D_CONST_tid ? 0 : 2;
@@ -177,87 +211,652 @@ unpack_uint8(char flags, char **buf, uint8_t *ref, uint8_t flag)
     return *ref;
 }
 
+/*
+ * Delta contexts
+ *
+ * Deltas are normally computed against the previous access in the
+ * file. With USF_FLAG_TID_CONTEXT, pc, addr, len and type are instead
+ * computed against the previous access of the same thread, while
+ * time and tid are still computed against the previous access in the
+ * file. Decoders find the tid first, it is stored after the pc, addr
+ * and time fields whose sizes are known from the flags.
+ */
+
+/** Make sure that there is a context for tid */
 static usf_error_t
-write_access(usf_file_t *file, const usf_access_t *a)
+grow_contexts(usf_file_t *file, usf_tid_t tid)
+{
+    usf_delta_ctx_t *ctx;
+    size_t len;
+
+    if (tid < file->ctx_len)
+        return USF_ERROR_OK;
+
+    len = file->ctx_len ? file->ctx_len : 16;
+    while (len <= tid)
+        len *= 2;
+
+    ctx = realloc(file->ctx, len * sizeof(*ctx));
+    if (!ctx)
+        return USF_ERROR_MEM;
+
+    /* Generation 0 is never current, new contexts start out stale */
+    memset(ctx + file->ctx_len, 0, (len - file->ctx_len) * sizeof(*ctx));
+    file->ctx = ctx;
+    file->ctx_len = len;
+    return USF_ERROR_OK;
+}
+
+/**
+ * Get the context used for the pc, addr, len and type of an access
+ * by tid. The context must exist if per-thread contexts are used.
+ */
+static ALWAYS_INLINE usf_access_t *
+delta_context(usf_file_t *file, usf_tid_t tid, const usf_flags_t file_flags)
+{
+    usf_delta_ctx_t *ctx;
+
+    if (!(file_flags & USF_FLAG_TID_CONTEXT))
+        return &file->last_access;
+
+    assert(tid < file->ctx_len);
+    ctx = &file->ctx[tid];
+    if (file->undo_enabled) {
+        assert(file->ctx_undo_len < ARRAY_LEN(file->ctx_undo));
+        file->ctx_undo_tid[file->ctx_undo_len] = tid;
+        file->ctx_undo[file->ctx_undo_len++] = *ctx;
+    }
+
+    if (ctx->generation != file->ctx_generation) {
+        memset(&ctx->last, 0, sizeof(ctx->last));
+        ctx->generation = file->ctx_generation;
+    }
+
+    return &ctx->last;
+}
+
+/*
+ * Address prediction
+ *
+ * With USF_FLAG_STRIDE, every pc remembers the last address it
+ * accessed and the stride between its last two addresses. Accesses
+ * whose address is the last address plus the stride are stored as
+ * predicted, without an address field. The pc must be decoded before
+ * the address. Mispredicted addresses are delta coded as usual and
+ * the delta reference is updated either way.
+ */
+
+static inline usf_stride_t *
+stride_entry(usf_file_t *file, usf_addr_t pc)
+{
+    size_t i = (size_t)((pc * 0x9e3779b97f4a7c15ULL) >> 52);
+
+    if (file->undo_enabled) {
+        assert(file->stride_undo_len < ARRAY_LEN(file->stride_undo));
+        file->stride_undo_idx[file->stride_undo_len] = i;
+        file->stride_undo[file->stride_undo_len++] = file->stride[i];
+    }
+
+    return &file->stride[i];
+}
+
+/* Returns 1 and the predicted address if there is a prediction */
+static inline int
+stride_predict(const usf_stride_t *e, usf_addr_t pc, usf_addr_t *addr)
+{
+    *addr = e->addr + e->stride;
+    return e->pc == pc;
+}
+
+static inline void
+stride_update(usf_stride_t *e, usf_addr_t pc, usf_addr_t addr)
+{
+    if (e->pc == pc) {
+        e->stride = addr - e->addr;
+    } else {
+        e->pc = pc;
+        e->stride = 0;
+    }
+    e->addr = addr;
+}
+
+/*
+ * PC dictionary
+ *
+ * With USF_FLAG_PC_DICT, pcs are stored as indexes into a dictionary
+ * of the pcs seen so far in the block, in order of first use. A pc
+ * that isn't in the dictionary is stored in full and appended to it,
+ * as long as there is room for it. The dictionary only grows within
+ * a block, so the indexes of hot pcs are stable and compress well.
+ */
+
+/** Find the hash slot of pc, or the empty slot where it belongs */
+static inline size_t
+pcdict_slot(const usf_file_t *file, usf_addr_t pc)
+{
+    size_t i = (size_t)((pc * 0x9e3779b97f4a7c15ULL) >>
+                        (64 - USF_PCDICT_HASH_BITS));
+    uint32_t v;
+
+    while ((v = file->pcdict_hash[i]) && file->pcdict[v - 1] != pc)
+        i = (i + 1) & (USF_PCDICT_HASH_SIZE - 1);
+
+    return i;
+}
+
+/** Returns the index of pc, or -1 after adding it if it is new */
+static inline long
+pcdict_encode(usf_file_t *file, usf_addr_t pc)
+{
+    size_t slot = pcdict_slot(file, pc);
+
+    if (file->pcdict_hash[slot])
+        return file->pcdict_hash[slot] - 1;
+
+    if (file->pcdict_len < USF_PCDICT_SIZE) {
+        file->pcdict[file->pcdict_len++] = pc;
+        file->pcdict_hash[slot] = file->pcdict_len;
+    }
+    return -1;
+}
+
+static inline void
+pcdict_add(usf_file_t *file, usf_addr_t pc)
+{
+    if (file->pcdict_len < USF_PCDICT_SIZE)
+        file->pcdict[file->pcdict_len++] = pc;
+}
+
+static inline usf_error_t
+pcdict_decode(const usf_file_t *file, uint64_t i, usf_addr_t *pc)
+{
+    if (i >= file->pcdict_len)
+        return USF_ERROR_FILE;
+
+    *pc = file->pcdict[i];
+    return USF_ERROR_OK;
+}
+
+/*
+ * In the plain delta encoding, dictionary indexes below 256 are
+ * stored in one byte and flagged with D_DELTA_pc, larger indexes are
+ * stored in two bytes and flagged with D_DICT_pc. Unflagged pcs are
+ * new to the dictionary.
+ */
+
+static inline void
+pack_pc_dict(usf_file_t *file, char *flags, char **buf, usf_addr_t pc)
+{
+    long i = pcdict_encode(file, pc);
+
+    if (i < 0) {
+        *((uint64_t *)*buf) = pc;
+        *buf += 8;
+    } else if (i <= UINT8_MAX) {
+        *flags |= D_DELTA_pc;
+        *((uint8_t *)*buf) = (uint8_t)i;
+        *buf += 1;
+    } else {
+        *flags |= D_DICT_pc;
+        *((uint16_t *)*buf) = (uint16_t)i;
+        *buf += 2;
+    }
+}
+
+static inline usf_error_t
+unpack_pc_dict(usf_file_t *file, char flags, char **buf, usf_addr_t *pc)
+{
+    if (flags & D_DELTA_pc) {
+        *buf += 1;
+        return pcdict_decode(file, *((uint8_t *)*buf - 1), pc);
+    } else if (flags & D_DICT_pc) {
+        *buf += 2;
+        return pcdict_decode(file, *((uint16_t *)(*buf - 2)), pc);
+    } else {
+        *pc = *((uint64_t *)*buf);
+        *buf += 8;
+        pcdict_add(file, *pc);
+        return USF_ERROR_OK;
+    }
+}
+
+/** Allocate the contexts needed to encode event */
+static usf_error_t
+grow_contexts_event(usf_file_t *file, const usf_event_t *event)
 {
     usf_error_t error = USF_ERROR_OK;
 
-    if (file->header->flags & USF_FLAG_DELTA) {
-	char buf[DATA_LEN_ACCESS + 1];
-	char *cur = buf + 1;
-	*buf = 0;
-	PACK_UINT64(file, buf, &cur, a, pc);
-	PACK_UINT64(file, buf, &cur, a, addr);
-	PACK_UINT64(file, buf, &cur, a, time);
-
-	PACK_UINT16(file, buf, &cur, a, tid);
-	PACK_UINT16(file, buf, &cur, a, len);
-	PACK_UINT8(file, buf, &cur, a, type);
-        
-        E_ERROR(usf_internal_write(file, (const void *)buf, cur - buf));
-    } else
-        E_ERROR(usf_internal_write(file, (const void *)a, DATA_LEN_ACCESS));
+    switch (event->type) {
+    case USF_EVENT_SAMPLE:
+        E_ERROR(grow_contexts(file, event->u.sample.begin.tid));
+        E_ERROR(grow_contexts(file, event->u.sample.end.tid));
+        break;
+    case USF_EVENT_DANGLING:
+        E_ERROR(grow_contexts(file, event->u.dangling.begin.tid));
+        break;
+    case USF_EVENT_TRACE:
+        E_ERROR(grow_contexts(file, event->u.trace.access.tid));
+        break;
+    default:
+        break;
+    }
 
 ret_err:
     return error;
 }
 
-static usf_error_t
-read_access(usf_file_t *file, usf_access_t *a)
+static ALWAYS_INLINE void
+encode_access_delta(usf_file_t *file, char **buf, const usf_access_t *a,
+                    const usf_flags_t file_flags)
 {
-    usf_error_t error = USF_ERROR_OK;
+    usf_access_t *ctx = delta_context(file, a->tid, file_flags);
+    char *flags = *buf;
+    char *cur = *buf + 1;
+
+    *flags = 0;
+    if (file_flags & USF_FLAG_PC_DICT) {
+        pack_pc_dict(file, flags, &cur, a->pc);
+        ctx->pc = a->pc;
+    } else
+        PACK_UINT64(ctx, flags, &cur, a, pc);
+    if (file_flags & USF_FLAG_STRIDE) {
+        usf_stride_t *e = stride_entry(file, a->pc);
+        usf_addr_t pred;
+
+        if (stride_predict(e, a->pc, &pred) && pred == a->addr) {
+            *flags |= D_PRED_addr;
+            ctx->addr = a->addr;
+        } else
+            PACK_UINT64(ctx, flags, &cur, a, addr);
+        stride_update(e, a->pc, a->addr);
+    } else
+        PACK_UINT64(ctx, flags, &cur, a, addr);
+    PACK_UINT64(&file->last_access, flags, &cur, a, time);
+
+    PACK_UINT16(&file->last_access, flags, &cur, a, tid);
+    PACK_UINT16(ctx, flags, &cur, a, len);
+    PACK_UINT8(ctx, flags, &cur, a, type);
+
+    *buf = cur;
+}
+
+/*
+ * Varint delta encoding (USF_FLAG_DELTA | USF_FLAG_VARINT)
+ *
+ * The pc, addr and time deltas are zigzag encoded and stored as 0-8
+ * little endian bytes, just enough to hold the value. A zero delta
+ * takes no space at all. Two control bytes precede the values:
+ *
+ *   byte 0: bits 0-3 length of the pc delta, bits 4-7 length of the
+ *           addr delta
+ *   byte 1: bits 0-3 length of the time delta, bits 4-6 D_CONST_*
+ *           flags, bit 7 set if the address was predicted (see
+ *           USF_FLAG_STRIDE), the addr length is 0 then
+ *
+ * tid, len and type are stored like in the plain delta encoding.
+ *
+ * With USF_FLAG_PC_DICT, the pc length is the length of its
+ * dictionary index instead, which isn't zigzag encoded. Pcs new to
+ * the dictionary have length VARINT_NEW_pc and are stored in full.
+ */
+
+#define VARINT_LEN_MAX 8
+#define VARINT_PRED_addr (1 << 7)
+#define VARINT_NEW_pc 0xf
+
+/* Number of data bytes described by control byte 0 and 1
+ * respectively, VARINT_INVALID for malformed control bytes. Generated
+ * from the layout above. */
+#define VARINT_INVALID 255
+
+static const uint8_t varint_size0[256] = {
+     0,  1,  2,  3,  4,  5,  6,  7,  8,255,255,255,255,255,255,  8,
+     1,  2,  3,  4,  5,  6,  7,  8,  9,255,255,255,255,255,255,  9,
+     2,  3,  4,  5,  6,  7,  8,  9, 10,255,255,255,255,255,255, 10,
+     3,  4,  5,  6,  7,  8,  9, 10, 11,255,255,255,255,255,255, 11,
+     4,  5,  6,  7,  8,  9, 10, 11, 12,255,255,255,255,255,255, 12,
+     5,  6,  7,  8,  9, 10, 11, 12, 13,255,255,255,255,255,255, 13,
+     6,  7,  8,  9, 10, 11, 12, 13, 14,255,255,255,255,255,255, 14,
+     7,  8,  9, 10, 11, 12, 13, 14, 15,255,255,255,255,255,255, 15,
+     8,  9, 10, 11, 12, 13, 14, 15, 16,255,255,255,255,255,255, 16,
+   255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+   255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+   255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+   255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+   255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+   255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+   255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,255,
+};
+
+static const uint8_t varint_size1[256] = {
+     5,  6,  7,  8,  9, 10, 11, 12, 13,255,255,255,255,255,255,255,
+     3,  4,  5,  6,  7,  8,  9, 10, 11,255,255,255,255,255,255,255,
+     3,  4,  5,  6,  7,  8,  9, 10, 11,255,255,255,255,255,255,255,
+     1,  2,  3,  4,  5,  6,  7,  8,  9,255,255,255,255,255,255,255,
+     4,  5,  6,  7,  8,  9, 10, 11, 12,255,255,255,255,255,255,255,
+     2,  3,  4,  5,  6,  7,  8,  9, 10,255,255,255,255,255,255,255,
+     2,  3,  4,  5,  6,  7,  8,  9, 10,255,255,255,255,255,255,255,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,255,255,255,255,255,255,255,
+     5,  6,  7,  8,  9, 10, 11, 12, 13,255,255,255,255,255,255,255,
+     3,  4,  5,  6,  7,  8,  9, 10, 11,255,255,255,255,255,255,255,
+     3,  4,  5,  6,  7,  8,  9, 10, 11,255,255,255,255,255,255,255,
+     1,  2,  3,  4,  5,  6,  7,  8,  9,255,255,255,255,255,255,255,
+     4,  5,  6,  7,  8,  9, 10, 11, 12,255,255,255,255,255,255,255,
+     2,  3,  4,  5,  6,  7,  8,  9, 10,255,255,255,255,255,255,255,
+     2,  3,  4,  5,  6,  7,  8,  9, 10,255,255,255,255,255,255,255,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,255,255,255,255,255,255,255,
+};
+
+static const uint64_t varint_mask[VARINT_LEN_MAX + 1] = {
+    0,
+    0xffULL,
+    0xffffULL,
+    0xffffffULL,
+    0xffffffffULL,
+    0xffffffffffULL,
+    0xffffffffffffULL,
+    0xffffffffffffffULL,
+    0xffffffffffffffffULL,
+};
+
+/* Store the len = 0-8 bytes needed to hold z, returns len */
+static inline unsigned
+store_varint(char **buf, uint64_t z)
+{
+    unsigned len = z ? (71 - __builtin_clzll(z)) / 8 : 0;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(*buf, &z, sizeof(z));
+#else
+    for (unsigned i = 0; i < len; i++)
+        (*buf)[i] = (char)(z >> (8 * i));
+#endif
+    *buf += len;
+
+    return len;
+}
+
+/* wide is set if it is safe to load 8 bytes from *buf */
+static inline uint64_t
+load_varint(char **buf, unsigned len, int wide)
+{
+    const unsigned char *p = (const unsigned char *)*buf;
+    uint64_t z = 0;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (wide) {
+        memcpy(&z, p, sizeof(z));
+        z &= varint_mask[len];
+    } else
+#endif
+    {
+        for (unsigned i = 0; i < len; i++)
+            z |= (uint64_t)p[i] << (8 * i);
+    }
+
+    *buf += len;
+    return z;
+}
+
+static inline unsigned
+pack_varint(char **buf, uint64_t *ref, uint64_t val)
+{
+    unsigned len = store_varint(buf, zigzag(val - *ref));
 
-    if (file->header->flags & USF_FLAG_DELTA) {
-	char buf[DATA_LEN_ACCESS + 1];
-	char *cur = buf + 1;
-	size_t size;
+    *ref = val;
+    return len;
+}
+
+static inline uint64_t
+unpack_varint(char **buf, uint64_t *ref, unsigned len, int wide)
+{
+    *ref += unzigzag(load_varint(buf, len, wide));
+    return *ref;
+}
+
+static ALWAYS_INLINE void
+encode_access_varint(usf_file_t *file, char **buf, const usf_access_t *a,
+                     const usf_flags_t file_flags)
+{
+    usf_access_t *ctx = delta_context(file, a->tid, file_flags);
+    char *ctl = *buf;
+    char *cur = *buf + 2;
+    unsigned pc, addr;
+    int hit = 0;
+
+    if (file_flags & USF_FLAG_PC_DICT) {
+        long i = pcdict_encode(file, a->pc);
+
+        if (i < 0) {
+            memcpy(cur, &a->pc, sizeof(a->pc));
+            cur += sizeof(a->pc);
+            pc = VARINT_NEW_pc;
+        } else
+            pc = store_varint(&cur, (uint64_t)i);
+        ctx->pc = a->pc;
+    } else
+        pc = pack_varint(&cur, &ctx->pc, a->pc);
+    if (file_flags & USF_FLAG_STRIDE) {
+        usf_stride_t *e = stride_entry(file, a->pc);
+        usf_addr_t pred;
+
+        hit = stride_predict(e, a->pc, &pred) && pred == a->addr;
+        if (hit) {
+            addr = 0;
+            ctx->addr = a->addr;
+        } else
+            addr = pack_varint(&cur, &ctx->addr, a->addr);
+        stride_update(e, a->pc, a->addr);
+    } else
+        addr = pack_varint(&cur, &ctx->addr, a->addr);
+    ctl[0] = (char)(pc | addr << 4);
+    ctl[1] = (char)(pack_varint(&cur, &file->last_access.time, a->time) |
+                    (hit ? VARINT_PRED_addr : 0));
+
+    PACK_UINT16(&file->last_access, &ctl[1], &cur, a, tid);
+    PACK_UINT16(ctx, &ctl[1], &cur, a, len);
+    PACK_UINT8(ctx, &ctl[1], &cur, a, type);
 
-	E_ERROR(usf_internal_read(file, (void *)buf, 1));
+    *buf = cur;
+}
 
-	size = delta_data_size(*buf);
-	E_ERROR(usf_internal_read(file, (void *)cur, size));
+static ALWAYS_INLINE void
+encode_access_plain(char **buf, const usf_access_t *a)
+{
+    memcpy(*buf, a, DATA_LEN_ACCESS);
+    *buf += DATA_LEN_ACCESS;
+}
 
-	UNPACK_UINT64(file, *buf, &cur, a, pc);
-	UNPACK_UINT64(file, *buf, &cur, a, addr);
-	UNPACK_UINT64(file, *buf, &cur, a, time);
+static ALWAYS_INLINE void
+encode_access(usf_file_t *file, char **buf, const usf_access_t *a,
+              const usf_flags_t file_flags)
+{
+    if (file_flags & USF_FLAG_VARINT)
+        encode_access_varint(file, buf, a, file_flags);
+    else if (file_flags & USF_FLAG_DELTA)
+        encode_access_delta(file, buf, a, file_flags);
+    else
+        encode_access_plain(buf, a);
+}
 
-	UNPACK_UINT16(file, *buf, &cur, a, tid);
-	UNPACK_UINT16(file, *buf, &cur, a, len);
-	UNPACK_UINT8(file, *buf, &cur, a, type);
+static ALWAYS_INLINE usf_error_t
+read_access_delta(usf_file_t *file, usf_access_t *a,
+                  const usf_flags_t file_flags)
+{
+    usf_error_t error = USF_ERROR_OK;
+    usf_access_t *ctx;
+    char *buf;
+    char *cur;
+    size_t size;
+
+    /* Decode straight from the staging buffer, the first byte tells
+     * us how large the record is. */
+    E_ERROR(usf_internal_peek(file, 1, &buf));
+    size = 1 + delta_data_size(*buf);
+    E_ERROR(usf_internal_peek(file, size, &buf));
+    cur = buf + 1;
+
+    if (file_flags & USF_FLAG_TID_CONTEXT) {
+        usf_tid_t tid = file->last_access.tid;
+
+        if (!(*buf & D_CONST_tid))
+            memcpy(&tid, buf + size - 2 -
+                   (*buf & D_CONST_len ? 0 : 2) -
+                   (*buf & D_CONST_type ? 0 : 1), sizeof(tid));
+        E_ERROR(grow_contexts(file, tid));
+        ctx = delta_context(file, tid, file_flags);
     } else
-        E_ERROR(usf_internal_read(file, (void *)a, DATA_LEN_ACCESS));
+        ctx = &file->last_access;
+
+    if (file_flags & USF_FLAG_PC_DICT) {
+        E_IF((*buf & D_DELTA_pc) && (*buf & D_DICT_pc), USF_ERROR_FILE);
+        E_ERROR(unpack_pc_dict(file, *buf, &cur, &a->pc));
+        ctx->pc = a->pc;
+    } else {
+        E_IF(*buf & D_DICT_pc, USF_ERROR_FILE);
+        UNPACK_UINT64(ctx, *buf, &cur, a, pc);
+    }
+    if (file_flags & USF_FLAG_STRIDE) {
+        usf_stride_t *e = stride_entry(file, a->pc);
+
+        if (*buf & D_PRED_addr) {
+            E_IF(!stride_predict(e, a->pc, &a->addr), USF_ERROR_FILE);
+            ctx->addr = a->addr;
+        } else
+            UNPACK_UINT64(ctx, *buf, &cur, a, addr);
+        stride_update(e, a->pc, a->addr);
+    } else {
+        E_IF(*buf & D_PRED_addr, USF_ERROR_FILE);
+        UNPACK_UINT64(ctx, *buf, &cur, a, addr);
+    }
+    UNPACK_UINT64(&file->last_access, *buf, &cur, a, time);
+
+    UNPACK_UINT16(&file->last_access, *buf, &cur, a, tid);
+    UNPACK_UINT16(ctx, *buf, &cur, a, len);
+    UNPACK_UINT8(ctx, *buf, &cur, a, type);
+
+    usf_internal_consume(file, size);
 
 ret_err:
     return error;
 }
 
-/* ********************************************************************** */
-
-static usf_error_t
-write_sample(usf_file_t *file, const usf_event_t *event)
+static ALWAYS_INLINE usf_error_t
+read_access_varint(usf_file_t *file, usf_access_t *a,
+                   const usf_flags_t file_flags)
 {
     usf_error_t error = USF_ERROR_OK;
-    const usf_event_sample_t *s = &event->u.sample;
-    assert(event->type == USF_EVENT_SAMPLE);
+    unsigned len_pc, len_addr, len_time;
+    unsigned size0, size1;
+    usf_access_t *ctx;
+    char *buf;
+    char *cur;
+    size_t size;
+    int wide;
+
+    E_ERROR(usf_internal_peek(file, 2, &buf));
+    size0 = varint_size0[(uint8_t)buf[0]];
+    size1 = varint_size1[(uint8_t)buf[1]];
+    E_IF(size0 == VARINT_INVALID || size1 == VARINT_INVALID,
+         USF_ERROR_FILE);
+
+    size = 2 + size0 + size1;
+    E_ERROR(usf_internal_peek(file, size, &buf));
+    len_pc = buf[0] & 0xf;
+    len_addr = (buf[0] >> 4) & 0xf;
+    len_time = buf[1] & 0xf;
+    cur = buf + 2;
+    /* Whole words may be loaded unless we are at the very end of
+     * the staging buffer */
+    wide = file->buf_len - file->buf_pos >= size + sizeof(uint64_t);
+
+    if (file_flags & USF_FLAG_TID_CONTEXT) {
+        usf_tid_t tid = file->last_access.tid;
+
+        if (!(buf[1] & D_CONST_tid))
+            memcpy(&tid, cur + size0 + len_time, sizeof(tid));
+        E_ERROR(grow_contexts(file, tid));
+        ctx = delta_context(file, tid, file_flags);
+    } else
+        ctx = &file->last_access;
+
+    if (file_flags & USF_FLAG_PC_DICT) {
+        if (len_pc == VARINT_NEW_pc) {
+            memcpy(&a->pc, cur, sizeof(a->pc));
+            cur += sizeof(a->pc);
+            pcdict_add(file, a->pc);
+        } else
+            E_ERROR(pcdict_decode(file, load_varint(&cur, len_pc, wide),
+                                  &a->pc));
+        ctx->pc = a->pc;
+    } else {
+        E_IF(len_pc == VARINT_NEW_pc, USF_ERROR_FILE);
+        a->pc = unpack_varint(&cur, &ctx->pc, len_pc, wide);
+    }
+    if (buf[1] & VARINT_PRED_addr) {
+        usf_stride_t *e;
+
+        E_IF(!(file_flags & USF_FLAG_STRIDE) || len_addr, USF_ERROR_FILE);
+        e = stride_entry(file, a->pc);
+        E_IF(!stride_predict(e, a->pc, &a->addr), USF_ERROR_FILE);
+        ctx->addr = a->addr;
+        stride_update(e, a->pc, a->addr);
+    } else {
+        a->addr = unpack_varint(&cur, &ctx->addr, len_addr, wide);
+        if (file_flags & USF_FLAG_STRIDE)
+            stride_update(stride_entry(file, a->pc), a->pc, a->addr);
+    }
+    a->time = unpack_varint(&cur, &file->last_access.time, len_time, wide);
+
+    UNPACK_UINT16(&file->last_access, buf[1], &cur, a, tid);
+    UNPACK_UINT16(ctx, buf[1], &cur, a, len);
+    UNPACK_UINT8(ctx, buf[1], &cur, a, type);
 
-    E_ERROR(write_access(file, &s->begin));
-    E_ERROR(write_access(file, &s->end));
-    E_ERROR(usf_internal_write(file, (const void *)&s->line_size,
-                               sizeof(usf_line_size_2_t)));
+    usf_internal_consume(file, size);
 
 ret_err:
     return error;
 }
 
-static usf_error_t
-read_sample(usf_file_t *file, usf_event_t *event)
+static ALWAYS_INLINE usf_error_t
+read_access_plain(usf_file_t *file, usf_access_t *a)
+{
+    return usf_internal_read(file, (void *)a, DATA_LEN_ACCESS);
+}
+
+static ALWAYS_INLINE usf_error_t
+read_access(usf_file_t *file, usf_access_t *a, const usf_flags_t file_flags)
+{
+    if (file_flags & USF_FLAG_VARINT)
+        return read_access_varint(file, a, file_flags);
+    else if (file_flags & USF_FLAG_DELTA)
+        return read_access_delta(file, a, file_flags);
+    else
+        return read_access_plain(file, a);
+}
+
+/* ********************************************************************** */
+
+static ALWAYS_INLINE void
+encode_sample(usf_file_t *file, char **buf, const usf_event_t *event,
+              const usf_flags_t file_flags)
+{
+    const usf_event_sample_t *s = &event->u.sample;
+
+    encode_access(file, buf, &s->begin, file_flags);
+    encode_access(file, buf, &s->end, file_flags);
+    ENCODE_RAW(buf, s->line_size);
+}
+
+static ALWAYS_INLINE usf_error_t
+read_sample(usf_file_t *file, usf_event_t *event,
+            const usf_flags_t file_flags)
 {
     usf_error_t error = USF_ERROR_OK;
     usf_event_sample_t *s = &event->u.sample;
-    assert(event->type == USF_EVENT_SAMPLE);
 
-    E_ERROR(read_access(file, &s->begin));
-    E_ERROR(read_access(file, &s->end));
+    E_ERROR(read_access(file, &s->begin, file_flags));
+    E_ERROR(read_access(file, &s->end, file_flags));
     E_ERROR(usf_internal_read(file, (void *)&s->line_size,
                               sizeof(usf_line_size_2_t)));
 
@@ -267,29 +866,24 @@ ret_err:
 
 /* ********************************************************************** */
 
-static usf_error_t
-write_dangling(usf_file_t *file, const usf_event_t *event)
+static ALWAYS_INLINE void
+encode_dangling(usf_file_t *file, char **buf, const usf_event_t *event,
+                const usf_flags_t file_flags)
 {
-    usf_error_t error = USF_ERROR_OK;
     const usf_event_dangling_t *d = &event->u.dangling;
-    assert(event->type == USF_EVENT_DANGLING);
-
-    E_ERROR(write_access(file, &d->begin));
-    E_ERROR(usf_internal_write(file, (const void *)&d->line_size,
-                               sizeof(usf_line_size_2_t)));
 
-ret_err:
-    return error;
+    encode_access(file, buf, &d->begin, file_flags);
+    ENCODE_RAW(buf, d->line_size);
 }
 
-static usf_error_t
-read_dangling(usf_file_t *file, usf_event_t *event)
+static ALWAYS_INLINE usf_error_t
+read_dangling(usf_file_t *file, usf_event_t *event,
+              const usf_flags_t file_flags)
 {
     usf_error_t error = USF_ERROR_OK;
     usf_event_dangling_t *d = &event->u.dangling;
-    assert(event->type == USF_EVENT_DANGLING);
 
-    E_ERROR(read_access(file, &d->begin));
+    E_ERROR(read_access(file, &d->begin, file_flags));
     E_ERROR(usf_internal_read(file, (void *)&d->line_size,
                               sizeof(usf_line_size_2_t)));
 
@@ -299,26 +893,19 @@ ret_err:
 
 /* ********************************************************************** */
 
-static usf_error_t
-write_burst(usf_file_t *file, const usf_event_t *event)
+static ALWAYS_INLINE void
+encode_burst(char **buf, const usf_event_t *event)
 {
-    usf_error_t error = USF_ERROR_OK;
     const usf_event_burst_t *b = &event->u.burst;
-    assert(event->type == USF_EVENT_BURST);
 
-    E_ERROR(usf_internal_write(file, (const void *)&b->begin_time,
-                               sizeof(usf_atime_t)));
-
-ret_err:
-    return error;
+    ENCODE_RAW(buf, b->begin_time);
 }
 
-static usf_error_t
+static ALWAYS_INLINE usf_error_t
 read_burst(usf_file_t *file, usf_event_t *event)
 {
     usf_error_t error = USF_ERROR_OK;
     usf_event_burst_t *b = &event->u.burst;
-    assert(event->type == USF_EVENT_BURST);
 
     E_ERROR(usf_internal_read(file, (void *)&b->begin_time, 
                               sizeof(usf_atime_t)));
@@ -327,126 +914,608 @@ ret_err:
     return error;
 }
 
+/* ********************************************************************** */
+
+static ALWAYS_INLINE usf_error_t
+read_trace(usf_file_t *file, usf_event_t *event,
+           const usf_flags_t file_flags)
+{
+    return read_access(file, &event->u.trace.access, file_flags);
+}
+
+static ALWAYS_INLINE void
+encode_trace(usf_file_t *file, char **buf, const usf_event_t *event,
+             const usf_flags_t file_flags)
+{
+    encode_access(file, buf, &event->u.trace.access, file_flags);
+}
 
 /* ********************************************************************** */
 
-/* The following handles writes a trace _event_, pure trace files
- * (i.e. files having USF_FLAG_TRACE set) use different trace event
- * encodings.
+/** Time used to order events, i.e. the time of the first access */
+static inline usf_atime_t
+event_time(const usf_event_t *event)
+{
+    switch (event->type) {
+    case USF_EVENT_SAMPLE:
+        return event->u.sample.begin.time;
+    case USF_EVENT_DANGLING:
+        return event->u.dangling.begin.time;
+    case USF_EVENT_BURST:
+        return event->u.burst.begin_time;
+    case USF_EVENT_TRACE:
+        return event->u.trace.access.time;
+    default:
+        assert(0);
+        return 0;
+    }
+}
+
+/*
+ * Pure trace files (i.e. files having USF_FLAG_TRACE set) store
+ * trace events without the event type.
  */
 
-static usf_error_t
-read_trace(usf_file_t *file, usf_event_t *event)
+static ALWAYS_INLINE void
+encode_event(usf_file_t *file, char **buf, const usf_event_t *event,
+             const usf_flags_t file_flags)
+{
+    if (file_flags & USF_FLAG_TRACE) {
+        encode_trace(file, buf, event, file_flags);
+        return;
+    }
+
+    ENCODE_RAW(buf, event->type);
+    switch (event->type) {
+    case USF_EVENT_SAMPLE:
+        encode_sample(file, buf, event, file_flags);
+        break;
+    case USF_EVENT_DANGLING:
+        encode_dangling(file, buf, event, file_flags);
+        break;
+    case USF_EVENT_BURST:
+        encode_burst(buf, event);
+        break;
+    default:
+        encode_trace(file, buf, event, file_flags);
+        break;
+    }
+}
+
+static ALWAYS_INLINE usf_error_t
+read_event(usf_file_t *file, usf_event_t *event,
+           const usf_flags_t file_flags)
 {
     usf_error_t error = USF_ERROR_OK;
-    usf_event_trace_t *d = &event->u.trace;
-    assert(event->type == USF_EVENT_TRACE);
 
-    E_ERROR(read_access(file, &d->access));
+    if (file_flags & USF_FLAG_TRACE) {
+        event->type = USF_EVENT_TRACE;
+        return read_trace(file, event, file_flags);
+    }
+
+    E_ERROR(usf_internal_read(file, &event->type,
+                              sizeof(usf_event_type_t)));
+    switch (event->type) {
+    case USF_EVENT_SAMPLE:
+        E_ERROR(read_sample(file, event, file_flags));
+        break;
+    case USF_EVENT_DANGLING:
+        E_ERROR(read_dangling(file, event, file_flags));
+        break;
+    case USF_EVENT_BURST:
+        E_ERROR(read_burst(file, event));
+        break;
+    case USF_EVENT_TRACE:
+        E_ERROR(read_trace(file, event, file_flags));
+        break;
+    default:
+        E_ERROR(USF_ERROR_FILE);
+    }
 
 ret_err:
     return error;
 }
 
-static usf_error_t
-write_trace(usf_file_t *file, const usf_event_t *event)
+/*
+ * Specialized readers and writers
+ *
+ * The event format of a file is fixed once it has been opened, so
+ * usf_events_select() picks a reader and a writer that have been
+ * compiled for exactly the format flags of the file. Their inner
+ * loops don't test any flags. The compression codec is only called
+ * when the staging buffer is refilled or flushed, so it doesn't take
+ * part in the specialization.
+ */
+
+static ALWAYS_INLINE usf_error_t
+read_events(usf_file_t *file, usf_event_t *events, size_t max, size_t *n,
+            const usf_flags_t file_flags)
 {
     usf_error_t error = USF_ERROR_OK;
-    const usf_event_trace_t *d = &event->u.trace;
-    assert(event->type == USF_EVENT_TRACE);
+    size_t i;
 
-    E_ERROR(write_access(file, &d->access));
+    for (i = 0; i < max; i++)
+        E_ERROR(read_event(file, &events[i], file_flags));
 
 ret_err:
+    *n = i;
     return error;
 }
 
-/* ********************************************************************** */
+static ALWAYS_INLINE usf_error_t
+append_events(usf_file_t *file, const usf_event_t *events, size_t n,
+              const usf_flags_t file_flags)
+{
+    usf_error_t error = USF_ERROR_OK;
+    char *cur;
+
+    for (size_t i = 0; i < n; i++) {
+        if (file_flags & USF_FLAG_TID_CONTEXT)
+            E_ERROR(grow_contexts_event(file, &events[i]));
+        if (file->stats)
+            E_ERROR(usf_stats_reserve(file, &events[i]));
+        E_ERROR(usf_internal_reserve(file, MAX_LEN_EVENT, &cur));
+        encode_event(file, &cur, &events[i], file_flags);
+        usf_internal_commit(file, cur);
+        if (file->stats)
+            usf_stats_add(file, &events[i]);
+        file->events++;
+
+        if (file->blocks)
+            usf_block_add_event(file, event_time(&events[i]));
+    }
+
+ret_err:
+    return error;
+}
+
+/* Format flags the readers and writers are specialized for */
+#define FORMAT_FLAGS (USF_FLAG_TRACE | USF_FLAG_DELTA | USF_FLAG_VARINT | \
+                      USF_FLAG_TID_CONTEXT | USF_FLAG_STRIDE |           \
+                      USF_FLAG_PC_DICT)
+
+#define EVENT_OPS(name, file_flags)                                     \
+    static usf_error_t                                                  \
+    read_##name(usf_file_t *file, usf_event_t *events, size_t max,     \
+                size_t *n)                                              \
+    {                                                                   \
+        return read_events(file, events, max, n, file_flags);           \
+    }                                                                   \
+                                                                        \
+    static usf_error_t                                                  \
+    append_##name(usf_file_t *file, const usf_event_t *events, size_t n) \
+    {                                                                   \
+        return append_events(file, events, n, file_flags);              \
+    }
 
-event_io_t event_io[] = {
-    { &write_sample, &read_sample },
-    { &write_dangling, &read_dangling },
-    { &write_burst, &read_burst },
-    { &write_trace, &read_trace }
+/* Every valid combination of the delta compression flags */
+#define EVENT_FORMATS(X, base)                                          \
+    X(base##_plain, 0)                                                  \
+    X(base##_delta, USF_FLAG_DELTA)                                     \
+    X(base##_delta_t, USF_FLAG_DELTA | USF_FLAG_TID_CONTEXT)            \
+    X(base##_delta_s, USF_FLAG_DELTA | USF_FLAG_STRIDE)                 \
+    X(base##_delta_ts, USF_FLAG_DELTA | USF_FLAG_TID_CONTEXT |          \
+      USF_FLAG_STRIDE)                                                  \
+    X(base##_delta_p, USF_FLAG_DELTA | USF_FLAG_PC_DICT)                \
+    X(base##_delta_tp, USF_FLAG_DELTA | USF_FLAG_TID_CONTEXT |          \
+      USF_FLAG_PC_DICT)                                                 \
+    X(base##_delta_sp, USF_FLAG_DELTA | USF_FLAG_STRIDE |               \
+      USF_FLAG_PC_DICT)                                                 \
+    X(base##_delta_tsp, USF_FLAG_DELTA | USF_FLAG_TID_CONTEXT |         \
+      USF_FLAG_STRIDE | USF_FLAG_PC_DICT)                               \
+    X(base##_varint, USF_FLAG_DELTA | USF_FLAG_VARINT)                  \
+    X(base##_varint_t, USF_FLAG_DELTA | USF_FLAG_VARINT |               \
+      USF_FLAG_TID_CONTEXT)                                             \
+    X(base##_varint_s, USF_FLAG_DELTA | USF_FLAG_VARINT |               \
+      USF_FLAG_STRIDE)                                                  \
+    X(base##_varint_ts, USF_FLAG_DELTA | USF_FLAG_VARINT |              \
+      USF_FLAG_TID_CONTEXT | USF_FLAG_STRIDE)                           \
+    X(base##_varint_p, USF_FLAG_DELTA | USF_FLAG_VARINT |               \
+      USF_FLAG_PC_DICT)                                                 \
+    X(base##_varint_tp, USF_FLAG_DELTA | USF_FLAG_VARINT |              \
+      USF_FLAG_TID_CONTEXT | USF_FLAG_PC_DICT)                          \
+    X(base##_varint_sp, USF_FLAG_DELTA | USF_FLAG_VARINT |              \
+      USF_FLAG_STRIDE | USF_FLAG_PC_DICT)                               \
+    X(base##_varint_tsp, USF_FLAG_DELTA | USF_FLAG_VARINT |             \
+      USF_FLAG_TID_CONTEXT | USF_FLAG_STRIDE | USF_FLAG_PC_DICT)
+
+#define EVENT_OPS_TRACE(name, file_flags)               \
+    EVENT_OPS(name, USF_FLAG_TRACE | (file_flags))
+#define EVENT_OPS_ENTRY(name, file_flags)               \
+    { (file_flags), { &read_##name, &append_##name } },
+#define EVENT_OPS_ENTRY_TRACE(name, file_flags)         \
+    EVENT_OPS_ENTRY(name, USF_FLAG_TRACE | (file_flags))
+
+EVENT_FORMATS(EVENT_OPS, events)
+EVENT_FORMATS(EVENT_OPS_TRACE, trace)
+/* Tests the flags at run time, used to benchmark the specialized
+ * readers and writers */
+EVENT_OPS(generic, file->header->flags)
+
+static const struct {
+    usf_flags_t flags;
+    usf_event_ops_t ops;
+} event_ops[] = {
+    EVENT_FORMATS(EVENT_OPS_ENTRY, events)
+    EVENT_FORMATS(EVENT_OPS_ENTRY_TRACE, trace)
 };
 
-static usf_error_t
-usf_append_event(usf_file_t *file, const usf_event_t *event)
+usf_error_t
+usf_events_select(usf_file_t *file)
 {
-    usf_error_t error = USF_ERROR_OK;
+    const usf_flags_t flags = file->header->flags & FORMAT_FLAGS;
 
-    E_ERROR(usf_internal_write(file, (const void *)&event->type,
-                               sizeof(usf_event_type_t)));
-    E_ERROR(event_io[event->type].write(file, event));
+    for (size_t i = 0; i < ARRAY_LEN(event_ops); i++) {
+        if (event_ops[i].flags == flags) {
+            file->event_ops = &event_ops[i].ops;
+            return USF_ERROR_OK;
+        }
+    }
+
+    return USF_ERROR_UNSUPPORTED;
+}
+
+void
+usf_events_generic(usf_file_t *file)
+{
+    static const usf_event_ops_t generic_ops = {
+        &read_generic, &append_generic
+    };
+
+    if (file->prefetch)
+        usf_prefetch_set_ops(file, &generic_ops);
+    else
+        file->event_ops = &generic_ops;
+}
+
+/* ********************************************************************** */
+
+usf_error_t
+usf_append(usf_file_t *file, const usf_event_t *event)
+{
+    if (!file || !event || event->type >= EVENT_TYPES ||
+        ((file->header->flags & USF_FLAG_TRACE) &&
+         event->type != USF_EVENT_TRACE))
+        return USF_ERROR_PARAM;
+
+    return file->event_ops->append(file, event, 1);
+}
+
+usf_error_t
+usf_append_batch(usf_file_t *file, const usf_event_t *events, size_t n)
+{
+    const int trace = file && (file->header->flags & USF_FLAG_TRACE);
+    size_t i;
+
+    if (!file || (!events && n))
+        return USF_ERROR_PARAM;
+
+    /* Validate the whole batch before encoding anything, we don't
+     * want to leave half a batch in the file on parameter errors. */
+    for (i = 0; i < n; i++) {
+        if (events[i].type >= EVENT_TYPES ||
+            (trace && events[i].type != USF_EVENT_TRACE))
+            return USF_ERROR_PARAM;
+    }
+
+    return file->event_ops->append(file, events, n);
+}
+
+usf_error_t
+usf_read(usf_file_t *file, usf_event_t *event)
+{
+    usf_error_t error;
+    size_t n;
+
+    if (!file || !event)
+	return USF_ERROR_PARAM;
+
+    error = file->event_ops->read(file, event, 1, &n);
+    file->events += n;
 
-ret_err:
     return error;
 }
 
+usf_error_t
+usf_read_batch(usf_file_t *file, usf_event_t *events, size_t max, size_t *n)
+{
+    usf_error_t error;
 
-static usf_error_t
-usf_append_trace(usf_file_t *file, const usf_event_t *event)
+    if (!file || !events || !n)
+	return USF_ERROR_PARAM;
+
+    error = file->event_ops->read(file, events, max, n);
+    file->events += *n;
+
+    /* Hitting the end of the file after decoding some events isn't
+     * an error, the caller will get USF_ERROR_EOF on the next
+     * call. */
+    if (error == USF_ERROR_EOF && *n > 0)
+	error = USF_ERROR_OK;
+
+    return error;
+}
+
+usf_error_t
+usf_read_raw_trace(usf_file_t *file, const void **records,
+                   size_t max, size_t *n)
 {
     usf_error_t error = USF_ERROR_OK;
+    char *data;
+    size_t avail;
+
+    if (!file || !records || !n)
+        return USF_ERROR_PARAM;
+
+    assert(DATA_LEN_ACCESS == USF_RAW_ACCESS_SIZE);
+    *n = 0;
+    if ((file->header->flags & (USF_FLAG_TRACE | USF_FLAG_DELTA)) !=
+        USF_FLAG_TRACE || file->prefetch)
+        return USF_ERROR_UNSUPPORTED;
 
-    assert(event->type == USF_EVENT_TRACE);
-    E_ERROR(write_access(file, &event->u.trace.access));
+    E_ERROR(usf_internal_peek(file, DATA_LEN_ACCESS, &data));
+
+    /* Hand out as many complete records as the staging buffer
+     * currently holds, for mapped files that is the rest of the
+     * file. */
+    avail = (file->buf_len - file->buf_pos) / DATA_LEN_ACCESS;
+    *n = max < avail ? max : avail;
+    *records = data;
+    usf_internal_consume(file, *n * DATA_LEN_ACCESS);
+    file->events += *n;
 
 ret_err:
     return error;
 }
 
+/** Store a in the arrays of columns that aren't NULL */
+static inline void
+store_columns(const usf_columns_t *columns, size_t i, const usf_access_t *a)
+{
+    if (columns->pc)
+        columns->pc[i] = a->pc;
+    if (columns->addr)
+        columns->addr[i] = a->addr;
+    if (columns->time)
+        columns->time[i] = a->time;
+    if (columns->tid)
+        columns->tid[i] = a->tid;
+    if (columns->len)
+        columns->len[i] = a->len;
+    if (columns->type)
+        columns->type[i] = a->type;
+}
+
+/* Decode n values starting at value pos of a column into dst, 64-bit
+ * fields are decoded in place and narrower fields through a small
+ * buffer. */
+#define READ_COLUMN(c, pos, dst, n)                                     \
+    do {                                                                \
+        uint64_t values_[256];                                          \
+        usf_column_skip(c, pos);                                        \
+        if (sizeof(*(dst)) == sizeof(uint64_t)) {                       \
+            usf_column_read(c, (uint64_t *)(dst), n);                   \
+            break;                                                      \
+        }                                                               \
+        for (size_t i_ = 0; i_ < (n); i_ += ARRAY_LEN(values_)) {       \
+            size_t k_ = (n) - i_ < ARRAY_LEN(values_) ?                 \
+                (n) - i_ : ARRAY_LEN(values_);                          \
+            usf_column_read(c, values_, k_);                            \
+            for (size_t j_ = 0; j_ < k_; j_++)                          \
+                (dst)[i_ + j_] = values_[j_];                           \
+        }                                                               \
+    } while (0)
+
 usf_error_t
-usf_append(usf_file_t *file, const usf_event_t *event)
+usf_read_columns(usf_file_t *file, const usf_columns_t *columns,
+                 size_t max, size_t *n)
 {
-    if(!file || !event || (event->type >= ARRAY_LEN(event_io)))
+    usf_error_t error = USF_ERROR_OK;
+    usf_access_t a;
+    size_t i = 0;
+
+    if (!file || !columns || !n)
         return USF_ERROR_PARAM;
 
-    if (file->header->flags & USF_FLAG_TRACE)
-	return usf_append_trace(file, event);
-    else
-	return usf_append_event(file, event);
+    *n = 0;
+    if (!(file->header->flags & USF_FLAG_TRACE))
+        return USF_ERROR_UNSUPPORTED;
+
+    /* The background decoder owns the columns */
+    if (!(file->header->flags & USF_FLAG_COLUMNS) || file->prefetch) {
+        usf_event_t event;
+        size_t k;
+
+        for (; i < max; i++) {
+            E_ERROR(file->event_ops->read(file, &event, 1, &k));
+            store_columns(columns, i, &event.u.trace.access);
+        }
+    } else if (file->buf_pos < file->buf_len) {
+        /* Finish the accesses already moved to the staging buffer */
+        for (; i < max && file->buf_pos < file->buf_len; i++) {
+            E_ERROR(read_access_plain(file, &a));
+            store_columns(columns, i, &a);
+        }
+    } else {
+        usf_column_t *c = file->col;
+        size_t pos;
+
+        while (file->col_pos == file->col_events)
+            E_ERROR(usf_block_read_columns(file));
+
+        pos = file->col_pos;
+        i = file->col_events - pos < max ? file->col_events - pos : max;
+        if (columns->pc)
+            READ_COLUMN(&c[0], pos, columns->pc, i);
+        if (columns->addr)
+            READ_COLUMN(&c[1], pos, columns->addr, i);
+        if (columns->time)
+            READ_COLUMN(&c[2], pos, columns->time, i);
+        if (columns->tid)
+            READ_COLUMN(&c[3], pos, columns->tid, i);
+        if (columns->len)
+            READ_COLUMN(&c[4], pos, columns->len, i);
+        if (columns->type)
+            READ_COLUMN(&c[5], pos, columns->type, i);
+        file->col_pos += i;
+    }
+
+ret_err:
+    *n = i;
+    file->events += i;
+
+    if (error == USF_ERROR_EOF && i > 0)
+        error = USF_ERROR_OK;
+
+    return error;
 }
 
+/**
+ * Make sure that the next event can be decoded without refilling the
+ * staging buffer, which would invalidate its position in the buffer.
+ */
 static usf_error_t
-usf_read_event(usf_file_t *file, usf_event_t *event)
+seek_prepare(usf_file_t *file)
 {
-    usf_error_t error = USF_ERROR_OK;
+    usf_error_t error;
+    size_t avail = file->buf_len - file->buf_pos;
 
-    E_ERROR(usf_internal_read(file, &event->type,
-                              sizeof(usf_event_type_t)));
+    if (avail >= MAX_LEN_EVENT)
+        return USF_ERROR_OK;
 
-    E_IF(event->type >= ARRAY_LEN(event_io),
-	 USF_ERROR_FILE);
+    /* Blocks and mappings always hold complete events */
+    if (file->blocks || file->map)
+        return avail ? USF_ERROR_OK : usf_internal_fill(file, 1);
 
-    E_ERROR(event_io[event->type].read(file, event));
+    /* A short tail is fine here, truncated events are reported when
+     * they are decoded. */
+    error = usf_internal_fill(file, MAX_LEN_EVENT);
+    return error == USF_ERROR_FILE ? USF_ERROR_OK : error;
+}
 
-ret_err:
-    return error;
+/** Check if no block holds events older than those of the block
+ * before it */
+static int
+index_ordered(const usf_block_index_t *index, size_t len)
+{
+    size_t i;
+
+    for (i = 1; i < len; i++) {
+        if (index[i].min_time < index[i - 1].max_time)
+            return 0;
+    }
+    return 1;
 }
 
+/**
+ * Decode events until one at or after time is found and push that
+ * event back into the staging buffer.
+ */
 static usf_error_t
-usf_read_trace(usf_file_t *file, usf_event_t *event)
+seek_scan(usf_file_t *file, usf_atime_t time)
 {
     usf_error_t error = USF_ERROR_OK;
-
-    event->type = USF_EVENT_TRACE;
-    E_ERROR(read_access(file, &event->u.trace.access));
+    usf_access_t last_access;
+    usf_event_t event;
+    size_t pcdict_len;
+    size_t pos, n;
+
+    /* Record the per-thread contexts and predictor entries changed by
+     * each event so that they can be restored. The pc dictionary only
+     * grows, restoring its length is enough. */
+    file->undo_enabled = 1;
+    for (;;) {
+        E_ERROR(seek_prepare(file));
+        pos = file->buf_pos;
+        last_access = file->last_access;
+        file->ctx_undo_len = 0;
+        file->stride_undo_len = 0;
+        pcdict_len = file->pcdict_len;
+
+        E_ERROR(file->event_ops->read(file, &event, 1, &n));
+
+        if (event_time(&event) >= time) {
+            file->buf_pos = pos;
+            file->last_access = last_access;
+            while (file->ctx_undo_len) {
+                file->ctx_undo_len--;
+                file->ctx[file->ctx_undo_tid[file->ctx_undo_len]] =
+                    file->ctx_undo[file->ctx_undo_len];
+            }
+            while (file->stride_undo_len) {
+                file->stride_undo_len--;
+                file->stride[file->stride_undo_idx[file->stride_undo_len]] =
+                    file->stride_undo[file->stride_undo_len];
+            }
+            file->pcdict_len = pcdict_len;
+            break;
+        }
+        file->events++;
+    }
 
 ret_err:
+    file->undo_enabled = 0;
     return error;
 }
 
 usf_error_t
-usf_read(usf_file_t *file, usf_event_t *event)
+usf_seek_time(usf_file_t *file, usf_atime_t time)
 {
-    if (!file || !event)
-	return USF_ERROR_PARAM;
+    usf_error_t error = USF_ERROR_OK;
+    unsigned prefetch = 0;
 
-    if (file->header->flags & USF_FLAG_TRACE)
-	return usf_read_trace(file, event);
-    else
-	return usf_read_event(file, event);
+    if (!file || file->mode != USF_MODE_READ)
+        return USF_ERROR_PARAM;
+
+    /* Discard the events decoded ahead, the decoder restarts from
+     * the new position */
+    if (file->prefetch) {
+        prefetch = usf_prefetch_batches(file);
+        usf_prefetch_stop(file);
+    }
+
+    if (file->blocks)
+        E_ERROR(usf_block_read_index(file));
+
+    if (file->index_len) {
+        const usf_block_index_t *index = file->index;
+        size_t lo = 0;
+        size_t hi = file->index_len - 1;
+
+        /* Find the first block ending at or after time. Scan the
+         * last block if there is none, that leaves us at the end of
+         * the file. Files appended to concurrently are only ordered
+         * within each thread, their blocks are searched in file
+         * order. */
+        if (index_ordered(index, file->index_len)) {
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+
+                if (index[mid].max_time < time)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+        } else {
+            while (lo < hi && index[lo].max_time < time)
+                lo++;
+        }
+
+        E_ERROR(usf_block_seek(file, index[lo].offset,
+                               index[lo].first_event));
+    } else if (file->events || prefetch) {
+        E_ERROR(usf_internal_rewind(file));
+    }
+
+    E_ERROR(seek_scan(file, time));
+
+ret_err:
+    if (prefetch) {
+        usf_error_t prefetch_error = usf_prefetch_start(file, prefetch);
+        if (error == USF_ERROR_OK)
+            error = prefetch_error;
+    }
+    return error;
 }
 
 /*
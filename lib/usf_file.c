@@ -31,16 +31,35 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
 
 #include "usf_priv.h"
 #include "usf_header.h"
 #include "usf_internal.h"
+#include "usf_io.h"
+#include "usf_block.h"
+#include "usf_columns.h"
+#include "usf_events.h"
+#include "usf_readahead.h"
+#include "usf_async.h"
+#include "usf_prefetch.h"
+#include "usf_stats.h"
 #include "error.h"
 
 static const char usf_magic[] = "USF1";
 
 static usf_io_methods_t io_methods[] = {
-#define _COMP(comp, init, fini, read, write) [comp] = {init, fini, read, write},
+#define _COMP(comp, init, fini, read, write, bound, compress, decompress) \
+    [comp] = {init, fini, read, write, bound, compress, decompress},
     USF_COMP_LIST
 #undef _COMP
 };
@@ -48,154 +67,503 @@ static usf_io_methods_t io_methods[] = {
 static inline usf_error_t
 check_compression(usf_compression_t comp)
 {
-#define _COMP(comp, u1, u2, u3, u4) case comp:
+#define _COMP(comp, u1, u2, u3, u4, u5, u6, u7) case comp:
     switch (comp) { 
         USF_COMP_LIST
             return USF_ERROR_OK;
     default:
-        return USF_ERROR_FILE;
+        /* Known compression types that this build lacks support for
+         * have names */
+        return strcmp(usf_strcompr(comp), "Unknown") ?
+            USF_ERROR_UNSUPPORTED : USF_ERROR_FILE;
     }
 #undef _COMP
 }
 
+int
+usf_hascompr(usf_compression_t compression)
+{
+    return check_compression(compression) == USF_ERROR_OK;
+}
+
+
+/* Flags that modify the delta encoding, older readers don't know
+ * about them. */
+#define USF_FLAG_DELTA_MODES (USF_FLAG_VARINT | USF_FLAG_TID_CONTEXT | \
+                              USF_FLAG_STRIDE | USF_FLAG_PC_DICT)
+
+static int
+valid_delta_modes(const usf_header_t *header)
+{
+    if (header->flags & USF_FLAG_COLUMNS)
+        return (header->flags & (USF_FLAG_TRACE | USF_FLAG_DELTA)) ==
+            USF_FLAG_TRACE && header->version >= USF_VERSION_BLOCKS;
+
+    return !(header->flags & USF_FLAG_DELTA_MODES) ||
+        ((header->flags & USF_FLAG_DELTA) &&
+         header->version >= USF_VERSION_BLOCKS);
+}
 
 usf_error_t
-read_magic(FILE *f)
+read_magic(usf_io_t *io)
 {
     char magic[sizeof(usf_magic)];
 
-    if (fread(magic, sizeof(magic), 1, f) != 1)
-	return feof(f) ? USF_ERROR_FILE : USF_ERROR_SYS;
+    if (usf_io_read(io, magic, sizeof(magic)) != sizeof(magic))
+	return usf_io_error(io) ? USF_ERROR_SYS : USF_ERROR_FILE;
 
     return memcmp(magic, usf_magic, sizeof(usf_magic)) == 0 ?
 	USF_ERROR_OK : USF_ERROR_FILE;
 }
 
 usf_error_t
-write_magic(FILE *f)
+write_magic(usf_io_t *io)
 {
-    return fwrite(usf_magic, sizeof(usf_magic), 1, f) == 1 ?
-	USF_ERROR_OK : USF_ERROR_SYS;
+    return usf_io_write(io, usf_magic, sizeof(usf_magic));
 }
 
-/* This function is not exported, i.e. it prototype is not in usf.h, it is
- * only meant to be called by usf2usf */
-usf_error_t
-usf_open_hidden(usf_file_t **file, const char *path,
-                usf_compression_t override)
+/**
+ * Use size bytes at map, which contain the entire input file,
+ * instead of the I/O buffer for everything after the header.
+ */
+static void
+use_map(usf_file_t *f, void *map, size_t size)
 {
-    usf_file_t *f = NULL;
-    usf_error_t error;
+    const uint64_t offset = usf_io_tell(f->io);
+
+    f->map = map;
+    f->map_size = size;
+    f->map_pos = offset;
+
+    /* The event stream of an uncompressed pre-0.3 file can be decoded
+     * in place, let the staging buffer cover the rest of the file. */
+    if (!f->blocks && f->header->compression == USF_COMPRESSION_NONE) {
+        free(f->buf_mem);
+        f->buf_mem = NULL;
+        f->buf = (char *)map + offset;
+        f->buf_size = size - offset;
+        f->buf_len = f->buf_size;
+        f->map_pos = size;
+    }
+}
 
-    E_IF(!file, USF_ERROR_PARAM);
+#ifdef HAVE_MMAP
+/**
+ * Map an input file into memory. Leaves the file unchanged if it
+ * can't be mapped, e.g. if it is a pipe.
+ */
+static void
+map_file(usf_file_t *f)
+{
+    const uint64_t offset = usf_io_tell(f->io);
+    struct stat st;
+    void *map;
+
+    /* Offsets in the file are relative to its start */
+    if (usf_io_start(f->io) ||
+        fstat(usf_io_fd(f->io), &st) == -1 || !S_ISREG(st.st_mode))
+        return;
+
+    if ((uint64_t)st.st_size <= offset)
+        return;
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+               usf_io_fd(f->io), 0);
+    if (map == MAP_FAILED)
+        return;
+
+#ifdef HAVE_MADVISE
+    /* These are only hints, ignore failures */
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    madvise(map, st.st_size, MADV_HUGEPAGE);
+#endif
+#endif
+
+    use_map(f, map, st.st_size);
+}
+#endif
 
-    f = malloc(sizeof(usf_file_t));
-    E_NULL(f, USF_ERROR_MEM);
+static void
+free_buffers(usf_file_t *f)
+{
+    /* Outstanding jobs may refer to the mapping */
+    usf_block_free_pool(f);
+
+#ifdef HAVE_MMAP
+    if (f->map && !f->map_mem)
+        munmap(f->map, f->map_size);
+#endif
+
+    free(f->buf_mem);
+    free(f->cbuf);
+    free(f->index);
+    free(f->ctx);
+    free(f->stride);
+    free(f->pcdict);
+    free(f->pcdict_hash);
+    free(f->cols_mem);
+    usf_stats_free(f->stats);
+}
 
-    f->header = NULL;
-    f->bzeof = 0;
+static usf_error_t
+alloc_buffers(usf_file_t *f, size_t size)
+{
+    usf_error_t error = USF_ERROR_OK;
+
+    f->buf_size = size;
+    E_NULL(f->buf_mem = malloc(f->buf_size), USF_ERROR_MEM);
+    f->buf = f->buf_mem;
+
+    /* Compressed blocks are staged in a separate buffer */
+    if (f->blocks && f->io_methods->bound) {
+        /* Column blocks are slightly larger than the records */
+        f->cbuf_size = f->io_methods->bound(
+            f->buf_size + (f->header->flags & USF_FLAG_COLUMNS ?
+                           USF_COLUMNS_OVERHEAD : 0));
+        E_NULL(f->cbuf = malloc(f->cbuf_size), USF_ERROR_MEM);
+    }
 
-    if (path)
-        f->file = fopen(path, "r");
-    else
-        f->file = stdin;
+    if (f->header->flags & USF_FLAG_STRIDE)
+        E_NULL(f->stride = calloc(USF_STRIDE_SIZE, sizeof(*f->stride)),
+               USF_ERROR_MEM);
 
-    E_NULL(f->file, USF_ERROR_SYS);
-    memset(&f->last_access, 0, sizeof(f->last_access));
+    if (f->header->flags & USF_FLAG_PC_DICT)
+        E_NULL(f->pcdict = malloc(USF_PCDICT_SIZE * sizeof(*f->pcdict)),
+               USF_ERROR_MEM);
 
-    E_ERROR(read_magic(f->file));
-    E_ERROR(usf_header_read(&f->header, f->file));
+ret_err:
+    return error;
+}
+
+/** Open a file for reading from io, which is closed on errors */
+static usf_error_t
+open_io(usf_file_t **file, usf_io_t *io, usf_compression_t override,
+        const usf_options_t *options)
+{
+    usf_file_t *f = NULL;
+    usf_error_t error;
+    const char *mem;
+    size_t mem_size;
+
+    /* Zero everything to make cleanup on errors safe */
+    f = calloc(1, sizeof(usf_file_t));
+    if (!f) {
+        usf_io_close(io);
+        return USF_ERROR_MEM;
+    }
+
+    f->io = io;
+    E_ERROR(read_magic(f->io));
+    E_ERROR(usf_header_read(&f->header, f->io));
+    E_IF(f->header->version > USF_VERSION_CURRENT, USF_ERROR_UNSUPPORTED);
+    f->blocks = f->header->version >= USF_VERSION_BLOCKS;
+    f->data_offset = sizeof(usf_magic) + usf_header_size(f->header);
+    E_IF(!valid_delta_modes(f->header), USF_ERROR_FILE);
+    E_ERROR(usf_events_select(f));
 
     if (override != (usf_compression_t)-1)
         f->header->compression = override;
 
     E_ERROR(check_compression(f->header->compression));
     f->io_methods = &io_methods[f->header->compression];
+    E_ERROR(alloc_buffers(f, USF_BUF_SIZE));
+    f->threads = options->threads;
     E_ERROR(usf_internal_init(f, USF_MODE_READ));
 
+    if (f->blocks || f->header->compression == USF_COMPRESSION_NONE) {
+        /* Memory is used in place, like a mapping */
+        if ((mem = usf_io_mem(f->io, &mem_size))) {
+            f->map_mem = 1;
+            use_map(f, (void *)mem, mem_size);
+        }
+#ifdef HAVE_MMAP
+        /* Files read with io_uring or O_DIRECT aren't mapped */
+        else if (options->io_depth <= 1 && !options->direct)
+            map_file(f);
+#endif
+    }
+
+    if (options->threads) {
+        if (f->blocks)
+            E_ERROR(usf_block_init_pool(f, options->threads));
+        else if (!f->map)
+            E_ERROR(usf_readahead_start(f));
+    }
+
+    if (options->prefetch) {
+        /* The background decoder owns the file position, so
+         * usf_file_stats() can't read the statistics later */
+        if (f->blocks)
+            E_ERROR(usf_block_read_stats(f));
+        E_ERROR(usf_prefetch_start(f, options->prefetch));
+    }
+
     *file = f;
     return USF_ERROR_OK;
 
 ret_err:
     if (f) {
-	if (f->file)
-	    fclose(f->file);
+	if (f->io)
+	    usf_io_close(f->io);
 	if (f->header)
 	    usf_header_free(f->header);
+	free_buffers(f);
 	free(f);
     }
 
     return error;
 }
 
+/* This function is not exported, i.e. it prototype is not in usf.h, it is
+ * only meant to be called by usf2usf */
 usf_error_t
-usf_open(usf_file_t **file, const char *path)
+usf_open_hidden(usf_file_t **file, const char *path,
+                usf_compression_t override, const usf_options_t *options)
 {
-    return usf_open_hidden(file, path, -1);
+    static const usf_options_t defaults;
+    usf_error_t error;
+    usf_io_t *io;
+
+    E_IF(!file, USF_ERROR_PARAM);
+    if (!options)
+        options = &defaults;
+
+    E_ERROR(usf_io_open(&io, path, USF_MODE_READ, options));
+    E_ERROR(open_io(file, io, override, options));
+
+ret_err:
+    return error;
 }
 
 usf_error_t
-usf_create(usf_file_t **file,
-	   const char *path, const usf_header_t *header)
+usf_open_fd(usf_file_t **file, int fd, const usf_options_t *options)
 {
-    usf_file_t *f;
+    static const usf_options_t defaults;
     usf_error_t error;
+    usf_io_t *io;
+
+    E_IF(!file, USF_ERROR_PARAM);
+    if (!options)
+        options = &defaults;
+
+    E_ERROR(usf_io_open_fd(&io, fd, USF_MODE_READ, options));
+    E_ERROR(open_io(file, io, -1, options));
+
+ret_err:
+    return error;
+}
+
+usf_error_t
+usf_open_mem(usf_file_t **file, const void *data, size_t size,
+             const usf_options_t *options)
+{
+    static const usf_options_t defaults;
+    usf_error_t error;
+    usf_io_t *io;
+
+    E_IF(!file || (!data && size), USF_ERROR_PARAM);
+    if (!options)
+        options = &defaults;
+
+    E_ERROR(usf_io_open_mem(&io, data, size));
+    E_ERROR(open_io(file, io, -1, options));
+
+ret_err:
+    return error;
+}
+
+usf_error_t
+usf_open(usf_file_t **file, const char *path)
+{
+    return usf_open_hidden(file, path, -1, NULL);
+}
+
+usf_error_t
+usf_open_opts(usf_file_t **file, const char *path,
+              const usf_options_t *options)
+{
+    return usf_open_hidden(file, path, -1, options);
+}
+
+/** Check the arguments of the usf_create functions before anything
+ * is opened, NULL options select the defaults. */
+static usf_error_t
+check_create(usf_file_t **file, const usf_header_t *header,
+             const usf_options_t **options)
+{
+    static const usf_options_t defaults;
+    usf_error_t error = USF_ERROR_OK;
+    size_t block_size;
 
     E_IF(!file || !header, USF_ERROR_PARAM);
+    if (!*options)
+        *options = &defaults;
+
+    block_size = (*options)->block_size ?
+        (*options)->block_size : USF_BUF_SIZE;
+    E_IF(block_size < USF_BLOCK_MIN_SIZE || block_size > USF_BLOCK_MAX_SIZE,
+         USF_ERROR_PARAM);
+    /* bzip2 and xz would only reject the level when compressing */
+    if (header->compression == USF_COMPRESSION_BZIP2 ||
+        header->compression == USF_COMPRESSION_XZ)
+        E_IF((*options)->level < 0 || (*options)->level > 9,
+             USF_ERROR_PARAM);
     /* Currently we require the native endian bit to be set. We could
      * support having the foreign bit set instead, but we won't do
      * that at the moment. Having both bits set will always constitue
      * an error. */
     E_IF(!(header->flags & USF_FLAG_NATIVE_ENDIAN) ||
          header->flags & USF_FLAG_FOREIGN_ENDIAN, USF_ERROR_PARAM);
+    E_IF(header->version > USF_VERSION_CURRENT, USF_ERROR_UNSUPPORTED);
+    E_IF(!valid_delta_modes(header), USF_ERROR_PARAM);
 
-    f = malloc(sizeof(usf_file_t));
-    E_NULL(f, USF_ERROR_MEM);
-
-    f->header = NULL;
+ret_err:
+    return error;
+}
 
-    if (path)
-        f->file = fopen(path, "w");
-    else
-        f->file = stdout;
+/** Create a file writing to io, which is closed on errors */
+static usf_error_t
+create_io(usf_file_t **file, usf_io_t *io, const usf_header_t *header,
+          const usf_options_t *options)
+{
+    const size_t block_size = options->block_size ?
+        options->block_size : USF_BUF_SIZE;
+    usf_file_t *f = NULL;
+    usf_error_t error;
 
-    E_NULL(f->file, USF_ERROR_SYS);
-    memset(&f->last_access, 0, sizeof(f->last_access));
+    /* Zero everything to make cleanup on errors safe */
+    f = calloc(1, sizeof(usf_file_t));
+    if (!f) {
+        usf_io_close(io);
+        return USF_ERROR_MEM;
+    }
 
-    E_ERROR(write_magic(f->file));
+    f->io = io;
+    E_ERROR(write_magic(f->io));
     E_ERROR(usf_header_dup(&f->header, header));
-    E_ERROR(usf_header_write(f->file, f->header));
+    E_ERROR(usf_header_write(f->io, f->header));
+    f->blocks = f->header->version >= USF_VERSION_BLOCKS;
+    f->data_offset = sizeof(usf_magic) + usf_header_size(f->header);
+    f->offset = f->data_offset;
+    E_ERROR(usf_events_select(f));
     
     E_ERROR(check_compression(f->header->compression));
     f->io_methods = &io_methods[f->header->compression];
+    E_ERROR(alloc_buffers(f, block_size));
+    /* Only the encoder needs to look up pcs in the dictionary */
+    if (f->pcdict)
+        E_NULL(f->pcdict_hash = calloc(USF_PCDICT_HASH_SIZE,
+                                       sizeof(*f->pcdict_hash)),
+               USF_ERROR_MEM);
+    f->level = options->level;
+    f->threads = options->threads;
     E_ERROR(usf_internal_init(f, USF_MODE_WRITE));
+    if (f->blocks)
+        E_ERROR(usf_block_init_pool(f, options->threads));
+    if (options->stats && f->blocks)
+        E_ERROR(usf_stats_init(f));
+    if (options->async || options->concurrent)
+        E_ERROR(usf_async_start(f, options->async, options->concurrent));
 
     *file = f;
     return USF_ERROR_OK;
 
 ret_err:
     if (f) {
-	if (f->file)
-	    fclose(f->file);
+	if (f->io)
+	    usf_io_close(f->io);
 	if (f->header)
 	    usf_header_free(f->header);
+	free_buffers(f);
 	free(f);
     }
 
     return error;
 }
 
+usf_error_t
+usf_create_opts(usf_file_t **file,
+                const char *path, const usf_header_t *header,
+                const usf_options_t *options)
+{
+    usf_error_t error;
+    usf_io_t *io;
+
+    E_ERROR(check_create(file, header, &options));
+    E_ERROR(usf_io_open(&io, path, USF_MODE_WRITE, options));
+    E_ERROR(create_io(file, io, header, options));
+
+ret_err:
+    return error;
+}
+
+usf_error_t
+usf_create_fd(usf_file_t **file, int fd, const usf_header_t *header,
+              const usf_options_t *options)
+{
+    usf_error_t error;
+    usf_io_t *io;
+
+    E_ERROR(check_create(file, header, &options));
+    E_ERROR(usf_io_open_fd(&io, fd, USF_MODE_WRITE, options));
+    E_ERROR(create_io(file, io, header, options));
+
+ret_err:
+    return error;
+}
+
+usf_error_t
+usf_create_mem(usf_file_t **file, void **data, size_t *size,
+               const usf_header_t *header, const usf_options_t *options)
+{
+    usf_error_t error;
+    usf_io_t *io;
+
+    E_IF(!data || !size, USF_ERROR_PARAM);
+    *data = NULL;
+    *size = 0;
+    E_ERROR(check_create(file, header, &options));
+    E_ERROR(usf_io_create_mem(&io, data, size));
+    if ((error = create_io(file, io, header, options)) != USF_ERROR_OK) {
+        /* Closing the buffer on errors handed it to us */
+        free(*data);
+        *data = NULL;
+        *size = 0;
+    }
+
+ret_err:
+    return error;
+}
+
+usf_error_t
+usf_create(usf_file_t **file,
+	   const char *path, const usf_header_t *header)
+{
+    return usf_create_opts(file, path, header, NULL);
+}
+
 usf_error_t
 usf_close(usf_file_t *file)
 {
-    if (!file || !file->file)
+    usf_error_t error, fini_error;
+
+    if (!file || !file->io)
 	return USF_ERROR_PARAM;
 
-    usf_internal_fini(file);
+    /* Write the events still queued for the background writer */
+    error = usf_async_stop(file);
+    usf_prefetch_stop(file);
+    fini_error = usf_internal_fini(file);
+    if (error == USF_ERROR_OK)
+        error = fini_error;
     usf_header_free(file->header);
-    fclose(file->file);
+    if ((fini_error = usf_io_close(file->io)) != USF_ERROR_OK &&
+        error == USF_ERROR_OK)
+        error = fini_error;
+    free_buffers(file);
     free(file);
-    return USF_ERROR_OK;
+    return error;
 }
 
 usf_error_t
@@ -208,6 +576,42 @@ usf_header(const usf_header_t **header, usf_file_t *file)
     return USF_ERROR_OK;
 }
 
+usf_error_t
+usf_file_stats(const usf_stats_t **stats, usf_file_t *file)
+{
+    usf_error_t error = USF_ERROR_OK;
+
+    E_IF(!stats || !file || file->mode != USF_MODE_READ, USF_ERROR_PARAM);
+    E_IF(!file->blocks, USF_ERROR_UNSUPPORTED);
+    E_ERROR(usf_block_read_stats(file));
+    E_IF(!file->stats, USF_ERROR_UNSUPPORTED);
+
+    *stats = file->stats;
+
+ret_err:
+    return error;
+}
+
+usf_error_t
+usf_tell(usf_file_t *file, uint64_t *pos)
+{
+    if (!file || !pos)
+	return USF_ERROR_PARAM;
+
+    *pos = file->async ? usf_async_events(file) : file->events;
+    return USF_ERROR_OK;
+}
+
+usf_error_t
+usf_write_stalls(usf_file_t *file, uint64_t *stalls)
+{
+    if (!file || !stalls)
+	return USF_ERROR_PARAM;
+
+    *stalls = file->async ? usf_async_stalls(file) : 0;
+    return USF_ERROR_OK;
+}
+
 /*
  * Local Variables:
  * mode: c
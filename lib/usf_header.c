@@ -40,10 +40,11 @@
 #include "os_compat.h"
 
 #include "usf_header.h"
+#include "usf_io.h"
 #include "error.h"
 
 usf_error_t
-usf_header_read(usf_header_t **header, FILE *f)
+usf_header_read(usf_header_t **header, usf_io_t *f)
 {
     usf_error_t error = USF_ERROR_OK;
     uint32_t header_len;
@@ -53,11 +54,12 @@ usf_header_read(usf_header_t **header, FILE *f)
     size_t data_left;
     int i;
 
-    E_IF_IO(f, fread(&header_len, sizeof(header_len), 1, f) != 1);
+    E_IF_IO(f, usf_io_read(f, &header_len, sizeof(header_len)) !=
+            sizeof(header_len));
     E_IF(header_len < offsetof(usf_header_t, argv), USF_ERROR_FILE);
     E_NULL(c_header = malloc(header_len), USF_ERROR_MEM);
     
-    E_IF_IO(f, fread(c_header, header_len, 1, f) != 1);
+    E_IF_IO(f, usf_io_read(f, c_header, header_len) != header_len);
     E_NULL(h = malloc(sizeof(usf_header_t)), USF_ERROR_MEM);
     memcpy(h, c_header, offsetof(usf_header_t, argv));
 
@@ -97,26 +99,42 @@ ret_err:
     return error;
 }
 
-usf_error_t
-usf_header_write(FILE *f, const usf_header_t *h)
+static uint32_t
+calc_header_len(const usf_header_t *h)
 {
-    usf_error_t error = USF_ERROR_OK;
-    uint32_t header_len = offsetof(usf_header_t, argv);
+    uint32_t len = offsetof(usf_header_t, argv);
     int i;
 
     for (i = 0; i < h->argc; i++)
-	header_len += strlen(h->argv[i]) + 1;
+	len += strlen(h->argv[i]) + 1;
+
+    return len;
+}
+
+usf_error_t
+usf_header_write(usf_io_t *f, const usf_header_t *h)
+{
+    usf_error_t error = USF_ERROR_OK;
+    uint32_t header_len = calc_header_len(h);
+    int i;
 
-    E_IF_IO(f, fwrite(&header_len, sizeof(header_len), 1, f) != 1);
-    E_IF_IO(f, fwrite(h, offsetof(usf_header_t, argv), 1, f) != 1);
+    E_ERROR(usf_io_write(f, &header_len, sizeof(header_len)));
+    E_ERROR(usf_io_write(f, h, offsetof(usf_header_t, argv)));
 
     for (i = 0; i < h->argc; i++)
-	E_IF_IO(f, fwrite(h->argv[i], strlen(h->argv[i]) + 1, 1, f) != 1);
+	E_ERROR(usf_io_write(f, h->argv[i], strlen(h->argv[i]) + 1));
 
 ret_err:
     return error;
 }
 
+/** Size of the header on disk, including the length field */
+size_t
+usf_header_size(const usf_header_t *h)
+{
+    return sizeof(uint32_t) + calc_header_len(h);
+}
+
 usf_error_t
 usf_header_free(usf_header_t *header)
 {
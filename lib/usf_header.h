@@ -34,8 +34,9 @@
 
 #include "usf_priv.h"
 
-usf_error_t usf_header_read(usf_header_t **header, FILE *f);
-usf_error_t usf_header_write(FILE *f, const usf_header_t *header);
+usf_error_t usf_header_read(usf_header_t **header, usf_io_t *f);
+usf_error_t usf_header_write(usf_io_t *f, const usf_header_t *header);
+size_t usf_header_size(const usf_header_t *header);
 usf_error_t usf_header_free(usf_header_t *header);
 usf_error_t usf_header_dup(usf_header_t **out, const usf_header_t *in);
 
@@ -28,13 +28,185 @@
  * OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <unistd.h>
 #include <assert.h>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
 #include <bzlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef HAVE_XZ
+#include <lzma.h>
+#endif
 
 #include "usf_priv.h"
 #include "usf_internal.h"
+#include "usf_block.h"
+#include "usf_readahead.h"
+#include "usf_io.h"
+
+
+/* ********************************************************************** */
+
+usf_error_t
+usf_internal_init(usf_file_t *file, int mode)
+{
+    assert(file && file->io_methods && file->io_methods->init);
+    file->mode = mode;
+    file->buf_pos = 0;
+    file->buf_len = 0;
+
+    if (file->blocks) {
+        usf_block_begin(file);
+        return USF_ERROR_OK;
+    } else
+        return file->io_methods->init(file, mode);
+}
+
+usf_error_t
+usf_internal_fini(usf_file_t *file)
+{
+    usf_error_t error = USF_ERROR_OK;
+    usf_error_t fini_error;
+
+    assert(file && file->io_methods && file->io_methods->fini);
+    if (file->mode == USF_MODE_WRITE)
+        error = usf_internal_flush(file);
+
+    if (file->blocks) {
+        if (file->mode == USF_MODE_WRITE && error == USF_ERROR_OK)
+            error = usf_block_finish(file);
+        return error;
+    }
+
+    usf_readahead_stop(file);
+    fini_error = file->io_methods->fini(file);
+    return error != USF_ERROR_OK ? error : fini_error;
+}
+
+/**
+ * Restart reading from the first event in the file. Unmapped files
+ * must be seekable.
+ */
+usf_error_t
+usf_internal_rewind(usf_file_t *file)
+{
+    usf_error_t error;
+    int readahead = file->readahead != NULL;
+
+    assert(file && file->mode == USF_MODE_READ);
+    if (file->blocks)
+        return usf_block_seek(file, file->data_offset, 0);
+
+    memset(&file->last_access, 0, sizeof(file->last_access));
+    file->events = 0;
+
+    /* The staging buffer covers all events in mapped files */
+    if (file->map) {
+        file->buf_pos = 0;
+        return USF_ERROR_OK;
+    }
+
+    usf_readahead_stop(file);
+    if (usf_io_seek(file->io, file->data_offset) != USF_ERROR_OK)
+        return USF_ERROR_UNSUPPORTED;
+
+    /* Restart the decompressor */
+    error = file->io_methods->fini(file);
+    if (error != USF_ERROR_OK)
+        return error;
+
+    error = usf_internal_init(file, USF_MODE_READ);
+    if (error == USF_ERROR_OK && readahead)
+        error = usf_readahead_start(file);
+
+    return error;
+}
+
+usf_error_t
+usf_internal_fill(usf_file_t *file, size_t count)
+{
+    usf_error_t error;
+    size_t avail = file->buf_len - file->buf_pos;
+    size_t len;
+
+    assert(file && file->io_methods && file->io_methods->read);
+
+    /* Records never cross block boundaries, so the current block has
+     * to be fully decoded before the next one is loaded. */
+    if (file->blocks) {
+        if (avail)
+            return USF_ERROR_FILE;
+
+        /* Continue with the rest of a column block that was
+         * partially read by usf_read_columns() */
+        if (file->col_pos < file->col_events)
+            error = usf_block_records(file);
+        else
+            error = usf_block_read(file);
+        if (error != USF_ERROR_OK)
+            return error;
+
+        return file->buf_len < count ? USF_ERROR_FILE : USF_ERROR_OK;
+    }
 
+    /* A mapped file is already in the buffer in its entirety */
+    if (file->map)
+        return avail ? USF_ERROR_FILE : USF_ERROR_EOF;
+
+    assert(count <= file->buf_size);
+
+    /* Move the undecoded tail to the beginning of the buffer to make
+     * room for a large read. */
+    if (avail && file->buf_pos)
+        memmove(file->buf, file->buf + file->buf_pos, avail);
+    file->buf_pos = 0;
+    file->buf_len = avail;
+
+    while (file->buf_len < count) {
+        if (file->readahead)
+            error = usf_readahead_read(file, file->buf + file->buf_len,
+                                       file->buf_size - file->buf_len,
+                                       &len);
+        else
+            error = file->io_methods->read(file, file->buf + file->buf_len,
+                                           file->buf_size - file->buf_len,
+                                           &len);
+        if (error == USF_ERROR_EOF)
+            return file->buf_len ? USF_ERROR_FILE : USF_ERROR_EOF;
+        else if (error != USF_ERROR_OK)
+            return error;
+
+        file->buf_len += len;
+    }
+
+    return USF_ERROR_OK;
+}
+
+usf_error_t
+usf_internal_flush(usf_file_t *file)
+{
+    usf_error_t error = USF_ERROR_OK;
+
+    assert(file && file->io_methods && file->io_methods->write);
+    if (file->blocks)
+        return usf_block_write(file);
+
+    if (file->buf_len)
+        error = file->io_methods->write(file, file->buf, file->buf_len);
+    file->buf_len = 0;
+
+    return error;
+}
 
 /* ********************************************************************** */
 
@@ -51,106 +223,846 @@ fini_none(usf_file_t *file)
 }
 
 usf_error_t
-read_none(usf_file_t *file, void *buf, size_t count)
+read_none(usf_file_t *file, void *buf, size_t count, size_t *len)
+{
+    *len = usf_io_read(file->io, buf, count);
+    if (*len == 0)
+        return usf_io_error(file->io) ? USF_ERROR_SYS : USF_ERROR_EOF;
+
+    return USF_ERROR_OK;
+}
+
+usf_error_t
+write_none(usf_file_t *file, const void *buf, size_t count)
+{
+    return usf_io_write(file->io, buf, count);
+}
+
+/* ********************************************************************** */
+
+/* Stream state of pre-0.3 files */
+typedef struct {
+    bz_stream strm;
+    /* Compressed data about to be written to the file */
+    char buf[64 * 1024];
+    /* Set while the decoder is inside a stream and when it has
+     * reached the end of the last stream */
+    int in_stream;
+    int end;
+} bzip2_stream_t;
+
+static usf_error_t
+bzip2_error(int bzerror)
+{
+    switch (bzerror) {
+    case BZ_DATA_ERROR:
+    case BZ_DATA_ERROR_MAGIC:
+    case BZ_UNEXPECTED_EOF:
+        return USF_ERROR_FILE;
+    case BZ_MEM_ERROR:
+        return USF_ERROR_MEM;
+    default:
+        return USF_ERROR_SYS;
+    }
+}
+
+usf_error_t
+init_bzip2(usf_file_t *file, int mode)
+{
+    bzip2_stream_t *s;
+    int ret;
+
+    if (!(s = calloc(1, sizeof(*s))))
+        return USF_ERROR_MEM;
+
+    /* Small bzip2 blocks, they decompress noticeably faster */
+    if (mode == USF_MODE_READ) {
+        ret = BZ2_bzDecompressInit(&s->strm, 0, 0);
+    } else {
+        ret = BZ2_bzCompressInit(&s->strm, 1, 0, 30);
+        s->strm.next_out = s->buf;
+        s->strm.avail_out = sizeof(s->buf);
+    }
+
+    if (ret != BZ_OK) {
+        free(s);
+        return bzip2_error(ret);
+    }
+
+    file->stream = s;
+    return USF_ERROR_OK;
+}
+
+/* Run the compressor until it has consumed all input, or until it
+ * has flushed everything if action is BZ_FINISH. */
+static usf_error_t
+write_bzip2_op(usf_file_t *file, int action)
+{
+    bzip2_stream_t *s = file->stream;
+    usf_error_t error;
+    int ret;
+
+    for (;;) {
+        ret = BZ2_bzCompress(&s->strm, action);
+        if (ret != BZ_RUN_OK && ret != BZ_FINISH_OK && ret != BZ_STREAM_END)
+            return bzip2_error(ret);
+
+        if (s->strm.avail_out == 0 || ret == BZ_STREAM_END) {
+            size_t len = sizeof(s->buf) - s->strm.avail_out;
+
+            if ((error = usf_io_write(file->io, s->buf, len)) !=
+                USF_ERROR_OK)
+                return error;
+            s->strm.next_out = s->buf;
+            s->strm.avail_out = sizeof(s->buf);
+        }
+
+        if (action == BZ_FINISH ?
+            ret == BZ_STREAM_END : s->strm.avail_in == 0)
+            return USF_ERROR_OK;
+    }
+}
+
+usf_error_t
+fini_bzip2(usf_file_t *file)
 {
     usf_error_t error = USF_ERROR_OK;
+    bzip2_stream_t *s = file->stream;
 
-    if (fread(buf, count, 1, file->file) != 1)
-        error = feof(file->file) ? USF_ERROR_EOF : USF_ERROR_SYS;
+    if (!s)
+        return USF_ERROR_OK;
+
+    if (file->mode == USF_MODE_READ) {
+        BZ2_bzDecompressEnd(&s->strm);
+    } else {
+        error = write_bzip2_op(file, BZ_FINISH);
+        BZ2_bzCompressEnd(&s->strm);
+    }
+    free(s);
+    file->stream = NULL;
 
     return error;
 }
 
 usf_error_t
-write_none(usf_file_t *file, const void *buf, size_t count)
+read_bzip2(usf_file_t *file, void *buf, size_t count, size_t *len)
+{
+    bzip2_stream_t *s = file->stream;
+    const unsigned int size = count > UINT_MAX ? UINT_MAX : count;
+    usf_error_t error;
+    const char *src;
+    size_t avail;
+    int ret;
+
+    *len = 0;
+    s->strm.next_out = buf;
+    s->strm.avail_out = size;
+
+    /* Files written by parallel compressors consist of several
+     * concatenated streams, decode them as one stream */
+    while (s->strm.avail_out == size && !s->end) {
+        if ((error = usf_io_peek(file->io, &src, &avail)) != USF_ERROR_OK)
+            return error;
+        if (!avail) {
+            if (s->in_stream)
+                return USF_ERROR_FILE;
+            s->end = 1;
+            break;
+        }
+
+        s->strm.next_in = (char *)src;
+        s->strm.avail_in = avail > UINT_MAX ? UINT_MAX : avail;
+        ret = BZ2_bzDecompress(&s->strm);
+        usf_io_consume(file->io, (avail > UINT_MAX ? UINT_MAX : avail) -
+                       s->strm.avail_in);
+        s->in_stream = 1;
+
+        if (ret == BZ_STREAM_END) {
+            BZ2_bzDecompressEnd(&s->strm);
+            s->in_stream = 0;
+            if ((ret = BZ2_bzDecompressInit(&s->strm, 0, 0)) != BZ_OK)
+                return bzip2_error(ret);
+        } else if (ret != BZ_OK)
+            return bzip2_error(ret);
+    }
+
+    *len = size - s->strm.avail_out;
+    return *len ? USF_ERROR_OK : USF_ERROR_EOF;
+}
+
+usf_error_t
+write_bzip2(usf_file_t *file, const void *buf, size_t count)
+{
+    bzip2_stream_t *s = file->stream;
+    usf_error_t error;
+
+    while (count) {
+        const unsigned int len = count > UINT_MAX ? UINT_MAX : count;
+
+        s->strm.next_in = (char *)buf;
+        s->strm.avail_in = len;
+        if ((error = write_bzip2_op(file, BZ_RUN)) != USF_ERROR_OK)
+            return error;
+
+        buf = (const char *)buf + len;
+        count -= len;
+    }
+
+    return USF_ERROR_OK;
+}
+
+size_t
+bound_bzip2(size_t len)
+{
+    /* From the bzip2 manual: "To guarantee that the compressed data
+     * will fit in its buffer, allocate an output buffer of size 1%
+     * larger than the uncompressed data, plus six hundred extra
+     * bytes." */
+    return len + len / 100 + 600;
+}
+
+usf_error_t
+compress_bzip2(void *dst, size_t *dst_len,
+               const void *src, size_t src_len, int level)
+{
+    unsigned int len = *dst_len > UINT_MAX ? UINT_MAX : *dst_len;
+    int ret;
+
+    /* Default to the same settings as the stream writer, larger
+     * bzip2 blocks compress better but decompress noticeably
+     * slower. */
+    ret = BZ2_bzBuffToBuffCompress(dst, &len, (char *)src, src_len,
+                                   level ? level : 1, 0, 30);
+    if (ret != BZ_OK)
+        return ret == BZ_MEM_ERROR ? USF_ERROR_MEM : USF_ERROR_SYS;
+
+    *dst_len = len;
+    return USF_ERROR_OK;
+}
+
+usf_error_t
+decompress_bzip2(void *dst, size_t *dst_len,
+                 const void *src, size_t src_len)
+{
+    unsigned int len = *dst_len > UINT_MAX ? UINT_MAX : *dst_len;
+    int ret;
+
+    ret = BZ2_bzBuffToBuffDecompress(dst, &len, (char *)src, src_len, 0, 0);
+    switch (ret) {
+    case BZ_OK:
+        *dst_len = len;
+        return USF_ERROR_OK;
+    case BZ_MEM_ERROR:
+        return USF_ERROR_MEM;
+    case BZ_OUTBUFF_FULL:
+    case BZ_DATA_ERROR:
+    case BZ_DATA_ERROR_MAGIC:
+    case BZ_UNEXPECTED_EOF:
+        return USF_ERROR_FILE;
+    default:
+        return USF_ERROR_SYS;
+    }
+}
+
+/* ********************************************************************** */
+
+#ifdef HAVE_ZSTD
+
+/* Stream state of pre-0.3 files */
+typedef struct {
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+
+    /* Compressed data about to be written to the file */
+    char *buf;
+    size_t buf_size;
+    /* Result of the last ZSTD_decompressStream() call, 0 at frame
+     * boundaries */
+    size_t frame_left;
+} zstd_stream_t;
+
+usf_error_t
+init_zstd(usf_file_t *file, int mode)
 {
     usf_error_t error = USF_ERROR_OK;
+    zstd_stream_t *s;
+
+    E_NULL(s = calloc(1, sizeof(*s)), USF_ERROR_MEM);
+    file->stream = s;
+
+    if (mode == USF_MODE_READ) {
+        E_NULL(s->dctx = ZSTD_createDCtx(), USF_ERROR_MEM);
+        return USF_ERROR_OK;
+    } else {
+        s->buf_size = ZSTD_CStreamOutSize();
+        E_NULL(s->cctx = ZSTD_createCCtx(), USF_ERROR_MEM);
+        if (file->level)
+            ZSTD_CCtx_setParameter(s->cctx, ZSTD_c_compressionLevel,
+                                   file->level);
+        /* Fails if the library was built without thread support,
+         * which simply leaves compression on the calling thread. */
+        if (file->threads)
+            ZSTD_CCtx_setParameter(s->cctx, ZSTD_c_nbWorkers,
+                                   file->threads);
+    }
 
-    if (fwrite(buf, count, 1, file->file) != 1)
-        error = USF_ERROR_SYS;
+    E_NULL(s->buf = malloc(s->buf_size), USF_ERROR_MEM);
 
+ret_err:
     return error;
 }
 
-/* ********************************************************************** */
+static usf_error_t
+write_zstd_op(usf_file_t *file, ZSTD_inBuffer *in, ZSTD_EndDirective op)
+{
+    zstd_stream_t *s = file->stream;
+    ZSTD_outBuffer out;
+    usf_error_t error;
+    size_t left;
+
+    do {
+        out.dst = s->buf;
+        out.size = s->buf_size;
+        out.pos = 0;
+
+        left = ZSTD_compressStream2(s->cctx, &out, in, op);
+        if (ZSTD_isError(left))
+            return USF_ERROR_SYS;
+
+        if ((error = usf_io_write(file->io, s->buf, out.pos)) !=
+            USF_ERROR_OK)
+            return error;
+    } while (op == ZSTD_e_end ? left != 0 : in->pos < in->size);
+
+    return USF_ERROR_OK;
+}
 
 usf_error_t
-init_bzip2(usf_file_t *file, int mode)
+fini_zstd(usf_file_t *file)
+{
+    usf_error_t error = USF_ERROR_OK;
+    zstd_stream_t *s = file->stream;
+    ZSTD_inBuffer in = { NULL, 0, 0 };
+
+    if (!s)
+        return USF_ERROR_OK;
+
+    if (file->mode == USF_MODE_WRITE)
+        error = write_zstd_op(file, &in, ZSTD_e_end);
+
+    ZSTD_freeCCtx(s->cctx);
+    ZSTD_freeDCtx(s->dctx);
+    free(s->buf);
+    free(s);
+    file->stream = NULL;
+
+    return error;
+}
+
+usf_error_t
+read_zstd(usf_file_t *file, void *buf, size_t count, size_t *len)
+{
+    zstd_stream_t *s = file->stream;
+    ZSTD_outBuffer out = { buf, count, 0 };
+    ZSTD_inBuffer in;
+    usf_error_t error;
+    const char *src;
+
+    *len = 0;
+
+    /* Concatenated frames are decoded as one stream */
+    while (out.pos == 0) {
+        if ((error = usf_io_peek(file->io, &src, &in.size)) != USF_ERROR_OK)
+            return error;
+        if (in.size == 0)
+            return s->frame_left ? USF_ERROR_FILE : USF_ERROR_EOF;
+
+        in.src = src;
+        in.pos = 0;
+        s->frame_left = ZSTD_decompressStream(s->dctx, &out, &in);
+        usf_io_consume(file->io, in.pos);
+        if (ZSTD_isError(s->frame_left))
+            return USF_ERROR_FILE;
+    }
+
+    *len = out.pos;
+    return USF_ERROR_OK;
+}
+
+usf_error_t
+write_zstd(usf_file_t *file, const void *buf, size_t count)
+{
+    ZSTD_inBuffer in = { buf, count, 0 };
+
+    return write_zstd_op(file, &in, ZSTD_e_continue);
+}
+
+size_t
+bound_zstd(size_t len)
 {
-    int bzerror;
+    return ZSTD_compressBound(len);
+}
 
-    if (mode == USF_MODE_READ) 
-        file->bzfile = BZ2_bzReadOpen(&bzerror, file->file, 0, 0, NULL, 0);
-    else
-        file->bzfile = BZ2_bzWriteOpen(&bzerror, file->file, 1, 0, 30);
+usf_error_t
+compress_zstd(void *dst, size_t *dst_len,
+              const void *src, size_t src_len, int level)
+{
+    size_t ret;
 
-    if (bzerror != BZ_OK)
+    ret = ZSTD_compress(dst, *dst_len, src, src_len,
+                        level ? level : ZSTD_CLEVEL_DEFAULT);
+    if (ZSTD_isError(ret))
         return USF_ERROR_SYS;
 
+    *dst_len = ret;
     return USF_ERROR_OK;
 }
 
 usf_error_t
-fini_bzip2(usf_file_t *file)
+decompress_zstd(void *dst, size_t *dst_len,
+                const void *src, size_t src_len)
+{
+    size_t ret;
+
+    ret = ZSTD_decompress(dst, *dst_len, src, src_len);
+    if (ZSTD_isError(ret))
+        return USF_ERROR_FILE;
+
+    *dst_len = ret;
+    return USF_ERROR_OK;
+}
+
+#endif
+
+/* ********************************************************************** */
+
+#ifdef HAVE_LZ4
+
+/* Uncompressed bytes passed to LZ4F_compressUpdate() at a time, keeps
+ * the output buffer small. */
+#define LZ4_CHUNK_SIZE (64 * 1024)
+
+/* Stream state of pre-0.3 files */
+typedef struct {
+    LZ4F_cctx *cctx;
+    LZ4F_dctx *dctx;
+    LZ4F_preferences_t prefs;
+
+    /* Compressed data about to be written to the file */
+    char *buf;
+    size_t buf_size;
+    /* Size hint returned by the last LZ4F_decompress() call, 0 at
+     * frame boundaries */
+    size_t frame_left;
+} lz4_stream_t;
+
+/* Frame parameters favour speed: linked 64 KiB blocks, no
+ * checksums. Levels below 3 use the fast compressor (negative levels
+ * trade ratio for even more speed), higher levels use LZ4HC. */
+static void
+lz4_prefs(LZ4F_preferences_t *prefs, int level)
+{
+    memset(prefs, 0, sizeof(*prefs));
+    prefs->frameInfo.blockSizeID = LZ4F_max64KB;
+    prefs->frameInfo.blockMode = LZ4F_blockLinked;
+    prefs->compressionLevel = level;
+}
+
+usf_error_t
+init_lz4(usf_file_t *file, int mode)
+{
+    usf_error_t error = USF_ERROR_OK;
+    lz4_stream_t *s;
+    size_t ret;
+
+    E_NULL(s = calloc(1, sizeof(*s)), USF_ERROR_MEM);
+    file->stream = s;
+
+    if (mode == USF_MODE_READ) {
+        E_IF(LZ4F_isError(LZ4F_createDecompressionContext(&s->dctx,
+                                                          LZ4F_VERSION)),
+             USF_ERROR_MEM);
+    } else {
+        lz4_prefs(&s->prefs, file->level);
+        s->buf_size = LZ4F_compressBound(LZ4_CHUNK_SIZE, &s->prefs);
+        E_IF(LZ4F_isError(LZ4F_createCompressionContext(&s->cctx,
+                                                        LZ4F_VERSION)),
+             USF_ERROR_MEM);
+        E_NULL(s->buf = malloc(s->buf_size), USF_ERROR_MEM);
+
+        ret = LZ4F_compressBegin(s->cctx, s->buf, s->buf_size, &s->prefs);
+        E_IF(LZ4F_isError(ret), USF_ERROR_SYS);
+        E_ERROR(usf_io_write(file->io, s->buf, ret));
+    }
+
+ret_err:
+    return error;
+}
+
+usf_error_t
+fini_lz4(usf_file_t *file)
+{
+    usf_error_t error = USF_ERROR_OK;
+    lz4_stream_t *s = file->stream;
+    size_t ret;
+
+    if (!s)
+        return USF_ERROR_OK;
+
+    if (file->mode == USF_MODE_WRITE && s->cctx) {
+        ret = LZ4F_compressEnd(s->cctx, s->buf, s->buf_size, NULL);
+        if (LZ4F_isError(ret))
+            error = USF_ERROR_SYS;
+        else
+            error = usf_io_write(file->io, s->buf, ret);
+    }
+
+    LZ4F_freeCompressionContext(s->cctx);
+    LZ4F_freeDecompressionContext(s->dctx);
+    free(s->buf);
+    free(s);
+    file->stream = NULL;
+
+    return error;
+}
+
+usf_error_t
+read_lz4(usf_file_t *file, void *buf, size_t count, size_t *len)
+{
+    lz4_stream_t *s = file->stream;
+    usf_error_t error;
+    size_t dst_len = 0;
+    const char *src;
+    size_t src_len;
+
+    *len = 0;
+
+    /* Concatenated frames are decoded as one stream */
+    while (dst_len == 0) {
+        if ((error = usf_io_peek(file->io, &src, &src_len)) !=
+            USF_ERROR_OK)
+            return error;
+        if (src_len == 0)
+            return s->frame_left ? USF_ERROR_FILE : USF_ERROR_EOF;
+
+        dst_len = count;
+        s->frame_left = LZ4F_decompress(s->dctx, buf, &dst_len,
+                                        src, &src_len, NULL);
+        if (LZ4F_isError(s->frame_left))
+            return USF_ERROR_FILE;
+        usf_io_consume(file->io, src_len);
+    }
+
+    *len = dst_len;
+    return USF_ERROR_OK;
+}
+
+usf_error_t
+write_lz4(usf_file_t *file, const void *buf, size_t count)
 {
-    int bzerror;
+    lz4_stream_t *s = file->stream;
+    const char *src = buf;
+    usf_error_t error;
+    size_t ret;
+
+    while (count) {
+        size_t len = count > LZ4_CHUNK_SIZE ? LZ4_CHUNK_SIZE : count;
+
+        ret = LZ4F_compressUpdate(s->cctx, s->buf, s->buf_size,
+                                  src, len, NULL);
+        if (LZ4F_isError(ret))
+            return USF_ERROR_SYS;
+        if ((error = usf_io_write(file->io, s->buf, ret)) != USF_ERROR_OK)
+            return error;
 
-    if (file->mode == USF_MODE_READ)
-        BZ2_bzReadClose(&bzerror, file->bzfile);
-    else
-        BZ2_bzWriteClose(&bzerror, file->bzfile, 0, NULL, NULL);
+        src += len;
+        count -= len;
+    }
 
-    if (bzerror != BZ_OK)
+    return USF_ERROR_OK;
+}
+
+size_t
+bound_lz4(size_t len)
+{
+    LZ4F_preferences_t prefs;
+
+    lz4_prefs(&prefs, 0);
+    return LZ4F_compressFrameBound(len, &prefs);
+}
+
+usf_error_t
+compress_lz4(void *dst, size_t *dst_len,
+             const void *src, size_t src_len, int level)
+{
+    LZ4F_preferences_t prefs;
+    size_t ret;
+
+    lz4_prefs(&prefs, level);
+    ret = LZ4F_compressFrame(dst, *dst_len, src, src_len, &prefs);
+    if (LZ4F_isError(ret))
         return USF_ERROR_SYS;
 
+    *dst_len = ret;
     return USF_ERROR_OK;
 }
 
 usf_error_t
-read_bzip2(usf_file_t *file, void *buf, size_t count)
+decompress_lz4(void *dst, size_t *dst_len,
+               const void *src, size_t src_len)
+{
+    usf_error_t error = USF_ERROR_OK;
+    LZ4F_dctx *dctx;
+    size_t len = *dst_len;
+    size_t ret;
+
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+        return USF_ERROR_MEM;
+
+    /* The whole frame must fit in dst, anything else is corrupt */
+    ret = LZ4F_decompress(dctx, dst, &len, src, &src_len, NULL);
+    E_IF(LZ4F_isError(ret) || ret != 0, USF_ERROR_FILE);
+    *dst_len = len;
+
+ret_err:
+    LZ4F_freeDecompressionContext(dctx);
+    return error;
+}
+
+#endif
+
+/* ********************************************************************** */
+
+#ifdef HAVE_XZ
+
+/* Stream state of pre-0.3 files */
+typedef struct {
+    lzma_stream strm;
+
+    /* Compressed data about to be written to the file */
+    uint8_t buf[64 * 1024];
+    /* Set when the input file has been consumed and when the decoder
+     * has reached the end of the last stream */
+    int in_eof;
+    int end;
+} xz_stream_t;
+
+static usf_error_t
+xz_error(lzma_ret ret)
+{
+    switch (ret) {
+    case LZMA_OK:
+    case LZMA_STREAM_END:
+        return USF_ERROR_OK;
+    case LZMA_MEM_ERROR:
+    case LZMA_MEMLIMIT_ERROR:
+        return USF_ERROR_MEM;
+    case LZMA_OPTIONS_ERROR:
+        return USF_ERROR_PARAM;
+    case LZMA_FORMAT_ERROR:
+    case LZMA_DATA_ERROR:
+    case LZMA_BUF_ERROR:
+        return USF_ERROR_FILE;
+    default:
+        return USF_ERROR_SYS;
+    }
+}
+
+/* Level 1-9 selects the xz preset, 0 the default preset (6) */
+static uint32_t
+xz_preset(int level)
+{
+    return level ? (uint32_t)level : LZMA_PRESET_DEFAULT;
+}
+
+usf_error_t
+init_xz(usf_file_t *file, int mode)
 {
-    int bzerror;
-    int read;
-    usf_error_t usf_error = USF_ERROR_OK;
+    usf_error_t error = USF_ERROR_OK;
+    lzma_stream init = LZMA_STREAM_INIT;
+    lzma_mt mt;
+    xz_stream_t *s;
+    lzma_ret ret;
 
-    /* Error handling: If BZ2_bzRead(bzerror, b, count) reads the last count
-     * bytes in the file, it returns count and sets bzerror to BZ_STREAM_END,
-     * in this case we want to return USF_ERROR_OK, since there are no errors,
-     * and then return USF_ERROR_EOF on the next call.
-     *
-     * Note: If BZ2_bzRead is called once more after it has returned
-     * BZ_STREAM_END it seems to always return BZ_SEQUENCE_ERROR, which
-     * we could check for. However, according to the manual
-     * BZ_SEQUENCE_ERROR is returned "if b was opened with BZ2_bzWriteOpen".
-     *
-     * --  David E.
-     */
+    E_NULL(s = malloc(sizeof(*s)), USF_ERROR_MEM);
+    s->strm = init;
+    s->in_eof = 0;
+    s->end = 0;
+    file->stream = s;
 
-    if (file->bzeof)
-        return USF_ERROR_EOF;
+    memset(&mt, 0, sizeof(mt));
+    mt.threads = file->threads;
 
-    read = BZ2_bzRead(&bzerror, file->bzfile, buf, count);
-    if (bzerror != BZ_OK) {
-        if (bzerror == BZ_STREAM_END) {
-            file->bzeof = 1;
-            if (read != count)
-                usf_error = USF_ERROR_FILE;
+    if (mode == USF_MODE_READ) {
+        /* The threaded decoder decodes the xz blocks of a stream in
+         * parallel. Files written by the single threaded encoder
+         * consist of a single block and are decoded serially. */
+#ifdef HAVE_LZMA_STREAM_DECODER_MT
+        if (mt.threads) {
+            mt.flags = LZMA_CONCATENATED;
+            mt.memlimit_threading = lzma_physmem() / 4;
+            mt.memlimit_stop = UINT64_MAX;
+            ret = lzma_stream_decoder_mt(&s->strm, &mt);
         } else
-            usf_error = USF_ERROR_SYS;
+#endif
+            ret = lzma_stream_decoder(&s->strm, UINT64_MAX,
+                                      LZMA_CONCATENATED);
+    } else {
+        s->strm.next_out = s->buf;
+        s->strm.avail_out = sizeof(s->buf);
+        if (mt.threads) {
+            mt.preset = xz_preset(file->level);
+            mt.check = LZMA_CHECK_CRC64;
+            ret = lzma_stream_encoder_mt(&s->strm, &mt);
+        } else
+            ret = lzma_easy_encoder(&s->strm, xz_preset(file->level),
+                                    LZMA_CHECK_CRC64);
     }
+    E_ERROR(xz_error(ret));
+
+ret_err:
+    return error;
+}
+
+/* Run the encoder until it has consumed all input, or until it has
+ * flushed everything if action is LZMA_FINISH. */
+static usf_error_t
+write_xz_op(usf_file_t *file, lzma_action action)
+{
+    xz_stream_t *s = file->stream;
+    usf_error_t error;
+    lzma_ret ret;
+
+    for (;;) {
+        ret = lzma_code(&s->strm, action);
+        if (ret != LZMA_OK && ret != LZMA_STREAM_END)
+            return xz_error(ret);
+
+        if (s->strm.avail_out == 0 || ret == LZMA_STREAM_END) {
+            size_t len = sizeof(s->buf) - s->strm.avail_out;
 
-    return usf_error;
+            if ((error = usf_io_write(file->io, s->buf, len)) !=
+                USF_ERROR_OK)
+                return error;
+            s->strm.next_out = s->buf;
+            s->strm.avail_out = sizeof(s->buf);
+        }
+
+        if (action == LZMA_FINISH ?
+            ret == LZMA_STREAM_END : s->strm.avail_in == 0)
+            return USF_ERROR_OK;
+    }
 }
 
 usf_error_t
-write_bzip2(usf_file_t *file, const void *buf, size_t count)
+fini_xz(usf_file_t *file)
+{
+    usf_error_t error = USF_ERROR_OK;
+    xz_stream_t *s = file->stream;
+
+    if (!s)
+        return USF_ERROR_OK;
+
+    if (file->mode == USF_MODE_WRITE)
+        error = write_xz_op(file, LZMA_FINISH);
+
+    lzma_end(&s->strm);
+    free(s);
+    file->stream = NULL;
+
+    return error;
+}
+
+usf_error_t
+read_xz(usf_file_t *file, void *buf, size_t count, size_t *len)
 {
-    int bzerror;
+    xz_stream_t *s = file->stream;
+    usf_error_t error;
+    const char *src;
+    size_t avail = 0;
+    lzma_ret ret;
+
+    s->strm.next_out = buf;
+    s->strm.avail_out = count;
+
+    /* Concatenated streams are decoded as one stream */
+    while (s->strm.avail_out == count && !s->end) {
+        if (!s->in_eof) {
+            if ((error = usf_io_peek(file->io, &src, &avail)) !=
+                USF_ERROR_OK)
+                return error;
+            s->strm.next_in = (const uint8_t *)src;
+            s->strm.avail_in = avail;
+            s->in_eof = avail == 0;
+        }
+
+        ret = lzma_code(&s->strm, s->in_eof ? LZMA_FINISH : LZMA_RUN);
+        usf_io_consume(file->io, avail - s->strm.avail_in);
+        avail = 0;
+        if (ret == LZMA_STREAM_END)
+            s->end = 1;
+        else if (ret != LZMA_OK)
+            return xz_error(ret);
+    }
 
-    BZ2_bzWrite(&bzerror, file->bzfile, (void *)buf, count);
-    return bzerror != BZ_OK ? USF_ERROR_SYS : USF_ERROR_OK;
+    *len = count - s->strm.avail_out;
+    return *len ? USF_ERROR_OK : USF_ERROR_EOF;
 }
 
+usf_error_t
+write_xz(usf_file_t *file, const void *buf, size_t count)
+{
+    xz_stream_t *s = file->stream;
+
+    s->strm.next_in = buf;
+    s->strm.avail_in = count;
+
+    return write_xz_op(file, LZMA_RUN);
+}
+
+size_t
+bound_xz(size_t len)
+{
+    return lzma_stream_buffer_bound(len);
+}
+
+usf_error_t
+compress_xz(void *dst, size_t *dst_len,
+            const void *src, size_t src_len, int level)
+{
+    size_t pos = 0;
+    lzma_ret ret;
+
+    ret = lzma_easy_buffer_encode(xz_preset(level), LZMA_CHECK_CRC64, NULL,
+                                  src, src_len, dst, &pos, *dst_len);
+    if (ret != LZMA_OK)
+        return ret == LZMA_OPTIONS_ERROR ? USF_ERROR_PARAM : USF_ERROR_SYS;
+
+    *dst_len = pos;
+    return USF_ERROR_OK;
+}
+
+usf_error_t
+decompress_xz(void *dst, size_t *dst_len,
+              const void *src, size_t src_len)
+{
+    uint64_t memlimit = UINT64_MAX;
+    size_t in_pos = 0;
+    size_t out_pos = 0;
+    lzma_ret ret;
+
+    ret = lzma_stream_buffer_decode(&memlimit, 0, NULL,
+                                    src, &in_pos, src_len,
+                                    dst, &out_pos, *dst_len);
+    if (ret != LZMA_OK)
+        return ret == LZMA_MEM_ERROR ? USF_ERROR_MEM : USF_ERROR_FILE;
+
+    *dst_len = out_pos;
+    return USF_ERROR_OK;
+}
+
+#endif
+
 /*
  * Local Variables:
  * mode: c
@@ -32,6 +32,7 @@
 #define USF_INTERNAL_H
 
 #include <assert.h>
+#include <string.h>
 #include "usf_priv.h"
 #include "error.h"
 
@@ -40,58 +41,231 @@ enum {
     USF_MODE_WRITE,
 };
 
+/**
+ * Compression methods.
+ *
+ * Files older than USF 0.3 are a single compressed stream, which is
+ * handled by init, fini, read and write. The read method reads at
+ * most count bytes and stores the number of bytes read in len. It
+ * returns USF_ERROR_EOF if there is no more data. The write method
+ * always writes all count bytes.
+ *
+ * Newer files consist of independently compressed blocks, which are
+ * handled by bound, compress and decompress. These don't touch the
+ * file object and may be called from any thread. A codec that
+ * stores blocks as they are sets them to NULL.
+ */
 typedef struct usf_io_methods_s {
     usf_error_t (*init)(usf_file_t *file, int mode);
     usf_error_t (*fini)(usf_file_t *file);
-    usf_error_t (*read)(usf_file_t *file, void *buf, size_t count);
+    usf_error_t (*read)(usf_file_t *file, void *buf, size_t count,
+                        size_t *len);
     usf_error_t (*write)(usf_file_t *file, const void *buf, size_t count);
+
+    /* Worst case compressed size of a block of size len */
+    size_t (*bound)(size_t len);
+    /* Compress src into dst, dst_len is the size of dst on entry
+     * and the size of the compressed data on return. A level of 0
+     * selects the codec's default. */
+    usf_error_t (*compress)(void *dst, size_t *dst_len,
+                            const void *src, size_t src_len, int level);
+    /* Decompress src into dst, dst_len works like for compress */
+    usf_error_t (*decompress)(void *dst, size_t *dst_len,
+                              const void *src, size_t src_len);
 } usf_io_methods_t;
 
+#ifdef HAVE_ZSTD
+#define USF_COMP_ZSTD                                                   \
+    _COMP(USF_COMPRESSION_ZSTD,                                         \
+          init_zstd,  fini_zstd,  read_zstd,  write_zstd,               \
+          bound_zstd, compress_zstd, decompress_zstd)
+#else
+#define USF_COMP_ZSTD
+#endif
+
+#ifdef HAVE_LZ4
+#define USF_COMP_LZ4                                                    \
+    _COMP(USF_COMPRESSION_LZ4,                                          \
+          init_lz4,   fini_lz4,   read_lz4,   write_lz4,                \
+          bound_lz4,  compress_lz4, decompress_lz4)
+#else
+#define USF_COMP_LZ4
+#endif
+
+#ifdef HAVE_XZ
+#define USF_COMP_XZ                                                     \
+    _COMP(USF_COMPRESSION_XZ,                                           \
+          init_xz,    fini_xz,    read_xz,    write_xz,                 \
+          bound_xz,   compress_xz, decompress_xz)
+#else
+#define USF_COMP_XZ
+#endif
+
 #define USF_COMP_LIST                                                   \
     _COMP(USF_COMPRESSION_NONE,                                         \
-          init_none,  fini_none,  read_none,  write_none)               \
+          init_none,  fini_none,  read_none,  write_none,               \
+          NULL, NULL, NULL)                                             \
     _COMP(USF_COMPRESSION_BZIP2,                                        \
-          init_bzip2, fini_bzip2, read_bzip2, write_bzip2)              \
+          init_bzip2, fini_bzip2, read_bzip2, write_bzip2,              \
+          bound_bzip2, compress_bzip2, decompress_bzip2)                \
+    USF_COMP_ZSTD                                                       \
+    USF_COMP_LZ4                                                        \
+    USF_COMP_XZ
 
 
 usf_error_t init_none(usf_file_t *file, int mode);
 usf_error_t fini_none(usf_file_t *file);
-usf_error_t read_none(usf_file_t *file, void *buf, size_t count);
+usf_error_t read_none(usf_file_t *file, void *buf, size_t count,
+                      size_t *len);
 usf_error_t write_none(usf_file_t *file, const void *buf, size_t count);
 
 usf_error_t init_bzip2(usf_file_t *file, int mode);
 usf_error_t fini_bzip2(usf_file_t *file);
-usf_error_t read_bzip2(usf_file_t *file, void *buf, size_t count);
+usf_error_t read_bzip2(usf_file_t *file, void *buf, size_t count,
+                       size_t *len);
 usf_error_t write_bzip2(usf_file_t *file, const void *buf, size_t count);
+size_t bound_bzip2(size_t len);
+usf_error_t compress_bzip2(void *dst, size_t *dst_len,
+                           const void *src, size_t src_len, int level);
+usf_error_t decompress_bzip2(void *dst, size_t *dst_len,
+                             const void *src, size_t src_len);
 
+#ifdef HAVE_ZSTD
+usf_error_t init_zstd(usf_file_t *file, int mode);
+usf_error_t fini_zstd(usf_file_t *file);
+usf_error_t read_zstd(usf_file_t *file, void *buf, size_t count,
+                      size_t *len);
+usf_error_t write_zstd(usf_file_t *file, const void *buf, size_t count);
+size_t bound_zstd(size_t len);
+usf_error_t compress_zstd(void *dst, size_t *dst_len,
+                          const void *src, size_t src_len, int level);
+usf_error_t decompress_zstd(void *dst, size_t *dst_len,
+                            const void *src, size_t src_len);
+#endif
 
+#ifdef HAVE_LZ4
+usf_error_t init_lz4(usf_file_t *file, int mode);
+usf_error_t fini_lz4(usf_file_t *file);
+usf_error_t read_lz4(usf_file_t *file, void *buf, size_t count,
+                     size_t *len);
+usf_error_t write_lz4(usf_file_t *file, const void *buf, size_t count);
+size_t bound_lz4(size_t len);
+usf_error_t compress_lz4(void *dst, size_t *dst_len,
+                         const void *src, size_t src_len, int level);
+usf_error_t decompress_lz4(void *dst, size_t *dst_len,
+                           const void *src, size_t src_len);
+#endif
+
+#ifdef HAVE_XZ
+usf_error_t init_xz(usf_file_t *file, int mode);
+usf_error_t fini_xz(usf_file_t *file);
+usf_error_t read_xz(usf_file_t *file, void *buf, size_t count,
+                    size_t *len);
+usf_error_t write_xz(usf_file_t *file, const void *buf, size_t count);
+size_t bound_xz(size_t len);
+usf_error_t compress_xz(void *dst, size_t *dst_len,
+                        const void *src, size_t src_len, int level);
+usf_error_t decompress_xz(void *dst, size_t *dst_len,
+                          const void *src, size_t src_len);
+#endif
+
+usf_error_t usf_internal_init(usf_file_t *file, int mode);
+usf_error_t usf_internal_fini(usf_file_t *file);
+usf_error_t usf_internal_rewind(usf_file_t *file);
+usf_error_t usf_internal_fill(usf_file_t *file, size_t count);
+usf_error_t usf_internal_flush(usf_file_t *file);
+
+/**
+ * Get a pointer to the next count bytes in the staging buffer,
+ * refilling it from the compression layer if needed. The data is
+ * valid until the next call that touches the staging buffer.
+ *
+ * Returns USF_ERROR_EOF if the file ended before the first byte and
+ * USF_ERROR_FILE if it ended in the middle of the requested data.
+ */
 static inline usf_error_t
-usf_internal_init(usf_file_t *file, int mode)
+usf_internal_peek(usf_file_t *file, size_t count, char **data)
 {
-    assert(file && file->io_methods && file->io_methods->init);
-    file->mode = mode;
-    return file->io_methods->init(file, mode);
+    usf_error_t error;
+
+    assert(file && file->mode == USF_MODE_READ);
+    if (file->buf_len - file->buf_pos < count) {
+        error = usf_internal_fill(file, count);
+        if (error != USF_ERROR_OK)
+            return error;
+    }
+
+    *data = file->buf + file->buf_pos;
+    return USF_ERROR_OK;
 }
 
-static inline usf_error_t
-usf_internal_fini(usf_file_t *file)
+/** Mark count bytes at the head of the staging buffer as decoded. */
+static inline void
+usf_internal_consume(usf_file_t *file, size_t count)
 {
-    assert(file && file->io_methods && file->io_methods->fini);
-    return file->io_methods->fini(file);
+    assert(file->buf_pos + count <= file->buf_len);
+    file->buf_pos += count;
 }
 
 static inline usf_error_t
 usf_internal_read(usf_file_t *file, void *buf, size_t count)
 {
-    assert(file && file->io_methods && file->io_methods->read);
-    return file->io_methods->read(file, buf, count);
+    usf_error_t error;
+    char *data;
+
+    error = usf_internal_peek(file, count, &data);
+    if (error != USF_ERROR_OK)
+        return error;
+
+    memcpy(buf, data, count);
+    usf_internal_consume(file, count);
+    return USF_ERROR_OK;
+}
+
+/**
+ * Get a pointer to at least count free bytes at the tail of the
+ * staging buffer, flushing it to the compression layer if needed.
+ * Data written to the pointer is added to the file by
+ * usf_internal_commit().
+ */
+static inline usf_error_t
+usf_internal_reserve(usf_file_t *file, size_t count, char **data)
+{
+    usf_error_t error;
+
+    assert(file && file->mode == USF_MODE_WRITE && count <= file->buf_size);
+    if (file->buf_size - file->buf_len < count) {
+        error = usf_internal_flush(file);
+        if (error != USF_ERROR_OK)
+            return error;
+    }
+
+    *data = file->buf + file->buf_len;
+    return USF_ERROR_OK;
+}
+
+/** Append the data up to end to the staging buffer. */
+static inline void
+usf_internal_commit(usf_file_t *file, const char *end)
+{
+    assert(end >= file->buf + file->buf_len &&
+           end <= file->buf + file->buf_size);
+    file->buf_len = end - file->buf;
 }
 
 static inline usf_error_t
 usf_internal_write(usf_file_t *file, const void *buf, size_t count)
 {
-    assert(file && file->io_methods && file->io_methods->write);
-    return file->io_methods->write(file, buf, count);
+    usf_error_t error;
+    char *data;
+
+    error = usf_internal_reserve(file, count, &data);
+    if (error != USF_ERROR_OK)
+        return error;
+
+    memcpy(data, buf, count);
+    usf_internal_commit(file, data + count);
+    return USF_ERROR_OK;
 }
 
 #endif
@@ -0,0 +1,895 @@
+/*
+ * Copyright (C) 2009-2011, Andreas Sandberg
+ * Copyright (C) 2009-2011, David Eklov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* O_DIRECT */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "usf_io.h"
+#include "usf_uring.h"
+#include "usf_internal.h"
+#include "error.h"
+
+/* Default buffer size */
+#define USF_IO_BUF_SIZE (4 * 1024 * 1024)
+/* Initial size of memory buffers being written */
+#define USF_IO_MEM_SIZE (64 * 1024)
+/* Alignment of buffers, offsets and sizes of O_DIRECT transfers */
+#define USF_IO_ALIGN 4096
+
+/** Buffer owned by the io_uring backend */
+typedef struct {
+    char *buf;
+    /* File offset and result of the last request */
+    uint64_t offset;
+    int32_t res;
+    int busy;
+} usf_io_seg_t;
+
+struct usf_io_s {
+    int fd;
+    /* Close fd when done, not set for stdin and stdout */
+    int owned;
+    int mode;
+    /* Regular files are accessed with pread() and pwrite() */
+    int seekable;
+    int direct;
+
+    /* Allocated on first use, mapped files only read the header
+     * through it */
+    char *buf;
+    size_t buf_size;
+    /* In read mode, buf[pos..len) hasn't been read yet. In write
+     * mode, buf[0..len) hasn't been written yet. */
+    size_t pos;
+    size_t len;
+    /* File offset of buf[0] */
+    uint64_t offset;
+    /* File offset the descriptor was at when it was opened,
+     * positions outside this file are relative to it */
+    uint64_t start;
+
+    int eof;
+    int error;
+
+    /* Memory instead of a file. In read mode, buf holds the whole
+     * file and isn't owned by us. In write mode, buf grows as
+     * needed and is handed to the caller through mem_data and
+     * mem_size when the file is closed. */
+    int mem;
+    void **mem_data;
+    size_t *mem_size;
+
+    /* Ring of io_depth buffers if io_uring is used. buf points to
+     * seg[cur]. In read mode, seg[cur..cur+queued) hold the current
+     * buffer and reads ahead of it, the next read starts at
+     * ahead. In write mode, all other busy buffers are being
+     * written. */
+    usf_uring_t *uring;
+    usf_io_seg_t *seg;
+    unsigned depth;
+    unsigned cur;
+    unsigned queued;
+    uint64_t ahead;
+    /* A read hit the end of the file, don't read further ahead */
+    int ahead_eof;
+};
+
+/** One read at offset, retried if interrupted */
+static ssize_t
+sys_read(usf_io_t *io, void *buf, size_t count, uint64_t offset)
+{
+    ssize_t ret;
+
+    do {
+        ret = io->seekable ? pread(io->fd, buf, count, offset) :
+            read(io->fd, buf, count);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret;
+}
+
+/** Write all of buf at offset */
+static usf_error_t
+sys_write(usf_io_t *io, const char *buf, size_t count, uint64_t offset)
+{
+    while (count) {
+        ssize_t ret = io->seekable ? pwrite(io->fd, buf, count, offset) :
+            write(io->fd, buf, count);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return USF_ERROR_SYS;
+        }
+
+        buf += ret;
+        count -= ret;
+        offset += ret;
+    }
+
+    return USF_ERROR_OK;
+}
+
+static usf_error_t
+alloc_buf(usf_io_t *io)
+{
+    void *buf;
+
+    if (io->buf)
+        return USF_ERROR_OK;
+    if (posix_memalign(&buf, USF_IO_ALIGN, io->buf_size))
+        return USF_ERROR_MEM;
+
+    io->buf = buf;
+    return USF_ERROR_OK;
+}
+
+/** Wait until seg is no longer busy */
+static usf_error_t
+reap(usf_io_t *io, usf_io_seg_t *seg)
+{
+    usf_error_t error;
+    uint64_t data;
+    int32_t res;
+
+    while (seg->busy) {
+        if ((error = usf_uring_wait(io->uring, &data, &res)) !=
+            USF_ERROR_OK)
+            return error;
+        io->seg[data].res = res;
+        io->seg[data].busy = 0;
+    }
+
+    return USF_ERROR_OK;
+}
+
+/** Wait for all requests, results are left in the buffers */
+static usf_error_t
+drain(usf_io_t *io)
+{
+    usf_error_t error = USF_ERROR_OK;
+
+    for (unsigned i = 0; i < io->depth; i++) {
+        usf_error_t e = reap(io, &io->seg[i]);
+        if (error == USF_ERROR_OK)
+            error = e;
+    }
+
+    return error;
+}
+
+/** Queue reads into the free buffers of a file opened for reading */
+static usf_error_t
+read_ahead(usf_io_t *io, unsigned count)
+{
+    usf_error_t error;
+
+    for (; io->queued < count && !io->ahead_eof; io->queued++) {
+        const unsigned i = (io->cur + io->queued) % io->depth;
+        usf_io_seg_t *seg = &io->seg[i];
+
+        seg->offset = io->ahead;
+        seg->busy = 1;
+        if ((error = usf_uring_prep(io->uring, 0, io->fd, seg->buf,
+                                    io->buf_size, seg->offset, i)) !=
+            USF_ERROR_OK) {
+            seg->busy = 0;
+            return error;
+        }
+        io->ahead += io->buf_size;
+    }
+
+    return usf_uring_submit(io->uring);
+}
+
+/**
+ * Refill the empty buffer with io_uring. The buffer is replaced by
+ * the next one in the ring if it was read from the right offset,
+ * otherwise the reads in flight are discarded. Only one buffer is
+ * read after a seek, which keeps seeks and the header reads of
+ * mapped files cheap. Reads continuing where the current buffer
+ * ended are sequential and keep the whole ring filled.
+ */
+static void
+fill_uring(usf_io_t *io, uint64_t start, size_t skip)
+{
+    usf_io_seg_t *seg;
+    int sequential = 0;
+
+    if (io->queued) {
+        /* Done with the current buffer */
+        seg = &io->seg[io->cur];
+        sequential = seg->offset + io->buf_size == start - skip;
+        io->cur = (io->cur + 1) % io->depth;
+        io->queued--;
+    }
+
+    seg = &io->seg[io->cur];
+    if (!io->queued || seg->offset != start - skip) {
+        if (drain(io) != USF_ERROR_OK) {
+            io->error = 1;
+            return;
+        }
+        io->queued = 0;
+        io->ahead = start - skip;
+        io->ahead_eof = 0;
+        if (read_ahead(io, sequential ? io->depth : 1) != USF_ERROR_OK) {
+            io->error = 1;
+            return;
+        }
+    } else if (read_ahead(io, io->depth) != USF_ERROR_OK) {
+        io->error = 1;
+        return;
+    }
+
+    if (reap(io, seg) != USF_ERROR_OK) {
+        io->error = 1;
+        return;
+    }
+    if (seg->res >= 0 && (size_t)seg->res < io->buf_size)
+        io->ahead_eof = 1;
+
+    io->buf = seg->buf;
+    if (seg->res < 0) {
+        errno = -seg->res;
+        io->error = 1;
+    } else if ((size_t)seg->res <= skip) {
+        io->eof = 1;
+    } else {
+        io->offset = start - skip;
+        io->pos = skip;
+        io->len = seg->res;
+    }
+}
+
+/** Refill the empty buffer of a file opened for reading */
+static void
+fill(usf_io_t *io)
+{
+    const uint64_t start = io->offset + io->pos;
+    /* O_DIRECT reads start at an aligned offset */
+    const size_t skip = io->direct ? start % USF_IO_ALIGN : 0;
+    ssize_t ret;
+
+    if (io->mem) {
+        io->eof = 1;
+        return;
+    }
+
+    io->offset = start;
+    io->pos = 0;
+    io->len = 0;
+    if (io->uring) {
+        fill_uring(io, start, skip);
+        return;
+    }
+    if (alloc_buf(io) != USF_ERROR_OK) {
+        io->error = 1;
+        return;
+    }
+
+    ret = sys_read(io, io->buf, io->buf_size, start - skip);
+    if (ret < 0) {
+        io->error = 1;
+    } else if ((size_t)ret <= skip) {
+        io->eof = 1;
+    } else {
+        io->offset = start - skip;
+        io->pos = skip;
+        io->len = ret;
+    }
+}
+
+/** Check the result of a write and complete it if it was short */
+static usf_error_t
+write_done(usf_io_t *io, usf_io_seg_t *seg, size_t len)
+{
+    if (seg->res < 0) {
+        errno = -seg->res;
+        return USF_ERROR_SYS;
+    }
+
+    return (size_t)seg->res < len ?
+        sys_write(io, seg->buf + seg->res, len - seg->res,
+                  seg->offset + seg->res) :
+        USF_ERROR_OK;
+}
+
+/**
+ * Queue the full buffer for writing with io_uring and switch to the
+ * next buffer in the ring, waiting for it if it is still being
+ * written.
+ */
+static usf_error_t
+flush_uring(usf_io_t *io)
+{
+    usf_error_t error;
+    usf_io_seg_t *seg = &io->seg[io->cur];
+
+    seg->offset = io->offset;
+    seg->busy = 1;
+    if ((error = usf_uring_prep(io->uring, 1, io->fd, seg->buf, io->len,
+                                seg->offset, io->cur)) != USF_ERROR_OK) {
+        seg->busy = 0;
+        return error;
+    }
+    if ((error = usf_uring_submit(io->uring)) != USF_ERROR_OK)
+        return error;
+    io->offset += io->len;
+    io->len = 0;
+
+    io->cur = (io->cur + 1) % io->depth;
+    seg = &io->seg[io->cur];
+    io->buf = seg->buf;
+    if (!seg->busy)
+        return USF_ERROR_OK;
+    if ((error = reap(io, seg)) != USF_ERROR_OK)
+        return error;
+    return write_done(io, seg, io->buf_size);
+}
+
+/** Wait for all writes queued with io_uring */
+static usf_error_t
+flush_wait(usf_io_t *io)
+{
+    usf_error_t error = USF_ERROR_OK;
+
+    for (unsigned i = 0; i < io->depth; i++) {
+        usf_io_seg_t *seg = &io->seg[i];
+        usf_error_t e;
+
+        if (!seg->busy)
+            continue;
+        if ((e = reap(io, seg)) == USF_ERROR_OK)
+            e = write_done(io, seg, io->buf_size);
+        if (error == USF_ERROR_OK)
+            error = e;
+    }
+
+    return error;
+}
+
+/**
+ * Write the buffer of a file opened for writing. With io_uring, only
+ * full buffers are queued (final is zero), the last one is written
+ * synchronously once all others are done.
+ */
+static usf_error_t
+flush(usf_io_t *io, int final)
+{
+    usf_error_t error;
+    int flags = -1;
+
+    if (io->uring) {
+        if (!final)
+            return flush_uring(io);
+        if ((error = flush_wait(io)) != USF_ERROR_OK)
+            return error;
+    }
+
+    if (!io->len)
+        return USF_ERROR_OK;
+
+#ifdef O_DIRECT
+    /* Only the tail of the file can be partial, write it without
+     * O_DIRECT */
+    if (io->direct && io->len % USF_IO_ALIGN) {
+        if ((flags = fcntl(io->fd, F_GETFL)) == -1 ||
+            fcntl(io->fd, F_SETFL, flags & ~O_DIRECT) == -1)
+            return USF_ERROR_SYS;
+        io->direct = 0;
+    }
+#endif
+
+    error = sys_write(io, io->buf, io->len, io->offset);
+    if (error == USF_ERROR_OK) {
+        io->offset += io->len;
+        io->len = 0;
+    }
+
+    /* Descriptors of the caller are handed back unchanged */
+    if (flags != -1 && !io->owned && fcntl(io->fd, F_SETFL, flags) == -1 &&
+        error == USF_ERROR_OK)
+        error = USF_ERROR_SYS;
+
+    return error;
+}
+
+/** Set up the io_uring backend, or leave the file synchronous if it
+ * isn't available */
+static usf_error_t
+open_uring(usf_io_t *io, unsigned depth)
+{
+    usf_error_t error;
+
+    error = usf_uring_create(&io->uring, depth);
+    if (error == USF_ERROR_UNSUPPORTED)
+        return USF_ERROR_OK;
+    else if (error != USF_ERROR_OK)
+        return error;
+
+    E_NULL(io->seg = calloc(depth, sizeof(*io->seg)), USF_ERROR_MEM);
+    io->depth = depth;
+    for (unsigned i = 0; i < depth; i++) {
+        void *buf;
+
+        E_IF(posix_memalign(&buf, USF_IO_ALIGN, io->buf_size),
+             USF_ERROR_MEM);
+        io->seg[i].buf = buf;
+    }
+    io->buf = io->seg[0].buf;
+
+    return USF_ERROR_OK;
+
+ret_err:
+    if (io->seg) {
+        for (unsigned i = 0; i < depth; i++)
+            free(io->seg[i].buf);
+        free(io->seg);
+        io->seg = NULL;
+    }
+    usf_uring_destroy(io->uring);
+    io->uring = NULL;
+    io->depth = 0;
+    return error;
+}
+
+static usf_io_t *
+alloc_io(int mode, const usf_options_t *options)
+{
+    const size_t size = options->io_buffer_size ?
+        options->io_buffer_size : USF_IO_BUF_SIZE;
+    usf_io_t *f;
+
+    if (!(f = calloc(1, sizeof(*f))))
+        return NULL;
+
+    f->fd = -1;
+    f->mode = mode;
+    f->buf_size = (size + USF_IO_ALIGN - 1) & ~(size_t)(USF_IO_ALIGN - 1);
+    return f;
+}
+
+/** Set up access to the open descriptor of f */
+static usf_error_t
+init_fd(usf_io_t *f, const usf_options_t *options)
+{
+    usf_error_t error = USF_ERROR_OK;
+    struct stat st;
+    off_t pos;
+
+    if (fstat(f->fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        (pos = lseek(f->fd, 0, SEEK_CUR)) >= 0) {
+        f->seekable = 1;
+        f->offset = pos;
+        f->start = pos;
+    }
+
+    /* Streams are read and written in order, keep them synchronous */
+    if (f->seekable && options->io_depth > 1)
+        E_ERROR(open_uring(f, options->io_depth));
+
+#ifdef HAVE_POSIX_FADVISE
+    /* Only a hint, ignore failures */
+    if (f->seekable && f->mode == USF_MODE_READ)
+        posix_fadvise(f->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+ret_err:
+    return error;
+}
+
+/**
+ * Open path, or stdin or stdout if path is NULL, for reading or
+ * writing.
+ */
+usf_error_t
+usf_io_open(usf_io_t **io, const char *path, int mode,
+            const usf_options_t *options)
+{
+    usf_error_t error = USF_ERROR_OK;
+    const int flags = mode == USF_MODE_READ ?
+        O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC;
+    usf_io_t *f;
+
+    E_NULL(f = alloc_io(mode, options), USF_ERROR_MEM);
+
+    if (path) {
+#ifdef O_DIRECT
+        /* Not all file systems support O_DIRECT */
+        if (options->direct) {
+            f->fd = open(path, flags | O_DIRECT, 0666);
+            f->direct = f->fd != -1;
+        }
+#endif
+        if (f->fd == -1)
+            f->fd = open(path, flags, 0666);
+        E_IF(f->fd == -1, USF_ERROR_SYS);
+        f->owned = 1;
+    } else
+        f->fd = mode == USF_MODE_READ ? STDIN_FILENO : STDOUT_FILENO;
+
+    E_ERROR(init_fd(f, options));
+
+    *io = f;
+    return USF_ERROR_OK;
+
+ret_err:
+    if (f) {
+        if (f->fd != -1 && f->owned)
+            close(f->fd);
+        free(f);
+    }
+    return error;
+}
+
+/**
+ * Use an open descriptor, starting at its current position. The
+ * descriptor is left open and positioned after the data that was
+ * used when the file is closed.
+ */
+usf_error_t
+usf_io_open_fd(usf_io_t **io, int fd, int mode,
+               const usf_options_t *options)
+{
+    usf_error_t error = USF_ERROR_OK;
+    usf_io_t *f;
+    int flags;
+
+    E_IF(fd < 0 || (flags = fcntl(fd, F_GETFL)) == -1, USF_ERROR_PARAM);
+    E_NULL(f = alloc_io(mode, options), USF_ERROR_MEM);
+    f->fd = fd;
+#ifdef O_DIRECT
+    /* Transfers have to be aligned if the caller asked for O_DIRECT */
+    f->direct = (flags & O_DIRECT) != 0;
+#endif
+
+    if ((error = init_fd(f, options)) != USF_ERROR_OK) {
+        free(f);
+        return error;
+    }
+
+    *io = f;
+
+ret_err:
+    return error;
+}
+
+/** Read from size bytes of memory at data, which isn't copied */
+usf_error_t
+usf_io_open_mem(usf_io_t **io, const void *data, size_t size)
+{
+    static const usf_options_t defaults;
+    usf_io_t *f;
+
+    if (!(f = alloc_io(USF_MODE_READ, &defaults)))
+        return USF_ERROR_MEM;
+
+    f->mem = 1;
+    f->buf = (char *)data;
+    f->len = size;
+    *io = f;
+    return USF_ERROR_OK;
+}
+
+/**
+ * Write to a growing memory buffer. *data and *size are set to the
+ * buffer and the number of bytes written when the file is closed,
+ * the caller has to free *data.
+ */
+usf_error_t
+usf_io_create_mem(usf_io_t **io, void **data, size_t *size)
+{
+    static const usf_options_t defaults;
+    usf_io_t *f;
+
+    if (!(f = alloc_io(USF_MODE_WRITE, &defaults)))
+        return USF_ERROR_MEM;
+
+    f->mem = 1;
+    f->buf_size = 0;
+    f->mem_data = data;
+    f->mem_size = size;
+    *io = f;
+    return USF_ERROR_OK;
+}
+
+/** Write buffered data and close the file */
+usf_error_t
+usf_io_close(usf_io_t *io)
+{
+    usf_error_t error = USF_ERROR_OK;
+
+    if (io->mem) {
+        if (io->mode == USF_MODE_WRITE) {
+            *io->mem_data = io->buf;
+            *io->mem_size = io->len;
+        }
+        free(io);
+        return USF_ERROR_OK;
+    }
+
+    if (io->mode == USF_MODE_WRITE)
+        error = flush(io, 1);
+    else if (io->uring && drain(io) != USF_ERROR_OK &&
+             error == USF_ERROR_OK)
+        error = USF_ERROR_SYS;
+
+    /* Leave shared descriptors positioned after the data we used */
+    if (!io->owned && io->seekable)
+        lseek(io->fd, io->start + usf_io_tell(io), SEEK_SET);
+    if (io->owned && close(io->fd) != 0 && error == USF_ERROR_OK)
+        error = USF_ERROR_SYS;
+
+    if (io->uring) {
+        usf_uring_destroy(io->uring);
+        for (unsigned i = 0; i < io->depth; i++)
+            free(io->seg[i].buf);
+        free(io->seg);
+    } else
+        free(io->buf);
+    free(io);
+    return error;
+}
+
+size_t
+usf_io_read(usf_io_t *io, void *buf, size_t count)
+{
+    char *dst = buf;
+    size_t done = 0;
+
+    while (done < count) {
+        size_t avail = io->len - io->pos;
+        size_t len;
+
+        if (!avail) {
+            ssize_t ret;
+
+            if (io->eof || io->error)
+                break;
+            if (io->direct || io->uring || io->mem ||
+                count - done < io->buf_size) {
+                fill(io);
+                continue;
+            }
+
+            /* Large reads bypass the buffer */
+            ret = sys_read(io, dst + done, count - done,
+                           io->offset + io->pos);
+            if (ret <= 0) {
+                io->eof = ret == 0;
+                io->error = ret < 0;
+                break;
+            }
+            io->offset += io->pos + ret;
+            io->pos = 0;
+            io->len = 0;
+            done += ret;
+            continue;
+        }
+
+        len = avail < count - done ? avail : count - done;
+        memcpy(dst + done, io->buf + io->pos, len);
+        io->pos += len;
+        done += len;
+    }
+
+    return done;
+}
+
+/** Append to a memory buffer, doubling its size when it is full */
+static usf_error_t
+write_mem(usf_io_t *io, const void *buf, size_t count)
+{
+    if (count > io->buf_size - io->len) {
+        size_t size = io->buf_size ? io->buf_size : USF_IO_MEM_SIZE;
+        char *p;
+
+        while (count > size - io->len)
+            size *= 2;
+        if (!(p = realloc(io->buf, size)))
+            return USF_ERROR_MEM;
+        io->buf = p;
+        io->buf_size = size;
+    }
+
+    memcpy(io->buf + io->len, buf, count);
+    io->len += count;
+    return USF_ERROR_OK;
+}
+
+usf_error_t
+usf_io_write(usf_io_t *io, const void *buf, size_t count)
+{
+    usf_error_t error;
+    const char *src = buf;
+
+    if (io->mem)
+        return write_mem(io, buf, count);
+
+    /* Large writes bypass the buffer */
+    if (!io->len && !io->direct && count >= io->buf_size) {
+        if ((error = sys_write(io, src, count, io->offset)) ==
+            USF_ERROR_OK)
+            io->offset += count;
+        return error;
+    }
+
+    if ((error = alloc_buf(io)) != USF_ERROR_OK)
+        return error;
+
+    while (count) {
+        size_t len = io->buf_size - io->len < count ?
+            io->buf_size - io->len : count;
+
+        memcpy(io->buf + io->len, src, len);
+        io->len += len;
+        src += len;
+        count -= len;
+
+        if (io->len == io->buf_size &&
+            (error = flush(io, 0)) != USF_ERROR_OK)
+            return error;
+    }
+
+    return USF_ERROR_OK;
+}
+
+usf_error_t
+usf_io_peek(usf_io_t *io, const char **data, size_t *len)
+{
+    if (io->pos == io->len && !io->eof && !io->error)
+        fill(io);
+
+    *data = io->buf + io->pos;
+    *len = io->len - io->pos;
+    return io->error ? USF_ERROR_SYS : USF_ERROR_OK;
+}
+
+void
+usf_io_consume(usf_io_t *io, size_t len)
+{
+    assert(len <= io->len - io->pos);
+    io->pos += len;
+}
+
+usf_error_t
+usf_io_seek(usf_io_t *io, uint64_t offset)
+{
+    assert(io->mode == USF_MODE_READ);
+    io->eof = 0;
+    io->error = 0;
+    offset += io->start;
+
+    /* Keep the buffer if it covers offset */
+    if (offset >= io->offset && offset - io->offset <= io->len) {
+        io->pos = offset - io->offset;
+        return USF_ERROR_OK;
+    }
+
+    if (!io->seekable)
+        return USF_ERROR_UNSUPPORTED;
+
+    io->offset = offset;
+    io->pos = 0;
+    io->len = 0;
+    return USF_ERROR_OK;
+}
+
+uint64_t
+usf_io_tell(const usf_io_t *io)
+{
+    return (io->mode == USF_MODE_READ ?
+            io->offset + io->pos : io->offset + io->len) - io->start;
+}
+
+usf_error_t
+usf_io_size(usf_io_t *io, uint64_t *size)
+{
+    struct stat st;
+
+    if (io->mem) {
+        *size = io->len;
+        return USF_ERROR_OK;
+    }
+    if (!io->seekable)
+        return USF_ERROR_UNSUPPORTED;
+    if (fstat(io->fd, &st) == -1)
+        return USF_ERROR_SYS;
+
+    *size = (uint64_t)st.st_size > io->start ? st.st_size - io->start : 0;
+    if (io->mode == USF_MODE_WRITE && usf_io_tell(io) > *size)
+        *size = usf_io_tell(io);
+    return USF_ERROR_OK;
+}
+
+int
+usf_io_eof(const usf_io_t *io)
+{
+    return io->eof;
+}
+
+int
+usf_io_error(const usf_io_t *io)
+{
+    return io->error;
+}
+
+int
+usf_io_fd(const usf_io_t *io)
+{
+    return io->fd;
+}
+
+uint64_t
+usf_io_start(const usf_io_t *io)
+{
+    return io->start;
+}
+
+const char *
+usf_io_mem(const usf_io_t *io, size_t *size)
+{
+    if (!io->mem || io->mode != USF_MODE_READ)
+        return NULL;
+
+    *size = io->len;
+    return io->buf;
+}
+
+unsigned
+usf_io_queued(const usf_io_t *io)
+{
+    return io->queued;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2009-2011, Andreas Sandberg
+ * Copyright (C) 2009-2011, David Eklov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef USF_IO_H
+#define USF_IO_H
+
+#include <stdint.h>
+#include <uart/usf.h>
+
+/**
+ * Buffered file I/O on a raw file descriptor.
+ *
+ * Reads and writes go through a single large aligned buffer
+ * (usf_options_t.io_buffer_size). Regular files are accessed with
+ * pread() and pwrite() at an offset tracked by the I/O object,
+ * pipes and other streams with read() and write(). Requests larger
+ * than the buffer bypass it unless the file was opened with
+ * O_DIRECT (usf_options_t.direct), which requires all transfers to
+ * be aligned.
+ *
+ * With usf_options_t.io_depth, regular files use a ring of buffers
+ * with io_uring instead. Readers keep the buffers after the current
+ * one filled ahead of time once reads are sequential, writers queue
+ * full buffers and continue in the next one.
+ *
+ * Memory opened for reading is used as the buffer, which makes every
+ * read a copy from it and every peek free.
+ *
+ * usf_io_peek() and usf_io_consume() hand out the buffered data
+ * directly, stream decompressors use them to avoid a copy.
+ */
+typedef struct usf_io_s usf_io_t;
+
+usf_error_t usf_io_open(usf_io_t **io, const char *path, int mode,
+                        const usf_options_t *options);
+usf_error_t usf_io_open_fd(usf_io_t **io, int fd, int mode,
+                           const usf_options_t *options);
+usf_error_t usf_io_open_mem(usf_io_t **io, const void *data, size_t size);
+usf_error_t usf_io_create_mem(usf_io_t **io, void **data, size_t *size);
+usf_error_t usf_io_close(usf_io_t *io);
+
+/** Read up to count bytes, fewer only at the end of the file or on
+ * errors */
+size_t usf_io_read(usf_io_t *io, void *buf, size_t count);
+usf_error_t usf_io_write(usf_io_t *io, const void *buf, size_t count);
+
+/** Get the buffered data, refilling the buffer if it is empty. len
+ * is 0 at the end of the file. */
+usf_error_t usf_io_peek(usf_io_t *io, const char **data, size_t *len);
+void usf_io_consume(usf_io_t *io, size_t len);
+
+/** Set the position of a file opened for reading. Positions are
+ * relative to the descriptor's offset when it was opened. */
+usf_error_t usf_io_seek(usf_io_t *io, uint64_t offset);
+uint64_t usf_io_tell(const usf_io_t *io);
+/** Get the size of a regular file */
+usf_error_t usf_io_size(usf_io_t *io, uint64_t *size);
+
+/** Non-zero if a read stopped at the end of the file or failed */
+int usf_io_eof(const usf_io_t *io);
+int usf_io_error(const usf_io_t *io);
+/** Offset of the descriptor when it was opened */
+uint64_t usf_io_start(const usf_io_t *io);
+/** Descriptor of the file, -1 for memory */
+int usf_io_fd(const usf_io_t *io);
+/** Contents of memory opened for reading, NULL for files */
+const char *usf_io_mem(const usf_io_t *io, size_t *size);
+/** Number of io_uring buffers holding or reading data for the
+ * reader, 0 for synchronous I/O */
+unsigned usf_io_queued(const usf_io_t *io);
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
@@ -0,0 +1,184 @@
+/*
+ * Copyright (C) 2009-2011, Andreas Sandberg
+ * Copyright (C) 2009-2011, David Eklov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "usf_pool.h"
+#include "error.h"
+
+struct usf_pool_s {
+    pthread_mutex_t lock;
+    /* Signalled when a job is queued or the pool is shut down */
+    pthread_cond_t work;
+    /* Signalled when a job finishes */
+    pthread_cond_t done;
+
+    /* Queue of jobs that haven't been started yet */
+    usf_pool_job_t *head;
+    usf_pool_job_t *tail;
+    int shutdown;
+
+    unsigned threads;
+    pthread_t thread[];
+};
+
+static void *
+worker(void *arg)
+{
+    usf_pool_t *pool = arg;
+    usf_pool_job_t *job;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->head && !pool->shutdown)
+            pthread_cond_wait(&pool->work, &pool->lock);
+
+        /* Queued jobs are always completed before shutting down,
+         * their owners are going to wait for them. */
+        if (!pool->head)
+            break;
+
+        job = pool->head;
+        pool->head = job->next;
+        if (!pool->head)
+            pool->tail = NULL;
+
+        pthread_mutex_unlock(&pool->lock);
+        job->error = job->run(job);
+        pthread_mutex_lock(&pool->lock);
+
+        job->done = 1;
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+usf_error_t
+usf_pool_create(usf_pool_t **pool, unsigned threads)
+{
+    usf_error_t error = USF_ERROR_OK;
+    usf_pool_t *p;
+
+    E_IF(!threads, USF_ERROR_PARAM);
+    E_NULL(p = calloc(1, sizeof(*p) + threads * sizeof(*p->thread)),
+           USF_ERROR_MEM);
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work, NULL);
+    pthread_cond_init(&p->done, NULL);
+
+    for (; p->threads < threads; p->threads++) {
+        if (pthread_create(&p->thread[p->threads], NULL, worker, p)) {
+            usf_pool_destroy(p);
+            return USF_ERROR_SYS;
+        }
+    }
+
+    *pool = p;
+
+ret_err:
+    return error;
+}
+
+/** Finish all queued jobs and free the pool. */
+void
+usf_pool_destroy(usf_pool_t *pool)
+{
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (unsigned i = 0; i < pool->threads; i++)
+        pthread_join(pool->thread[i], NULL);
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+void
+usf_pool_submit(usf_pool_t *pool, usf_pool_job_t *job)
+{
+    job->next = NULL;
+    job->done = 0;
+    job->error = USF_ERROR_OK;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail)
+        pool->tail->next = job;
+    else
+        pool->head = job;
+    pool->tail = job;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/** Check if a job has finished without blocking. */
+int
+usf_pool_done(usf_pool_t *pool, usf_pool_job_t *job)
+{
+    int done;
+
+    pthread_mutex_lock(&pool->lock);
+    done = job->done;
+    pthread_mutex_unlock(&pool->lock);
+
+    return done;
+}
+
+/** Wait for a job to finish and return its result. */
+usf_error_t
+usf_pool_wait(usf_pool_t *pool, usf_pool_job_t *job)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (!job->done)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+
+    return job->error;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2009-2011, Andreas Sandberg
+ * Copyright (C) 2009-2011, David Eklov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef USF_POOL_H
+#define USF_POOL_H
+
+#include <pthread.h>
+
+#include "usf_priv.h"
+
+/**
+ * Worker pool used to compress and decompress blocks in parallel.
+ *
+ * Jobs are started in the order they are submitted, but may finish
+ * in any order. The submitter owns the job structures and has to wait
+ * for every submitted job before reusing or freeing it. Jobs are
+ * usually embedded in a larger structure holding their data.
+ */
+typedef struct usf_pool_job_s {
+    usf_error_t (*run)(struct usf_pool_job_s *job);
+    usf_error_t error;
+
+    /* Private to the pool */
+    struct usf_pool_job_s *next;
+    int done;
+} usf_pool_job_t;
+
+typedef struct usf_pool_s usf_pool_t;
+
+usf_error_t usf_pool_create(usf_pool_t **pool, unsigned threads);
+void usf_pool_destroy(usf_pool_t *pool);
+
+void usf_pool_submit(usf_pool_t *pool, usf_pool_job_t *job);
+int usf_pool_done(usf_pool_t *pool, usf_pool_job_t *job);
+usf_error_t usf_pool_wait(usf_pool_t *pool, usf_pool_job_t *job);
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2009-2011, Andreas Sandberg
+ * Copyright (C) 2009-2011, David Eklov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "usf_priv.h"
+#include "usf_internal.h"
+#include "usf_prefetch.h"
+#include "error.h"
+
+/* Number of events per batch */
+#define BATCH_EVENTS 4096
+
+typedef struct {
+    usf_event_t *events;
+    size_t len;
+    /* Error returned by the reader after decoding the events */
+    usf_error_t error;
+} batch_t;
+
+struct usf_prefetch_s {
+    usf_file_t *file;
+    pthread_t thread;
+    /* Event reader of the file, only used by the decoder thread */
+    const usf_event_ops_t *ops;
+    usf_event_ops_t prefetch_ops;
+
+    batch_t *batch;
+    unsigned batches;
+    /* Number of batches consumed and decoded so far. The reader owns
+     * head and the decoder owns tail, the batches in between are
+     * ready to be read. */
+    uint64_t head;
+    uint64_t tail;
+    /* Events already read from the batch at the head */
+    size_t pos;
+
+    /* Only used to sleep and wake up, set the waiting flag before
+     * sleeping and check the flag of the other side after updating
+     * head or tail. */
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_cond_t drained;
+    int decoder_waiting;
+    int reader_waiting;
+    int stop;
+};
+
+#define LOAD(p) __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define STORE(p, v) __atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+
+static void
+wake(usf_prefetch_t *pf, int *waiting, pthread_cond_t *cond)
+{
+    if (LOAD(waiting)) {
+        pthread_mutex_lock(&pf->lock);
+        pthread_cond_signal(cond);
+        pthread_mutex_unlock(&pf->lock);
+    }
+}
+
+static void *
+decoder(void *arg)
+{
+    usf_prefetch_t *pf = arg;
+
+    while (!LOAD(&pf->stop)) {
+        const usf_event_ops_t *ops;
+        batch_t *b;
+
+        if (pf->tail - LOAD(&pf->head) >= pf->batches) {
+            pthread_mutex_lock(&pf->lock);
+            STORE(&pf->decoder_waiting, 1);
+            while (pf->tail - LOAD(&pf->head) >= pf->batches &&
+                   !LOAD(&pf->stop))
+                pthread_cond_wait(&pf->drained, &pf->lock);
+            STORE(&pf->decoder_waiting, 0);
+            pthread_mutex_unlock(&pf->lock);
+            continue;
+        }
+
+        ops = LOAD(&pf->ops);
+        b = &pf->batch[pf->tail % pf->batches];
+        b->error = ops->read(pf->file, b->events, BATCH_EVENTS, &b->len);
+
+        STORE(&pf->tail, pf->tail + 1);
+        wake(pf, &pf->reader_waiting, &pf->filled);
+
+        /* The reader keeps getting the error from the last batch */
+        if (b->error != USF_ERROR_OK)
+            break;
+    }
+
+    return NULL;
+}
+
+/** Wait until the decoder has filled the batch at the head */
+static void
+wait_batch(usf_prefetch_t *pf)
+{
+    if (pf->head != LOAD(&pf->tail))
+        return;
+
+    pthread_mutex_lock(&pf->lock);
+    STORE(&pf->reader_waiting, 1);
+    while (pf->head == LOAD(&pf->tail))
+        pthread_cond_wait(&pf->filled, &pf->lock);
+    STORE(&pf->reader_waiting, 0);
+    pthread_mutex_unlock(&pf->lock);
+}
+
+static usf_error_t
+prefetch_read(usf_file_t *file, usf_event_t *events, size_t max, size_t *n)
+{
+    usf_prefetch_t *pf = file->prefetch;
+
+    *n = 0;
+    while (*n < max) {
+        batch_t *b;
+        size_t k;
+
+        /* Don't wait for more events than are needed */
+        if (*n && pf->head == LOAD(&pf->tail))
+            break;
+        wait_batch(pf);
+
+        b = &pf->batch[pf->head % pf->batches];
+        k = b->len - pf->pos < max - *n ? b->len - pf->pos : max - *n;
+        memcpy(events + *n, b->events + pf->pos, k * sizeof(*events));
+        pf->pos += k;
+        *n += k;
+
+        if (pf->pos == b->len) {
+            /* Deliver the events before the error, the last batch
+             * is never released. */
+            if (b->error != USF_ERROR_OK)
+                return *n ? USF_ERROR_OK : b->error;
+
+            pf->pos = 0;
+            STORE(&pf->head, pf->head + 1);
+            wake(pf, &pf->decoder_waiting, &pf->drained);
+        }
+    }
+
+    return USF_ERROR_OK;
+}
+
+static usf_error_t
+prefetch_append(usf_file_t *file, const usf_event_t *events, size_t n)
+{
+    /* Files being read can't be appended to */
+    (void)file;
+    (void)events;
+    (void)n;
+    return USF_ERROR_PARAM;
+}
+
+static void
+free_prefetch(usf_prefetch_t *pf)
+{
+    for (unsigned i = 0; i < pf->batches; i++)
+        free(pf->batch[i].events);
+    free(pf->batch);
+
+    pthread_cond_destroy(&pf->drained);
+    pthread_cond_destroy(&pf->filled);
+    pthread_mutex_destroy(&pf->lock);
+    free(pf);
+}
+
+/**
+ * Start decoding in the background, queueing at most batches
+ * batches of events.
+ */
+usf_error_t
+usf_prefetch_start(usf_file_t *file, unsigned batches)
+{
+    usf_error_t error = USF_ERROR_OK;
+    usf_prefetch_t *pf;
+
+    assert(file->mode == USF_MODE_READ && !file->prefetch && batches);
+    E_NULL(pf = calloc(1, sizeof(*pf)), USF_ERROR_MEM);
+    pf->file = file;
+    pf->ops = file->event_ops;
+    pf->prefetch_ops.read = prefetch_read;
+    pf->prefetch_ops.append = prefetch_append;
+    pf->batches = batches;
+    pthread_mutex_init(&pf->lock, NULL);
+    pthread_cond_init(&pf->filled, NULL);
+    pthread_cond_init(&pf->drained, NULL);
+
+    if (!(pf->batch = calloc(batches, sizeof(*pf->batch)))) {
+        free_prefetch(pf);
+        return USF_ERROR_MEM;
+    }
+    for (unsigned i = 0; i < batches; i++) {
+        pf->batch[i].events = malloc(BATCH_EVENTS * sizeof(usf_event_t));
+        if (!pf->batch[i].events) {
+            free_prefetch(pf);
+            return USF_ERROR_MEM;
+        }
+    }
+
+    /* Publish the ring before the decoder can call back into it */
+    file->prefetch = pf;
+    if (pthread_create(&pf->thread, NULL, decoder, pf)) {
+        file->prefetch = NULL;
+        free_prefetch(pf);
+        return USF_ERROR_SYS;
+    }
+
+    file->event_ops = &pf->prefetch_ops;
+
+ret_err:
+    return error;
+}
+
+/**
+ * Stop the background thread and discard the events it has queued.
+ * The file is left positioned after the last event decoded.
+ */
+void
+usf_prefetch_stop(usf_file_t *file)
+{
+    usf_prefetch_t *pf = file->prefetch;
+
+    if (!pf)
+        return;
+
+    STORE(&pf->stop, 1);
+    wake(pf, &pf->decoder_waiting, &pf->drained);
+    pthread_join(pf->thread, NULL);
+
+    file->event_ops = pf->ops;
+    file->prefetch = NULL;
+    free_prefetch(pf);
+}
+
+/** Queue depth the background thread was started with */
+unsigned
+usf_prefetch_batches(const usf_file_t *file)
+{
+    return file->prefetch->batches;
+}
+
+/**
+ * Switch the event reader used by the background thread, takes
+ * effect from the next batch.
+ */
+void
+usf_prefetch_set_ops(usf_file_t *file, const usf_event_ops_t *ops)
+{
+    STORE(&file->prefetch->ops, ops);
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2009-2011, Andreas Sandberg
+ * Copyright (C) 2009-2011, David Eklov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef USF_PREFETCH_H
+#define USF_PREFETCH_H
+
+#include "usf_priv.h"
+#include "usf_events.h"
+
+/**
+ * Decoding read-ahead (usf_options_t.prefetch).
+ *
+ * A background thread decompresses and decodes batches of events
+ * into a ring using the event reader of the file, usf_read() and
+ * usf_read_batch() only copy events out of the ring. The ring is a
+ * single producer, single consumer queue like the one of the
+ * asynchronous writer (see usf_async.h). Decoding stops at the first
+ * error, which is handed to the reader after the events preceding
+ * it.
+ *
+ * The background thread owns all of the file's read state while it
+ * is running. It has to be stopped before repositioning or closing
+ * the file, stopping discards the events still queued.
+ */
+usf_error_t usf_prefetch_start(usf_file_t *file, unsigned batches);
+void usf_prefetch_stop(usf_file_t *file);
+unsigned usf_prefetch_batches(const usf_file_t *file);
+void usf_prefetch_set_ops(usf_file_t *file, const usf_event_ops_t *ops);
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
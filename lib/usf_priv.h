@@ -33,30 +33,237 @@
 #define USF_PRIV_H
 
 #include <stdio.h>
-#include <bzlib.h>
 
 #include <uart/usf.h>
 
 struct usf_io_methods_s;
+struct usf_block_job_s;
+struct usf_pool_s;
+typedef struct usf_readahead_s usf_readahead_t;
+typedef struct usf_async_s usf_async_t;
+typedef struct usf_prefetch_s usf_prefetch_t;
+typedef struct usf_io_s usf_io_t;
+
+/** Block index entry, stored in the footer of USF 0.3 files */
+typedef struct {
+    /* File offset of the block header */
+    uint64_t offset;
+    /* Ordinal of the first event in the block */
+    uint64_t first_event;
+    /* Range of event times in the block */
+    usf_atime_t min_time;
+    usf_atime_t max_time;
+} usf_block_index_t;
+
+/** Per-thread delta compression state */
+typedef struct {
+    usf_access_t last;
+    /* The context is stale unless this matches ctx_generation in
+     * the file */
+    uint64_t generation;
+} usf_delta_ctx_t;
+
+/** Address predictor entry */
+typedef struct {
+    usf_addr_t pc;
+    usf_addr_t addr;
+    usf_addr_t stride;
+} usf_stride_t;
+
+#define USF_STRIDE_SIZE 4096
+
+/** Number of columns in a columnar block, one per access field */
+#define USF_COLUMNS 6
+
+/** Decoder state of a column in a columnar block */
+typedef struct {
+    uint8_t encoding;
+    uint8_t width;
+    /* Size of the field stored in the column */
+    uint8_t field_size;
+    /* Next byte of column data */
+    const char *data;
+    /* First value of sequences, last value decoded otherwise */
+    uint64_t value;
+    uint64_t step;
+    /* Values left in the current run */
+    uint32_t run;
+    /* Number of values decoded so far */
+    size_t pos;
+} usf_column_t;
+
+#define USF_PCDICT_SIZE 65536
+#define USF_PCDICT_HASH_BITS 17
+#define USF_PCDICT_HASH_SIZE (1 << USF_PCDICT_HASH_BITS)
 
 struct usf_file_s {
-    FILE *file;
+    /* Buffered file descriptor, see usf_io.h */
+    usf_io_t *io;
 
-    BZFILE *bzfile;
-    int bzeof;
+    /* Stream state of the codec in pre-0.3 files */
+    void *stream;
 
     usf_header_t *header;
 
     int mode;
     struct usf_io_methods_s *io_methods;
+    /* Event reader and writer for the format of the file, see
+     * usf_events.h */
+    const struct usf_event_ops_s *event_ops;
 
     /* Last access if delta compression is used, initialized as all
      * '\0'. */
     usf_access_t last_access;
+
+    /* Per-thread delta contexts if USF_FLAG_TID_CONTEXT is set,
+     * indexed by tid and grown on demand. last_access then only
+     * supplies the time and tid. Bumping ctx_generation resets all
+     * contexts. */
+    usf_delta_ctx_t *ctx;
+    size_t ctx_len;
+    uint64_t ctx_generation;
+    /* Address predictor if USF_FLAG_STRIDE is set, a direct mapped
+     * table of USF_STRIDE_SIZE entries indexed by a hash of the pc.
+     * Cleared at the start of every block. */
+    usf_stride_t *stride;
+    /* PC dictionary if USF_FLAG_PC_DICT is set, pcdict_len pcs
+     * indexed by their dictionary index. Writers also keep
+     * pcdict_hash, an open addressing table of index + 1 (0 if
+     * empty) hashed on the pc. Emptied at the start of every
+     * block. */
+    usf_addr_t *pcdict;
+    uint32_t *pcdict_hash;
+    size_t pcdict_len;
+
+    /* Current block if USF_FLAG_COLUMNS is set. Writers encode the
+     * staging buffer into cols_mem. Readers decode the columns in
+     * cols_mem, or in the file mapping, and move them to the staging
+     * buffer as records on demand. col_pos of the col_events
+     * accesses in the block have been moved or read by
+     * usf_read_columns(). */
+    char *cols_mem;
+    size_t cols_size;
+    usf_column_t col[USF_COLUMNS];
+    size_t col_events;
+    size_t col_pos;
+
+    /* Contexts and predictor entries as they were before the event
+     * being decoded changed them, only recorded while undo_enabled
+     * is set. Seeks use this to push an event back. */
+    int undo_enabled;
+    size_t ctx_undo_len;
+    usf_tid_t ctx_undo_tid[2];
+    usf_delta_ctx_t ctx_undo[2];
+    size_t stride_undo_len;
+    size_t stride_undo_idx[2];
+    usf_stride_t stride_undo[2];
+
+    /* Number of events read or appended so far */
+    uint64_t events;
+    /* File offset of the first byte after the header */
+    uint64_t data_offset;
+
+    /* Staging buffer between the event codec and the compression
+     * layer. In read mode, buf_pos..buf_len contains decompressed
+     * data that hasn't been decoded yet. In write mode, 0..buf_len
+     * contains encoded events that haven't been compressed yet. In
+     * block files, the staging buffer always contains exactly one
+     * block.
+     *
+     * buf normally points to buf_mem, but may point into the file
+     * mapping when reading uncompressed data. */
+    char *buf;
+    char *buf_mem;
+    size_t buf_size;
+    size_t buf_pos;
+    size_t buf_len;
+
+    /* Mapping of the entire input file if it is read through mmap
+     * or from memory, map_pos is the offset of the first byte that
+     * hasn't been consumed. */
+    void *map;
+    size_t map_size;
+    size_t map_pos;
+    /* Set if map is memory passed to usf_open_mem(), which isn't
+     * unmapped */
+    int map_mem;
+
+    /* Block container state, only used in USF 0.3 and newer. */
+    int blocks;
+    int blocks_eof;
+    /* Buffer for compressed blocks */
+    char *cbuf;
+    size_t cbuf_size;
+    /* Number of bytes written to the file */
+    uint64_t offset;
+    /* Ordinal of the first event in the current block, number of
+     * events in it and their time range. */
+    uint64_t block_first_event;
+    uint32_t block_events;
+    usf_atime_t block_min_time;
+    usf_atime_t block_max_time;
+    /* Index of all blocks written so far, or of all blocks in the
+     * file once index_read is set in read mode. Files lacking an
+     * index have an empty index. */
+    usf_block_index_t *index;
+    size_t index_len;
+    size_t index_size;
+    int index_read;
+    /* Compression level requested when the file was created and
+     * number of threads requested when it was created or opened */
+    int level;
+    unsigned threads;
+    /* Blocks being compressed by the worker pool, jobs_head is the
+     * sequence number of the oldest block that hasn't been written
+     * and jobs_tail the sequence number of the next block. */
+    struct usf_pool_s *pool;
+    struct usf_block_job_s *jobs;
+    size_t jobs_len;
+    uint64_t jobs_head;
+    uint64_t jobs_tail;
+
+    /* Background decompression of pre-0.3 files, see
+     * usf_readahead.h */
+    usf_readahead_t *readahead;
+    /* Background writer if usf_options_t.async is set, see
+     * usf_async.h */
+    usf_async_t *async;
+    /* Background decoder if usf_options_t.prefetch is set, see
+     * usf_prefetch.h */
+    usf_prefetch_t *prefetch;
+
+    /* Statistics of the events appended if usf_options_t.stats is
+     * set, see usf_stats.h. stats_size is the number of entries
+     * allocated for the tid and burst tables. In read mode, the
+     * footer locates stats_bytes (0 if none) of statistics at
+     * stats_offset, stats_read is set once they have been loaded. */
+    usf_stats_t *stats;
+    size_t stats_size[2];
+    uint64_t stats_offset;
+    uint64_t stats_bytes;
+    int stats_read;
 };
 
+#define USF_BUF_SIZE (1024 * 1024)
+
+/** First version that uses the block container */
+#define USF_VERSION_BLOCKS USF_VERSION(0, 3)
+
 #define ARRAY_LEN(a) (sizeof(a) / sizeof(*a))
 
+/** Map signed deltas to unsigned values, small magnitudes first */
+static inline uint64_t
+zigzag(uint64_t delta)
+{
+    return (delta << 1) ^ (uint64_t)((int64_t)delta >> 63);
+}
+
+static inline uint64_t
+unzigzag(uint64_t z)
+{
+    return (z >> 1) ^ -(z & 1);
+}
+
 #endif
 
 /*
@@ -0,0 +1,221 @@
+/*
+ * Copyright (C) 2009-2011, Andreas Sandberg
+ * Copyright (C) 2009-2011, David Eklov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "usf_priv.h"
+#include "usf_internal.h"
+#include "usf_readahead.h"
+#include "error.h"
+
+#define CHUNKS 4
+#define CHUNK_SIZE (1024 * 1024)
+
+typedef struct {
+    char *data;
+    size_t len;
+} chunk_t;
+
+struct usf_readahead_s {
+    usf_file_t *file;
+    pthread_t thread;
+
+    pthread_mutex_t lock;
+    /* Signalled when a chunk has been filled or the stream ended */
+    pthread_cond_t filled;
+    /* Signalled when a chunk has been consumed or on stop requests */
+    pthread_cond_t drained;
+
+    chunk_t chunk[CHUNKS];
+    /* Number of chunks consumed and filled so far, the chunks in
+     * between are ready to be consumed. */
+    uint64_t head;
+    uint64_t tail;
+    /* Read position in the oldest chunk */
+    size_t pos;
+
+    /* Set when the producer has stopped, error is the reason */
+    int done;
+    usf_error_t error;
+    int stop;
+};
+
+static void *
+producer(void *arg)
+{
+    usf_readahead_t *ra = arg;
+    usf_error_t error = USF_ERROR_OK;
+    chunk_t *c;
+    size_t len;
+
+    while (error == USF_ERROR_OK) {
+        pthread_mutex_lock(&ra->lock);
+        while (ra->tail - ra->head == CHUNKS && !ra->stop)
+            pthread_cond_wait(&ra->drained, &ra->lock);
+        if (ra->stop) {
+            pthread_mutex_unlock(&ra->lock);
+            break;
+        }
+        pthread_mutex_unlock(&ra->lock);
+
+        /* Nobody else touches a chunk until it has been published */
+        c = &ra->chunk[ra->tail % CHUNKS];
+        for (c->len = 0; c->len < CHUNK_SIZE; c->len += len) {
+            error = ra->file->io_methods->read(ra->file, c->data + c->len,
+                                               CHUNK_SIZE - c->len, &len);
+            if (error != USF_ERROR_OK)
+                break;
+        }
+
+        pthread_mutex_lock(&ra->lock);
+        if (c->len)
+            ra->tail++;
+        if (error != USF_ERROR_OK) {
+            ra->done = 1;
+            ra->error = error;
+        }
+        pthread_cond_signal(&ra->filled);
+        pthread_mutex_unlock(&ra->lock);
+    }
+
+    return NULL;
+}
+
+static void
+free_readahead(usf_readahead_t *ra)
+{
+    for (int i = 0; i < CHUNKS; i++)
+        free(ra->chunk[i].data);
+
+    pthread_cond_destroy(&ra->drained);
+    pthread_cond_destroy(&ra->filled);
+    pthread_mutex_destroy(&ra->lock);
+    free(ra);
+}
+
+/** Start decompressing the file in the background. */
+usf_error_t
+usf_readahead_start(usf_file_t *file)
+{
+    usf_error_t error = USF_ERROR_OK;
+    usf_readahead_t *ra;
+
+    assert(file->mode == USF_MODE_READ && !file->readahead);
+    E_NULL(ra = calloc(1, sizeof(*ra)), USF_ERROR_MEM);
+    ra->file = file;
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->filled, NULL);
+    pthread_cond_init(&ra->drained, NULL);
+
+    for (int i = 0; i < CHUNKS; i++) {
+        if (!(ra->chunk[i].data = malloc(CHUNK_SIZE))) {
+            free_readahead(ra);
+            return USF_ERROR_MEM;
+        }
+    }
+
+    if (pthread_create(&ra->thread, NULL, producer, ra)) {
+        free_readahead(ra);
+        return USF_ERROR_SYS;
+    }
+
+    file->readahead = ra;
+
+ret_err:
+    return error;
+}
+
+/**
+ * Stop the background thread. Data that has been decompressed but
+ * not consumed is lost.
+ */
+void
+usf_readahead_stop(usf_file_t *file)
+{
+    usf_readahead_t *ra = file->readahead;
+
+    if (!ra)
+        return;
+
+    pthread_mutex_lock(&ra->lock);
+    ra->stop = 1;
+    pthread_cond_signal(&ra->drained);
+    pthread_mutex_unlock(&ra->lock);
+
+    pthread_join(ra->thread, NULL);
+    free_readahead(ra);
+    file->readahead = NULL;
+}
+
+/** Replacement for the codec's read method while read-ahead is on */
+usf_error_t
+usf_readahead_read(usf_file_t *file, void *buf, size_t count, size_t *len)
+{
+    usf_readahead_t *ra = file->readahead;
+    chunk_t *c;
+
+    *len = 0;
+    pthread_mutex_lock(&ra->lock);
+    while (ra->head == ra->tail && !ra->done)
+        pthread_cond_wait(&ra->filled, &ra->lock);
+    if (ra->head == ra->tail) {
+        pthread_mutex_unlock(&ra->lock);
+        return ra->error;
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    /* The producer leaves published chunks alone */
+    c = &ra->chunk[ra->head % CHUNKS];
+    *len = c->len - ra->pos < count ? c->len - ra->pos : count;
+    memcpy(buf, c->data + ra->pos, *len);
+    ra->pos += *len;
+
+    if (ra->pos == c->len) {
+        pthread_mutex_lock(&ra->lock);
+        ra->pos = 0;
+        ra->head++;
+        pthread_cond_signal(&ra->drained);
+        pthread_mutex_unlock(&ra->lock);
+    }
+
+    return USF_ERROR_OK;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
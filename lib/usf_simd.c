@@ -0,0 +1,380 @@
+/*
+ * Copyright (C) 2009-2011, Andreas Sandberg
+ * Copyright (C) 2009-2011, David Eklov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <pthread.h>
+
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#include "usf_simd.h"
+
+/*** Scalar kernels ***************************************************/
+
+#define SCALAR_KERNELS(suffix, type)                                    \
+    static uint64_t                                                     \
+    scalar_prefix_sum_##suffix(uint64_t *values, const char *src,       \
+                               size_t n, uint64_t acc)                  \
+    {                                                                   \
+        for (size_t i = 0; i < n; i++) {                                \
+            type d;                                                     \
+            memcpy(&d, src + i * sizeof(d), sizeof(d));                 \
+            acc += (uint64_t)(int64_t)d;                                \
+            values[i] = acc;                                            \
+        }                                                               \
+        return acc;                                                     \
+    }                                                                   \
+                                                                        \
+    static uint64_t                                                     \
+    scalar_sum_##suffix(const char *src, size_t n, uint64_t acc)        \
+    {                                                                   \
+        for (size_t i = 0; i < n; i++) {                                \
+            type d;                                                     \
+            memcpy(&d, src + i * sizeof(d), sizeof(d));                 \
+            acc += (uint64_t)(int64_t)d;                                \
+        }                                                               \
+        return acc;                                                     \
+    }
+
+SCALAR_KERNELS(8, int8_t)
+SCALAR_KERNELS(16, int16_t)
+SCALAR_KERNELS(32, int32_t)
+SCALAR_KERNELS(64, int64_t)
+
+static const usf_simd_kernels_t scalar_kernels = {
+    .name = "scalar",
+    .prefix_sum = {
+        scalar_prefix_sum_8, scalar_prefix_sum_16,
+        scalar_prefix_sum_32, scalar_prefix_sum_64,
+    },
+    .sum = {
+        scalar_sum_8, scalar_sum_16, scalar_sum_32, scalar_sum_64,
+    },
+};
+
+#ifdef HAVE_X86_SIMD
+
+/*** SSE4.1 kernels ***************************************************/
+
+#define SSE4 __attribute__((target("sse4.1"))) static inline
+
+/* Load two deltas at p and sign extend them to 64 bits */
+SSE4 __m128i
+sse4_load_8(const char *p)
+{
+    uint16_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return _mm_cvtepi8_epi64(_mm_cvtsi32_si128(v));
+}
+
+SSE4 __m128i
+sse4_load_16(const char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return _mm_cvtepi16_epi64(_mm_cvtsi32_si128(v));
+}
+
+SSE4 __m128i
+sse4_load_32(const char *p)
+{
+    return _mm_cvtepi32_epi64(_mm_loadl_epi64((const __m128i *)p));
+}
+
+SSE4 __m128i
+sse4_load_64(const char *p)
+{
+    return _mm_loadu_si128((const __m128i *)p);
+}
+
+/** Inclusive prefix sum of the two lanes of x */
+SSE4 __m128i
+sse4_scan(__m128i x)
+{
+    return _mm_add_epi64(x, _mm_slli_si128(x, 8));
+}
+
+/** Broadcast the last lane of x */
+SSE4 __m128i
+sse4_last(__m128i x)
+{
+    return _mm_unpackhi_epi64(x, x);
+}
+
+/*
+ * Four deltas are decoded per iteration. The second pair is scanned
+ * and offset by the sum of the first pair independently of the
+ * running sum, which leaves a single add on the loop carried path.
+ */
+#define SSE4_KERNELS(suffix, type)                                      \
+    __attribute__((target("sse4.1"))) static uint64_t                   \
+    sse4_prefix_sum_##suffix(uint64_t *values, const char *src,         \
+                             size_t n, uint64_t acc)                    \
+    {                                                                   \
+        __m128i vacc = _mm_set1_epi64x(acc);                            \
+        size_t i = 0;                                                   \
+                                                                        \
+        for (; i + 4 <= n; i += 4) {                                    \
+            const char *p = src + i * sizeof(type);                     \
+            __m128i a = sse4_load_##suffix(p);                          \
+            __m128i b = sse4_load_##suffix(p + 2 * sizeof(type));       \
+            a = sse4_scan(a);                                           \
+            b = _mm_add_epi64(sse4_scan(b), sse4_last(a));              \
+            _mm_storeu_si128((__m128i *)(values + i),                   \
+                             _mm_add_epi64(a, vacc));                   \
+            _mm_storeu_si128((__m128i *)(values + i + 2),               \
+                             _mm_add_epi64(b, vacc));                   \
+            vacc = _mm_add_epi64(vacc, sse4_last(b));                   \
+        }                                                               \
+                                                                        \
+        acc = (uint64_t)_mm_cvtsi128_si64(vacc);                        \
+        return scalar_prefix_sum_##suffix(values + i,                   \
+                                          src + i * sizeof(type),       \
+                                          n - i, acc);                  \
+    }                                                                   \
+                                                                        \
+    __attribute__((target("sse4.1"))) static uint64_t                   \
+    sse4_sum_##suffix(const char *src, size_t n, uint64_t acc)          \
+    {                                                                   \
+        __m128i a = _mm_setzero_si128(), b = _mm_setzero_si128();       \
+        size_t i = 0;                                                   \
+                                                                        \
+        for (; i + 4 <= n; i += 4) {                                    \
+            const char *p = src + i * sizeof(type);                     \
+            a = _mm_add_epi64(a, sse4_load_##suffix(p));                \
+            b = _mm_add_epi64(b, sse4_load_##suffix(p + 2 * sizeof(type))); \
+        }                                                               \
+                                                                        \
+        a = _mm_add_epi64(a, b);                                        \
+        acc += (uint64_t)_mm_cvtsi128_si64(a) +                         \
+            (uint64_t)_mm_extract_epi64(a, 1);                          \
+        return scalar_sum_##suffix(src + i * sizeof(type), n - i, acc); \
+    }
+
+SSE4_KERNELS(8, int8_t)
+SSE4_KERNELS(16, int16_t)
+SSE4_KERNELS(32, int32_t)
+SSE4_KERNELS(64, int64_t)
+
+static const usf_simd_kernels_t sse4_kernels = {
+    .name = "sse4.1",
+    .prefix_sum = {
+        sse4_prefix_sum_8, sse4_prefix_sum_16,
+        sse4_prefix_sum_32, sse4_prefix_sum_64,
+    },
+    .sum = {
+        sse4_sum_8, sse4_sum_16, sse4_sum_32, sse4_sum_64,
+    },
+};
+
+/*** AVX2 kernels *****************************************************/
+
+#define AVX2 __attribute__((target("avx2"))) static inline
+
+/* Load four deltas at p and sign extend them to 64 bits */
+AVX2 __m256i
+avx2_load_8(const char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return _mm256_cvtepi8_epi64(_mm_cvtsi32_si128(v));
+}
+
+AVX2 __m256i
+avx2_load_16(const char *p)
+{
+    return _mm256_cvtepi16_epi64(_mm_loadl_epi64((const __m128i *)p));
+}
+
+AVX2 __m256i
+avx2_load_32(const char *p)
+{
+    return _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i *)p));
+}
+
+AVX2 __m256i
+avx2_load_64(const char *p)
+{
+    return _mm256_loadu_si256((const __m256i *)p);
+}
+
+/**
+ * Inclusive prefix sum of the four lanes of x. Lanes are shifted
+ * across the 128-bit halves with a permute and the vacated lanes are
+ * cleared with a blend.
+ */
+AVX2 __m256i
+avx2_scan(__m256i x)
+{
+    const __m256i zero = _mm256_setzero_si256();
+
+    x = _mm256_add_epi64(x, _mm256_blend_epi32(
+        _mm256_permute4x64_epi64(x, _MM_SHUFFLE(2, 1, 0, 0)), zero, 0x03));
+    x = _mm256_add_epi64(x, _mm256_blend_epi32(
+        _mm256_permute4x64_epi64(x, _MM_SHUFFLE(1, 0, 0, 0)), zero, 0x0f));
+    return x;
+}
+
+/** Broadcast the last lane of x */
+AVX2 __m256i
+avx2_last(__m256i x)
+{
+    return _mm256_permute4x64_epi64(x, _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+/* Same structure as the SSE4.1 kernels, with eight deltas per
+ * iteration */
+#define AVX2_KERNELS(suffix, type)                                      \
+    __attribute__((target("avx2"))) static uint64_t                     \
+    avx2_prefix_sum_##suffix(uint64_t *values, const char *src,         \
+                             size_t n, uint64_t acc)                    \
+    {                                                                   \
+        __m256i vacc = _mm256_set1_epi64x(acc);                         \
+        size_t i = 0;                                                   \
+                                                                        \
+        for (; i + 8 <= n; i += 8) {                                    \
+            const char *p = src + i * sizeof(type);                     \
+            __m256i a = avx2_load_##suffix(p);                          \
+            __m256i b = avx2_load_##suffix(p + 4 * sizeof(type));       \
+            a = avx2_scan(a);                                           \
+            b = _mm256_add_epi64(avx2_scan(b), avx2_last(a));           \
+            _mm256_storeu_si256((__m256i *)(values + i),                \
+                                _mm256_add_epi64(a, vacc));             \
+            _mm256_storeu_si256((__m256i *)(values + i + 4),            \
+                                _mm256_add_epi64(b, vacc));             \
+            vacc = _mm256_add_epi64(vacc, avx2_last(b));                \
+        }                                                               \
+                                                                        \
+        acc = (uint64_t)_mm256_extract_epi64(vacc, 0);                  \
+        return scalar_prefix_sum_##suffix(values + i,                   \
+                                          src + i * sizeof(type),       \
+                                          n - i, acc);                  \
+    }                                                                   \
+                                                                        \
+    __attribute__((target("avx2"))) static uint64_t                     \
+    avx2_sum_##suffix(const char *src, size_t n, uint64_t acc)          \
+    {                                                                   \
+        __m256i a = _mm256_setzero_si256(), b = _mm256_setzero_si256(); \
+        __m128i s;                                                      \
+        size_t i = 0;                                                   \
+                                                                        \
+        for (; i + 8 <= n; i += 8) {                                    \
+            const char *p = src + i * sizeof(type);                     \
+            a = _mm256_add_epi64(a, avx2_load_##suffix(p));             \
+            b = _mm256_add_epi64(b, avx2_load_##suffix(p + 4 * sizeof(type))); \
+        }                                                               \
+                                                                        \
+        a = _mm256_add_epi64(a, b);                                     \
+        s = _mm_add_epi64(_mm256_castsi256_si128(a),                    \
+                          _mm256_extracti128_si256(a, 1));              \
+        acc += (uint64_t)_mm_cvtsi128_si64(s) +                         \
+            (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(s, s));      \
+        return scalar_sum_##suffix(src + i * sizeof(type), n - i, acc); \
+    }
+
+AVX2_KERNELS(8, int8_t)
+AVX2_KERNELS(16, int16_t)
+AVX2_KERNELS(32, int32_t)
+AVX2_KERNELS(64, int64_t)
+
+static const usf_simd_kernels_t avx2_kernels = {
+    .name = "avx2",
+    .prefix_sum = {
+        avx2_prefix_sum_8, avx2_prefix_sum_16,
+        avx2_prefix_sum_32, avx2_prefix_sum_64,
+    },
+    .sum = {
+        avx2_sum_8, avx2_sum_16, avx2_sum_32, avx2_sum_64,
+    },
+};
+
+#endif
+
+/*** Dispatch *********************************************************/
+
+const usf_simd_kernels_t *
+usf_simd_kernels(usf_simd_level_t level)
+{
+    switch (level) {
+    case USF_SIMD_SCALAR:
+        return &scalar_kernels;
+#ifdef HAVE_X86_SIMD
+    case USF_SIMD_SSE4:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse4.1") ? &sse4_kernels : NULL;
+    case USF_SIMD_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") ? &avx2_kernels : NULL;
+#endif
+    default:
+        return NULL;
+    }
+}
+
+static pthread_once_t best_once = PTHREAD_ONCE_INIT;
+static const usf_simd_kernels_t *best_kernels = &scalar_kernels;
+
+static void
+select_best(void)
+{
+    for (int level = USF_SIMD_COUNT - 1; level >= 0; level--) {
+        const usf_simd_kernels_t *k = usf_simd_kernels(level);
+
+        if (k) {
+            best_kernels = k;
+            break;
+        }
+    }
+}
+
+const usf_simd_kernels_t *
+usf_simd_best(void)
+{
+    pthread_once(&best_once, select_best);
+    return best_kernels;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
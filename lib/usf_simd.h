@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2009-2011, Andreas Sandberg
+ * Copyright (C) 2009-2011, David Eklov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef USF_SIMD_H
+#define USF_SIMD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Vectorized column decoding kernels.
+ *
+ * Delta columns store signed 1, 2, 4 or 8 byte differences that have
+ * to be widened to 64 bits and turned into a running sum. The
+ * kernels do both in one pass. There is a portable scalar version of
+ * every kernel and, on x86, SSE4.1 and AVX2 versions that are picked
+ * at run time depending on what the CPU supports.
+ */
+typedef enum {
+    USF_SIMD_SCALAR = 0,
+    USF_SIMD_SSE4,
+    USF_SIMD_AVX2,
+
+    USF_SIMD_COUNT
+} usf_simd_level_t;
+
+/* Kernel index of a delta width of 1, 2, 4 or 8 bytes */
+#define USF_SIMD_WIDTH_INDEX(width) \
+    ((width) == 1 ? 0 : (width) == 2 ? 1 : (width) == 4 ? 2 : 3)
+
+typedef struct {
+    const char *name;
+    /* Widen the n deltas at src, add them to acc and store the
+     * running sum in values. Returns the last sum. */
+    uint64_t (*prefix_sum[4])(uint64_t *values, const char *src,
+                              size_t n, uint64_t acc);
+    /* Add the n deltas at src to acc and return the result */
+    uint64_t (*sum[4])(const char *src, size_t n, uint64_t acc);
+} usf_simd_kernels_t;
+
+/** Kernels for level, NULL if the CPU or build doesn't support it */
+const usf_simd_kernels_t *usf_simd_kernels(usf_simd_level_t level);
+/** The best kernels supported by the CPU */
+const usf_simd_kernels_t *usf_simd_best(void);
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
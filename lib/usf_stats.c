@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2009-2011, Andreas Sandberg
+ * Copyright (C) 2009-2011, David Eklov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "usf_stats.h"
+#include "error.h"
+
+usf_error_t
+usf_stats_init(usf_file_t *file)
+{
+    usf_error_t error = USF_ERROR_OK;
+    usf_stats_t *stats;
+
+    E_NULL(stats = calloc(1, sizeof(*stats)), USF_ERROR_MEM);
+    stats->min_time = (usf_atime_t)-1;
+    stats->min_addr = (usf_addr_t)-1;
+    file->stats = stats;
+
+    /* Events before the first burst */
+    E_ERROR(usf_stats_grow(stats, file->stats_size, 0, 1));
+    stats->bursts = 1;
+
+ret_err:
+    return error;
+}
+
+void
+usf_stats_free(usf_stats_t *stats)
+{
+    if (!stats)
+        return;
+
+    free(stats->tid);
+    free(stats->burst);
+    free(stats);
+}
+
+/** Grow a zeroed array of counts to at least len entries */
+static usf_error_t
+grow(usf_stats_count_t **counts, size_t used, size_t *size, size_t len)
+{
+    usf_stats_count_t *c;
+    size_t new_size;
+
+    if (len <= *size)
+        return USF_ERROR_OK;
+
+    new_size = *size ? 2 * *size : 16;
+    if (new_size < len)
+        new_size = len;
+    if (!(c = realloc(*counts, new_size * sizeof(*c))))
+        return USF_ERROR_MEM;
+
+    memset(c + used, 0, (new_size - used) * sizeof(*c));
+    *counts = c;
+    *size = new_size;
+    return USF_ERROR_OK;
+}
+
+/**
+ * Allocate room for at least tids and bursts entries in the tid and
+ * burst tables, unused entries are zeroed. size[0] and size[1] are
+ * the number of entries allocated for the tables.
+ */
+usf_error_t
+usf_stats_grow(usf_stats_t *stats, size_t *size, size_t tids,
+               size_t bursts)
+{
+    usf_error_t error = USF_ERROR_OK;
+
+    E_ERROR(grow(&stats->tid, stats->tids, &size[0], tids));
+    E_ERROR(grow(&stats->burst, stats->bursts, &size[1], bursts));
+
+ret_err:
+    return error;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2009-2011, Andreas Sandberg
+ * Copyright (C) 2009-2011, David Eklov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef USF_STATS_H
+#define USF_STATS_H
+
+#include "usf_priv.h"
+
+/**
+ * Statistics of the events written to a file (usf_options_t.stats).
+ *
+ * The event writers call usf_stats_reserve() before an event is
+ * encoded and usf_stats_add() once it has been, so events that fail
+ * to encode aren't counted. The block container stores the result
+ * after the block index when the file is closed, see usf_block.h.
+ */
+usf_error_t usf_stats_init(usf_file_t *file);
+void usf_stats_free(usf_stats_t *stats);
+usf_error_t usf_stats_grow(usf_stats_t *stats, size_t *size, size_t tids,
+                           size_t bursts);
+
+static inline const usf_access_t *
+usf_stats_event_access(const usf_event_t *event)
+{
+    switch (event->type) {
+    case USF_EVENT_SAMPLE:
+        return &event->u.sample.begin;
+    case USF_EVENT_DANGLING:
+        return &event->u.dangling.begin;
+    case USF_EVENT_BURST:
+        return NULL;
+    default:
+        return &event->u.trace.access;
+    }
+}
+
+/** Make room in the tid and burst tables for an event */
+static inline usf_error_t
+usf_stats_reserve(usf_file_t *file, const usf_event_t *event)
+{
+    usf_stats_t *stats = file->stats;
+    const usf_access_t *access = usf_stats_event_access(event);
+
+    if (event->type == USF_EVENT_BURST)
+        return usf_stats_grow(stats, file->stats_size, 0,
+                              stats->bursts + 1);
+    else if (access->tid >= stats->tids)
+        return usf_stats_grow(stats, file->stats_size, access->tid + 1, 0);
+    else
+        return USF_ERROR_OK;
+}
+
+static inline void
+usf_stats_access(usf_stats_t *stats, const usf_access_t *access)
+{
+    if (access->time < stats->min_time)
+        stats->min_time = access->time;
+    if (access->time > stats->max_time)
+        stats->max_time = access->time;
+    if (access->addr < stats->min_addr)
+        stats->min_addr = access->addr;
+    if (access->addr > stats->max_addr)
+        stats->max_addr = access->addr;
+}
+
+/** Account for an event that has been appended, the tables must
+ * have been grown by usf_stats_reserve() */
+static inline void
+usf_stats_add(usf_file_t *file, const usf_event_t *event)
+{
+    usf_stats_t *stats = file->stats;
+    const usf_access_t *access = usf_stats_event_access(event);
+    const usf_event_type_t type = event->type;
+
+    switch (type) {
+    case USF_EVENT_SAMPLE:
+        usf_stats_access(stats, &event->u.sample.end);
+        if (event->u.sample.line_size < USF_STATS_LINE_SIZES)
+            stats->line_sizes[event->u.sample.line_size]++;
+        break;
+    case USF_EVENT_DANGLING:
+        if (event->u.dangling.line_size < USF_STATS_LINE_SIZES)
+            stats->line_sizes[event->u.dangling.line_size]++;
+        break;
+    case USF_EVENT_BURST:
+        stats->bursts++;
+        break;
+    }
+
+    stats->total.events[type]++;
+    stats->burst[stats->bursts - 1].events[type]++;
+    if (access) {
+        usf_stats_access(stats, access);
+        if (access->tid >= stats->tids)
+            stats->tids = access->tid + 1;
+        stats->tid[access->tid].events[type]++;
+    }
+}
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
@@ -0,0 +1,284 @@
+/*
+ * Copyright (C) 2009-2011, Andreas Sandberg
+ * Copyright (C) 2009-2011, David Eklov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_IO_URING
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "usf_uring.h"
+#include "error.h"
+
+#ifdef HAVE_IO_URING
+
+struct usf_uring_s {
+    int fd;
+    unsigned entries;
+    /* Requests prepared but not yet submitted */
+    unsigned queued;
+
+    /* The rings are shared with the kernel. sq_tail and cq_head are
+     * only written by us, sq_head and cq_tail only by the kernel. */
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+#define LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static int
+sys_enter(usf_uring_t *ring, unsigned to_submit, unsigned min_complete,
+          unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete,
+                   flags, NULL, 0);
+}
+
+usf_error_t
+usf_uring_create(usf_uring_t **ring, unsigned entries)
+{
+    usf_error_t error = USF_ERROR_OK;
+    struct io_uring_params p;
+    usf_uring_t *r;
+    char *sq, *cq;
+
+    E_NULL(r = calloc(1, sizeof(*r)), USF_ERROR_MEM);
+    r->sq_map = r->cq_map = r->sqes = MAP_FAILED;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    /* Not compiled in, disabled or blocked by a seccomp filter */
+    E_IF(r->fd < 0, errno == ENOSYS || errno == EPERM ?
+         USF_ERROR_UNSUPPORTED : USF_ERROR_SYS);
+    /* Plain reads and writes appeared together with this feature */
+    E_IF(!(p.features & IORING_FEAT_RW_CUR_POS), USF_ERROR_UNSUPPORTED);
+    r->entries = p.sq_entries;
+
+    r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_size = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_map_size > r->sq_map_size)
+            r->sq_map_size = r->cq_map_size;
+    }
+
+    r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    E_IF(r->sq_map == MAP_FAILED, USF_ERROR_SYS);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_map = r->sq_map;
+    } else {
+        r->cq_map = mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd,
+                         IORING_OFF_CQ_RING);
+        E_IF(r->cq_map == MAP_FAILED, USF_ERROR_SYS);
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    E_IF(r->sqes == MAP_FAILED, USF_ERROR_SYS);
+
+    sq = r->sq_map;
+    cq = r->cq_map;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    *ring = r;
+    return USF_ERROR_OK;
+
+ret_err:
+    usf_uring_destroy(r);
+    return error;
+}
+
+void
+usf_uring_destroy(usf_uring_t *ring)
+{
+    if (!ring)
+        return;
+
+    if (ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_map_size);
+    if (ring->sq_map != MAP_FAILED)
+        munmap(ring->sq_map, ring->sq_map_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    free(ring);
+}
+
+usf_error_t
+usf_uring_prep(usf_uring_t *ring, int write, int fd, void *buf,
+               size_t len, uint64_t offset, uint64_t data)
+{
+    usf_error_t error;
+    struct io_uring_sqe *sqe;
+    unsigned tail = *ring->sq_tail;
+    unsigned idx;
+
+    if (len > UINT32_MAX)
+        return USF_ERROR_PARAM;
+    if (tail - LOAD(ring->sq_head) >= ring->entries &&
+        (error = usf_uring_submit(ring)) != USF_ERROR_OK)
+        return error;
+
+    idx = tail & *ring->sq_mask;
+    sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = data;
+    ring->sq_array[idx] = idx;
+    STORE(ring->sq_tail, tail + 1);
+    ring->queued++;
+
+    return USF_ERROR_OK;
+}
+
+usf_error_t
+usf_uring_submit(usf_uring_t *ring)
+{
+    while (ring->queued) {
+        int ret = sys_enter(ring, ring->queued, 0, 0);
+
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return USF_ERROR_SYS;
+        }
+        ring->queued -= ret;
+    }
+
+    return USF_ERROR_OK;
+}
+
+usf_error_t
+usf_uring_wait(usf_uring_t *ring, uint64_t *data, int32_t *res)
+{
+    for (;;) {
+        const unsigned head = *ring->cq_head;
+        int ret;
+
+        if (head != LOAD(ring->cq_tail)) {
+            const struct io_uring_cqe *cqe =
+                &ring->cqes[head & *ring->cq_mask];
+
+            *data = cqe->user_data;
+            *res = cqe->res;
+            STORE(ring->cq_head, head + 1);
+            return USF_ERROR_OK;
+        }
+
+        ret = sys_enter(ring, ring->queued, 1, IORING_ENTER_GETEVENTS);
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return USF_ERROR_SYS;
+        }
+        ring->queued -= ret;
+    }
+}
+
+#else
+
+usf_error_t
+usf_uring_create(usf_uring_t **ring, unsigned entries)
+{
+    return USF_ERROR_UNSUPPORTED;
+}
+
+void
+usf_uring_destroy(usf_uring_t *ring)
+{
+}
+
+usf_error_t
+usf_uring_prep(usf_uring_t *ring, int write, int fd, void *buf,
+               size_t len, uint64_t offset, uint64_t data)
+{
+    return USF_ERROR_UNSUPPORTED;
+}
+
+usf_error_t
+usf_uring_submit(usf_uring_t *ring)
+{
+    return USF_ERROR_UNSUPPORTED;
+}
+
+usf_error_t
+usf_uring_wait(usf_uring_t *ring, uint64_t *data, int32_t *res)
+{
+    return USF_ERROR_UNSUPPORTED;
+}
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
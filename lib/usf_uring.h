@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2009-2011, Andreas Sandberg
+ * Copyright (C) 2009-2011, David Eklov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef USF_URING_H
+#define USF_URING_H
+
+#include <stdint.h>
+#include <uart/usf.h>
+
+/**
+ * Minimal io_uring submission and completion queue.
+ *
+ * Reads and writes are queued with usf_uring_prep() and handed to
+ * the kernel in one system call by the next usf_uring_submit() or
+ * usf_uring_wait(). Completions may arrive in any order, each one
+ * returns the data word of its request and the result of the
+ * equivalent pread() or pwrite() (or -errno).
+ *
+ * usf_uring_create() fails with USF_ERROR_UNSUPPORTED if the library
+ * was built without io_uring or the kernel doesn't provide it, the
+ * caller then falls back to synchronous I/O.
+ */
+typedef struct usf_uring_s usf_uring_t;
+
+usf_error_t usf_uring_create(usf_uring_t **ring, unsigned entries);
+void usf_uring_destroy(usf_uring_t *ring);
+
+usf_error_t usf_uring_prep(usf_uring_t *ring, int write, int fd,
+                           void *buf, size_t len, uint64_t offset,
+                           uint64_t data);
+usf_error_t usf_uring_submit(usf_uring_t *ring);
+/** Wait for a completion */
+usf_error_t usf_uring_wait(usf_uring_t *ring, uint64_t *data,
+                           int32_t *res);
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
@@ -28,6 +28,8 @@
  * OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <string.h>
+
 #include "usf_priv.h"
 
 static const char *usf_errors[] = {
@@ -43,6 +45,18 @@ static const char *usf_errors[] = {
 static const char *usf_compressions[] = {
     "None",
     "BZip2",
+    "Zstandard",
+    "LZ4",
+    "XZ",
+};
+
+/* Names used by usf_parsecompr() */
+static const char *usf_compression_names[] = {
+    "none",
+    "bzip2",
+    "zstd",
+    "lz4",
+    "xz",
 };
 
 static const char *usf_atypes[] = {
@@ -80,6 +94,28 @@ usf_strcompr(usf_compression_t compr)
 	return "Unknown";
 }
 
+usf_error_t
+usf_parsecompr(usf_compression_t *compr, const char *name)
+{
+    for (usf_compression_t i = 0; i < ARRAY_LEN(usf_compression_names); i++) {
+        if (!strcmp(usf_compression_names[i], name)) {
+            *compr = i;
+            return usf_hascompr(i) ? USF_ERROR_OK : USF_ERROR_UNSUPPORTED;
+        }
+    }
+
+    return USF_ERROR_PARAM;
+}
+
+const char *
+usf_namecompr(usf_compression_t compr)
+{
+    if (compr < ARRAY_LEN(usf_compression_names))
+	return usf_compression_names[compr];
+    else
+	return NULL;
+}
+
 const char *
 usf_stratype(usf_atype_t atype)
 {
@@ -49,6 +49,24 @@ KNOB<BOOL> knob_detach(KNOB_MODE_WRITEONCE,
                        "pintool", "d", "0", "Exit pin on stop condition");
 KNOB<BOOL> knob_bzip2(KNOB_MODE_WRITEONCE,
                       "pintool", "c", "0", "Enable BZip2 compression");
+KNOB<string> knob_compression(KNOB_MODE_WRITEONCE,
+                              "pintool", "comp", "",
+                              "Compression algorithm (none, bzip2, zstd, lz4, xz), overrides -c");
+KNOB<INT32> knob_level(KNOB_MODE_WRITEONCE,
+                       "pintool", "level", "0", "Compression level, 0 for the default");
+KNOB<BOOL> knob_varint(KNOB_MODE_WRITEONCE,
+                       "pintool", "varint", "1", "Use variable length deltas");
+KNOB<BOOL> knob_tid_context(KNOB_MODE_WRITEONCE,
+                            "pintool", "tidctx", "1", "Use per-thread delta contexts");
+KNOB<BOOL> knob_stride(KNOB_MODE_WRITEONCE,
+                       "pintool", "stride", "1", "Use per-pc address prediction");
+KNOB<BOOL> knob_pc_dict(KNOB_MODE_WRITEONCE,
+                        "pintool", "pcdict", "0", "Use a pc dictionary");
+KNOB<BOOL> knob_columns(KNOB_MODE_WRITEONCE,
+                        "pintool", "columns", "0",
+                        "Store the trace in columns, disables delta compression");
+KNOB<BOOL> knob_stats(KNOB_MODE_WRITEONCE,
+                      "pintool", "stats", "1", "Store a statistics trailer");
 KNOB<BOOL> knob_inst_time(KNOB_MODE_WRITEONCE,
                           "pintool", "i", "0", "Use instruction count as time base");
 
@@ -58,6 +76,7 @@ static unsigned long end_addr = 0;
 static UINT64 end_cnt = (UINT64)-1;
 
 static usf_file_t *usf_file = NULL;
+static PIN_LOCK usf_lock;
 static usf_atime_t inst_count = 0;
 static usf_atime_t access_count = 0;
 
@@ -84,11 +103,22 @@ static VOID
 log_access(VOID *pc, VOID *addr, ADDRINT size, THREADID tid, UINT32 access_type)
 {
     usf_event_t e;
+    usf_atime_t count;
+
+    /* Application threads share the file, appending under the lock
+     * keeps the trace ordered by time */
+    PIN_GetLock(&usf_lock, tid + 1);
+    if (!usf_file) {
+        /* Closed by fini() */
+        PIN_ReleaseLock(&usf_lock);
+        return;
+    }
+    count = access_count++;
 
     e.type = USF_EVENT_TRACE;
     e.u.trace.access.pc = (usf_addr_t)pc;
     e.u.trace.access.addr = (usf_addr_t)addr;
-    e.u.trace.access.time = knob_inst_time ? inst_count : access_count;
+    e.u.trace.access.time = knob_inst_time ? inst_count : count;
     e.u.trace.access.tid = (usf_tid_t)tid;
     e.u.trace.access.len = (usf_alen_t)size;
     e.u.trace.access.type = (usf_atype_t)access_type;
@@ -97,9 +127,9 @@ log_access(VOID *pc, VOID *addr, ADDRINT size, THREADID tid, UINT32 access_type)
         cerr << "USF: Failed to append event."  << endl;
         abort();
     }
+    PIN_ReleaseLock(&usf_lock);
 
-    access_count++;
-    if (access_count >= end_cnt)
+    if (count + 1 == end_cnt)
         stop_trace();
 }
 
@@ -164,11 +194,13 @@ init(int argc, char *argv[])
 {
     const char *filename = knob_filename.Value().c_str();
     usf_header_t header;
+    usf_options_t options;
     struct timeval tv;
     int target_argc = argc;
     char **target_argv = argv;
 
     memset(&header, 0, sizeof(header));
+    memset(&options, 0, sizeof(options));
     
     begin_addr = knob_begin_addr;
     if (!begin_addr)
@@ -179,8 +211,25 @@ init(int argc, char *argv[])
 
     header.version = USF_VERSION_CURRENT;
     header.compression = knob_bzip2.Value() ? USF_COMPRESSION_BZIP2 : USF_COMPRESSION_NONE;
-    header.flags = USF_FLAG_NATIVE_ENDIAN | USF_FLAG_TRACE | USF_FLAG_DELTA |
+    if (!knob_compression.Value().empty() &&
+        usf_parsecompr(&header.compression,
+                       knob_compression.Value().c_str()) != USF_ERROR_OK) {
+        cerr << "Unsupported compression: "
+             << knob_compression.Value() << endl;
+        return -1;
+    }
+    options.level = knob_level;
+    options.stats = knob_stats;
+    header.flags = USF_FLAG_NATIVE_ENDIAN | USF_FLAG_TRACE |
         (knob_inst_time ? USF_FLAG_TIME_INSTRUCTIONS : USF_FLAG_TIME_ACCESSES);
+    if (knob_columns)
+        header.flags |= USF_FLAG_COLUMNS;
+    else
+        header.flags |= USF_FLAG_DELTA |
+            (knob_varint ? USF_FLAG_VARINT : 0) |
+            (knob_tid_context ? USF_FLAG_TID_CONTEXT : 0) |
+            (knob_stride ? USF_FLAG_STRIDE : 0) |
+            (knob_pc_dict ? USF_FLAG_PC_DICT : 0);
 
     if (gettimeofday(&tv, NULL) == 0)
 	header.time_begin = tv.tv_sec;
@@ -197,17 +246,25 @@ init(int argc, char *argv[])
     header.argc = target_argc;
     header.argv = target_argv;
 
-    return usf_create(&usf_file, filename, &header) == USF_ERROR_OK ? 0 : -1;
+    return usf_create_opts(&usf_file, filename, &header, &options) ==
+        USF_ERROR_OK ? 0 : -1;
 }
 
 static VOID
 fini(INT32 code, VOID *v)
 {
-    cerr << "=== Trace statistics ===" << endl;
-    cerr << "Instructions: " << inst_count << endl;
-    cerr << "Memory accesses: " << access_count << endl;
-
-    usf_close(usf_file);
+    /* Other threads may still be appending if the trace was
+     * stopped early */
+    PIN_GetLock(&usf_lock, PIN_ThreadId() + 1);
+    if (usf_file) {
+        cerr << "=== Trace statistics ===" << endl;
+        cerr << "Instructions: " << inst_count << endl;
+        cerr << "Memory accesses: " << access_count << endl;
+
+        usf_close(usf_file);
+        usf_file = NULL;
+    }
+    PIN_ReleaseLock(&usf_lock);
 }
 
 static int
@@ -230,6 +287,7 @@ main(int argc, char *argv[])
     if (PIN_Init(argc, argv))
         return usage();
 
+    PIN_InitLock(&usf_lock);
     if (init(argc, argv))
         return -1;
 
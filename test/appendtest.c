@@ -0,0 +1,200 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <uart/usf.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "testutil.h"
+
+#define MAX_THREADS 64
+/* Events appended by each thread, every seventh call is a batch */
+#define EVENTS 100000
+#define BATCH 100
+/* Time usf_seek_time() is checked with, in the middle of thread 1 */
+#define SEEK_TIME ((MAX_THREADS - 2) * EVENTS + EVENTS / 2)
+
+typedef struct {
+    usf_file_t *file;
+    unsigned tid;
+} producer_t;
+
+/* Access i of thread tid. Threads get descending time ranges, so the
+ * file isn't ordered by time unless they happen to run in reverse. */
+static void
+make_thread_access(usf_access_t *a, unsigned tid, uint64_t i)
+{
+    a->pc = 0x400000 + ((i + tid) % 97) * 4;
+    a->addr = 0x10000000 + tid * 0x100000 + (i * 8) % 65536;
+    a->time = (uint64_t)(MAX_THREADS - 1 - tid) * EVENTS + i;
+    a->tid = tid;
+    a->len = 8;
+    a->type = i % 5 ? USF_ATYPE_RD : USF_ATYPE_WR;
+}
+
+static void *
+producer(void *arg)
+{
+    producer_t *p = arg;
+    usf_event_t events[BATCH];
+    uint64_t i = 0;
+
+    memset(events, 0, sizeof(events));
+    for (int call = 0; i < EVENTS; call++) {
+	size_t n = call % 7 ? 1 : BATCH;
+
+	if (n > EVENTS - i)
+	    n = EVENTS - i;
+	for (size_t j = 0; j < n; j++) {
+	    events[j].type = USF_EVENT_TRACE;
+	    make_thread_access(&events[j].u.trace.access, p->tid, i + j);
+	}
+	if (n == 1)
+	    C_E(usf_append(p->file, &events[0]));
+	else
+	    C_E(usf_append_batch(p->file, events, n));
+	i += n;
+    }
+
+    return NULL;
+}
+
+/* Append from several threads at once and check that every thread's
+ * events were written in order */
+static void
+check_file(const char *path, usf_version_t version,
+	   usf_compression_t compression, usf_flags_t flags,
+	   unsigned threads, unsigned async)
+{
+    usf_options_t options = {
+	.threads = 2, .async = async, .concurrent = 1
+    };
+    usf_header_t header = {
+	version,
+	compression,
+	USF_FLAG_NATIVE_ENDIAN | USF_FLAG_TRACE | flags,
+	0,
+	EVENTS,
+	0,
+	0,
+	NULL
+    };
+    producer_t producers[MAX_THREADS];
+    pthread_t thread[MAX_THREADS];
+    uint64_t next[MAX_THREADS];
+    usf_file_t *file;
+    usf_event_t event;
+    usf_access_t ref;
+    usf_error_t error;
+    uint64_t count = 0;
+    uint64_t seek_pos = UINT64_MAX;
+    uint64_t pos;
+    double t;
+
+    C_E(usf_create_opts(&file, path, &header, &options));
+    t = now();
+    for (unsigned i = 0; i < threads; i++) {
+	producers[i].file = file;
+	producers[i].tid = i;
+	if (pthread_create(&thread[i], NULL, producer, &producers[i]))
+	    abort();
+    }
+    for (unsigned i = 0; i < threads; i++)
+	pthread_join(thread[i], NULL);
+
+    C_E(usf_tell(file, &pos));
+    if (pos != (uint64_t)threads * EVENTS) {
+	fprintf(stderr, "Position %" PRIu64 " after appending\n", pos);
+	exit(EXIT_FAILURE);
+    }
+    C_E(usf_close(file));
+    t = now() - t;
+    printf("%u threads, %s, flags 0x%x: %.2f Mevents/s\n",
+	   threads, usf_strcompr(compression), flags,
+	   threads * EVENTS / t * 1E-6);
+
+    memset(next, 0, sizeof(next));
+    C_E(usf_open(&file, path));
+    while ((error = usf_read(file, &event)) == USF_ERROR_OK) {
+	const usf_access_t *a = &event.u.trace.access;
+
+	if (event.type != USF_EVENT_TRACE || a->tid >= threads) {
+	    fprintf(stderr, "Event %" PRIu64 " is invalid\n", count);
+	    exit(EXIT_FAILURE);
+	}
+	make_thread_access(&ref, a->tid, next[a->tid]++);
+	if (!access_eq(a, &ref)) {
+	    fprintf(stderr, "Event %" PRIu64 " of thread %u is out of "
+		    "order\n", next[a->tid] - 1, (unsigned)a->tid);
+	    exit(EXIT_FAILURE);
+	}
+	if (a->time >= SEEK_TIME && seek_pos == UINT64_MAX)
+	    seek_pos = count;
+	count++;
+    }
+    if (error != USF_ERROR_EOF)
+	C_E(error);
+    C_E(usf_close(file));
+
+    if (count != (uint64_t)threads * EVENTS) {
+	fprintf(stderr, "Read %" PRIu64 " events\n", count);
+	exit(EXIT_FAILURE);
+    }
+
+    /* The threads' events are interleaved, seeking has to find the
+     * first matching event in file order */
+    C_E(usf_open(&file, path));
+    C_E(usf_seek_time(file, SEEK_TIME));
+    C_E(usf_tell(file, &pos));
+    C_E(usf_read(file, &event));
+    if (pos != seek_pos || event.u.trace.access.time < SEEK_TIME) {
+	fprintf(stderr, "Seek to %u ended at event %" PRIu64
+		", expected %" PRIu64 "\n", SEEK_TIME, pos, seek_pos);
+	exit(EXIT_FAILURE);
+    }
+    C_E(usf_close(file));
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned threads = 8;
+
+    if (argc < 2 || argc > 3) {
+	fprintf(stderr, "%s FILE [THREADS]\n", argv[0]);
+	exit(EXIT_FAILURE);
+    }
+    if (argc == 3)
+	threads = strtoul(argv[2], NULL, 0);
+    if (!threads || threads > MAX_THREADS) {
+	fprintf(stderr, "Invalid number of threads\n");
+	exit(EXIT_FAILURE);
+    }
+
+    check_file(argv[1], USF_VERSION_CURRENT, USF_COMPRESSION_NONE, 0,
+	       threads, 0);
+    check_file(argv[1], USF_VERSION_CURRENT, USF_COMPRESSION_BZIP2,
+	       USF_FLAG_DELTA | USF_FLAG_VARINT | USF_FLAG_TID_CONTEXT,
+	       threads, 1);
+    check_file(argv[1], USF_VERSION(0, 2), USF_COMPRESSION_NONE,
+	       USF_FLAG_DELTA, threads, 2);
+    check_file(argv[1], USF_VERSION_CURRENT, USF_COMPRESSION_NONE,
+	       USF_FLAG_COLUMNS, 1, 0);
+
+    return 0;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
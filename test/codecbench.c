@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <uart/usf.h>
+/* Not part of the public API, reads and writes without specialized
+ * encoders and decoders */
+void usf_events_generic(usf_file_t *file);
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "testutil.h"
+
+/*
+ * Compares the supported compression algorithms on a trace. The
+ * events of the input file are loaded into memory (optionally
+ * repeated to get a larger trace) and written to a temporary file
+ * using every algorithm without delta compression, with delta
+ * compression and with varint delta compression. Reports
+ * the resulting file size and the write and read throughput.
+ */
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+#define BATCH 4096
+#define PASSES 3
+
+static usf_options_t options;
+/* Extra flags for the delta compressed files */
+static usf_flags_t delta_flags;
+/* Use the generic event readers and writers */
+static int generic;
+
+static usf_atime_t *
+event_time(usf_event_t *event)
+{
+    switch (event->type) {
+    case USF_EVENT_SAMPLE:
+	return &event->u.sample.begin.time;
+    case USF_EVENT_DANGLING:
+	return &event->u.dangling.begin.time;
+    case USF_EVENT_BURST:
+	return &event->u.burst.begin_time;
+    case USF_EVENT_TRACE:
+	return &event->u.trace.access.time;
+    default:
+	return NULL;
+    }
+}
+
+/* Load all events in path, repeated repeat times. Repetitions are
+ * shifted in time so that the trace stays ordered. */
+static usf_event_t *
+load_events(const char *path, unsigned repeat, usf_header_t *header,
+	    size_t *count)
+{
+    const usf_header_t *h;
+    usf_file_t *file;
+    usf_event_t *events = NULL;
+    size_t size = 0;
+    size_t n = 0;
+    usf_atime_t span = 0;
+    usf_error_t error;
+
+    C_E(usf_open(&file, path));
+    C_E(usf_header(&h, file));
+    *header = *h;
+    header->argc = 0;
+    header->argv = NULL;
+
+    for (;;) {
+	if (n == size) {
+	    size = size ? 2 * size : BATCH;
+	    events = realloc(events, size * sizeof(*events));
+	    if (!events)
+		abort();
+	}
+
+	if ((error = usf_read(file, &events[n])) != USF_ERROR_OK)
+	    break;
+	if (event_time(&events[n]))
+	    span = *event_time(&events[n]) + 1;
+	n++;
+    }
+    if (error != USF_ERROR_EOF)
+	C_E(error);
+    C_E(usf_close(file));
+
+    events = realloc(events, n * repeat * sizeof(*events));
+    if (!events && n)
+	abort();
+    for (unsigned r = 1; r < repeat; r++) {
+	for (size_t i = 0; i < n; i++) {
+	    usf_event_t *e = &events[r * n + i];
+
+	    *e = events[i];
+	    if (event_time(e))
+		*event_time(e) += r * span;
+	}
+    }
+
+    *count = n * repeat;
+    return events;
+}
+
+static double
+time_write(const char *path, const usf_header_t *header,
+	   const usf_event_t *events, size_t count)
+{
+    usf_file_t *file;
+    double start = now();
+
+    C_E(usf_create_opts(&file, path, header, &options));
+    if (generic)
+	usf_events_generic(file);
+    for (size_t i = 0; i < count; i += BATCH)
+	C_E(usf_append_batch(file, events + i, MIN(BATCH, count - i)));
+    C_E(usf_close(file));
+
+    return now() - start;
+}
+
+static double
+time_read(const char *path, size_t count)
+{
+    usf_file_t *file;
+    usf_event_t *events;
+    usf_error_t error;
+    size_t total = 0;
+    size_t n;
+    double start;
+
+    events = malloc(BATCH * sizeof(*events));
+    if (!events)
+	abort();
+
+    start = now();
+    C_E(usf_open_opts(&file, path, &options));
+    if (generic)
+	usf_events_generic(file);
+    while ((error = usf_read_batch(file, events, BATCH, &n)) ==
+	   USF_ERROR_OK)
+	total += n;
+    if (error != USF_ERROR_EOF)
+	C_E(error);
+    C_E(usf_close(file));
+    start = now() - start;
+
+    free(events);
+    if (total != count) {
+	fprintf(stderr, "Event count mismatch: %zu != %zu\n", total, count);
+	exit(EXIT_FAILURE);
+    }
+
+    return start;
+}
+
+static void
+bench(const char *path, usf_header_t *header,
+      const usf_event_t *events, size_t count, off_t *raw_size)
+{
+    struct stat st;
+    double tw, tr;
+
+    tw = time_write(path, header, events, count);
+    for (int i = 1; i < PASSES; i++)
+	tw = MIN(tw, time_write(path, header, events, count));
+    tr = time_read(path, count);
+    for (int i = 1; i < PASSES; i++)
+	tr = MIN(tr, time_read(path, count));
+
+    if (stat(path, &st) == -1) {
+	perror("stat");
+	exit(EXIT_FAILURE);
+    }
+    /* Ratios are relative to the first (uncompressed) file */
+    if (!*raw_size)
+	*raw_size = st.st_size;
+
+    printf("%-6s %-5s %12jd %7.2f %10.2f %10.2f\n",
+	   usf_namecompr(header->compression),
+	   header->flags & USF_FLAG_COLUMNS ? "col" :
+	   header->flags & USF_FLAG_VARINT ? "var" :
+	   header->flags & USF_FLAG_DELTA ? "yes" : "no",
+	   (intmax_t)st.st_size, (double)*raw_size / st.st_size,
+	   count / tw * 1E-6, count / tr * 1E-6);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *tmp = "codecbench.tmp";
+    usf_header_t header;
+    usf_event_t *events;
+    unsigned repeat = 1;
+    size_t count;
+    off_t raw_size = 0;
+    int argi = 1;
+
+    for (; argi < argc && argv[argi][0] == '-'; argi++) {
+	if (!strcmp(argv[argi], "-j") && argi + 1 < argc)
+	    options.threads = strtoul(argv[++argi], NULL, 0);
+	else if (!strcmp(argv[argi], "-a") && argi + 1 < argc)
+	    options.async = strtoul(argv[++argi], NULL, 0);
+	else if (!strcmp(argv[argi], "-L") && argi + 1 < argc)
+	    options.level = strtol(argv[++argi], NULL, 0);
+	else if (!strcmp(argv[argi], "-t"))
+	    delta_flags |= USF_FLAG_TID_CONTEXT;
+	else if (!strcmp(argv[argi], "-s"))
+	    delta_flags |= USF_FLAG_STRIDE;
+	else if (!strcmp(argv[argi], "-p"))
+	    delta_flags |= USF_FLAG_PC_DICT;
+	else if (!strcmp(argv[argi], "-g"))
+	    generic = 1;
+	else if (!strcmp(argv[argi], "-r") && argi + 1 < argc)
+	    repeat = strtoul(argv[++argi], NULL, 0);
+	else
+	    break;
+    }
+
+    if (argi >= argc || argc - argi > 2 || !repeat) {
+	fprintf(stderr,
+		"%s [-j THREADS] [-a BUFFERS] [-L LEVEL] [-r REPEAT] [-t] [-s] [-p] "
+		"[-g] FILE "
+		"[TMPFILE]\n",
+		argv[0]);
+	exit(EXIT_FAILURE);
+    }
+    if (argi + 1 < argc)
+	tmp = argv[argi + 1];
+
+    events = load_events(argv[argi], repeat, &header, &count);
+    printf("%zu events\n", count);
+    printf("%-6s %-5s %12s %7s %10s %10s\n",
+	   "codec", "delta", "bytes", "ratio", "write Me/s", "read Me/s");
+
+    header.version = USF_VERSION_CURRENT;
+    for (usf_compression_t c = 0; usf_namecompr(c); c++) {
+	if (!usf_hascompr(c))
+	    continue;
+
+	header.compression = c;
+	for (int delta = 0; delta < 4; delta++) {
+	    header.flags &= ~(USF_FLAG_DELTA | USF_FLAG_VARINT |
+			      USF_FLAG_TID_CONTEXT | USF_FLAG_STRIDE |
+			      USF_FLAG_PC_DICT | USF_FLAG_COLUMNS);
+	    if (delta == 1 || delta == 2)
+		header.flags |= USF_FLAG_DELTA | delta_flags;
+	    if (delta == 2)
+		header.flags |= USF_FLAG_VARINT;
+	    /* Only traces can be stored in columns */
+	    if (delta == 3) {
+		if (!(header.flags & USF_FLAG_TRACE))
+		    continue;
+		header.flags |= USF_FLAG_COLUMNS;
+	    }
+	    bench(tmp, &header, events, count, &raw_size);
+	}
+    }
+
+    remove(tmp);
+    free(events);
+    return 0;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
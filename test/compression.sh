@@ -2,11 +2,21 @@
 
 USFDUMP="../tools/usfdump"
 USF2USF="../tools/usf2usf"
+READBENCH="./readbench"
+SEEKTEST="./seektest"
+CODECBENCH="./codecbench"
+SIMDBENCH="./simdbench"
+APPENDTEST="./appendtest"
+STATSTEST="./statstest"
+MEMTEST="./memtest"
+IOTEST="./iotest"
+USFSTATS="../tools/usfstats"
 
 USFFILE="./data/gcc.usf"
 REFFILE="./data/gcc_ref.txt"
 TMPFILE1="/tmp/usf_test.usf"
 TMPFILE2="/tmp/usf_test.txt"
+TMPFILE3="/tmp/usf_test_multi.usf"
 
 RETVAL=0
 
@@ -18,15 +28,261 @@ function run_test {
 
     diff $REFFILE $TMPFILE2
     if [ "$?" != "0" ]; then
-        echo "FAILED: $compression $delta_comp"
+        echo "FAILED: $opts"
 	RETVAL=1
     fi
 
+    for batch in 1 7 4096; do
+        $READBENCH -c $TMPFILE1 $batch
+        if [ "$?" != "0" ]; then
+            echo "FAILED: usf_read_batch $opts (batch size $batch)"
+            RETVAL=1
+        fi
+    done
+
+    $READBENCH -c -j 2 $TMPFILE1
+    if [ "$?" != "0" ]; then
+        echo "FAILED: threaded read $opts"
+        RETVAL=1
+    fi
+
+    $READBENCH -c -P 2 $TMPFILE1
+    if [ "$?" != "0" ]; then
+        echo "FAILED: prefetched read $opts"
+        RETVAL=1
+    fi
+}
+
+# Read the last converted file with I/O options
+function read_test {
+    opts=$1; shift
+
+    $READBENCH -c $opts $TMPFILE1
+    if [ "$?" != "0" ]; then
+        echo "FAILED: read $opts"
+        RETVAL=1
+    fi
+}
+
+# Convert the test file and read it back through a pipe, decoding
+# ahead of the reader.
+function pipe_test {
+    opts=$1; shift
+
+    $USF2USF $opts $USFFILE $TMPFILE3
+    cat $TMPFILE3 | $USF2USF -c none -P 2 -j 2 - $TMPFILE1
+    $USFDUMP $TMPFILE1 | grep -iE "^\[(trace|burst|sample|dangling)\]" > $TMPFILE2
+
+    diff $REFFILE $TMPFILE2
+    if [ "$?" != "0" ]; then
+        echo "FAILED: pipe $opts"
+        RETVAL=1
+    fi
+}
+
+# Split the events of the uncompressed test file into two bzip2
+# streams, like a parallel compressor would, and read it back.
+function multistream_test {
+    name=$1; shift
+    compress=$1; shift
+
+    events=$($USFDUMP $USFFILE | grep -ciE "^\[(trace|burst|sample|dangling)\]")
+    hdr=$(( $(wc -c < $USFFILE) - events * 29 ))
+
+    head -c $hdr $USFFILE > $TMPFILE3
+    tail -c +$((hdr + 1)) $USFFILE | head -c 10000 | $compress >> $TMPFILE3
+    tail -c +$((hdr + 10001)) $USFFILE | $compress >> $TMPFILE3
+
+    for threads in 0 2; do
+        $USF2USF -o $name -j $threads $TMPFILE3 $TMPFILE1
+        $USFDUMP $TMPFILE1 | grep -iE "^\[(trace|burst|sample|dangling)\]" > $TMPFILE2
+
+        diff $REFFILE $TMPFILE2
+        if [ "$?" != "0" ]; then
+            echo "FAILED: multi-stream $name ($threads threads)"
+            RETVAL=1
+        fi
+    done
 }
 
 run_test "-c none"
 run_test "-c none -d"
 run_test "-c bzip2"
 run_test "-c bzip2 -d"
+run_test "-c bzip2 -b 4096 -j 3"
+run_test "-c bzip2 -d -b 4096 -j 3"
+run_test "-c none -z"
+run_test "-c bzip2 -z"
+run_test "-c bzip2 -z -b 4096 -j 3"
+run_test "-c none -t"
+run_test "-c none -z -t"
+run_test "-c bzip2 -z -t -b 4096 -j 3"
+run_test "-c none -s"
+run_test "-c none -z -t -s"
+run_test "-c bzip2 -z -s -b 4096 -j 3"
+run_test "-c none -p"
+run_test "-c none -z -p"
+run_test "-c none -z -t -s -p"
+run_test "-c bzip2 -d -p -b 4096 -j 3"
+run_test "-c none -C"
+run_test "-c none -C -b 4096"
+run_test "-c bzip2 -C -b 4096 -j 3"
+run_test "-c none -a 1"
+run_test "-c none -z -a 2"
+run_test "-c bzip2 -z -t -b 4096 -j 2 -a 1"
+run_test "-c none -B 4096"
+run_test "-c bzip2 -z -B 4096 -D"
+read_test "-B 4096 -D"
+run_test "-c none -B 4096 -Q 4"
+read_test "-B 4096 -Q 4"
+run_test "-c bzip2 -z -b 4096 -j 2 -B 4096 -Q 3 -D"
+read_test "-B 4096 -Q 3"
+read_test "-B 4096 -Q 3 -D"
+
+# bzip2 levels stop at 9
+$USF2USF -c bzip2 -L 10 $USFFILE $TMPFILE1 2> /dev/null
+if [ "$?" == "0" ]; then
+    echo "FAILED: bzip2 level 10"
+    RETVAL=1
+fi
+
+# Varint deltas need the block container
+$USF2USF -c none -z -l $USFFILE $TMPFILE1 2> /dev/null
+if [ "$?" == "0" ]; then
+    echo "FAILED: varint deltas in a legacy file"
+    RETVAL=1
+fi
+
+run_test "-c none -l"
+run_test "-c none -d -l"
+run_test "-c bzip2 -l"
+run_test "-c bzip2 -d -l"
+run_test "-c bzip2 -d -l -a 2"
+run_test "-c bzip2 -d -l -B 4096"
+run_test "-c bzip2 -d -l -B 5000 -D"
+read_test "-B 5000 -D"
+run_test "-c bzip2 -d -l -B 4096 -Q 4"
+read_test "-B 4096 -Q 4"
+run_test "-c bzip2 -d -l -B 5000 -Q 2 -D"
+read_test "-B 5000 -Q 2"
+read_test "-B 5000 -Q 2 -D"
+
+if $USF2USF -c help | grep -q zstd; then
+    run_test "-c zstd"
+    run_test "-c zstd -d"
+    run_test "-c zstd -d -L 19"
+    run_test "-c zstd -z"
+    run_test "-c zstd -d -b 4096 -j 3"
+    run_test "-c zstd -l"
+    run_test "-c zstd -d -l"
+    run_test "-c zstd -d -l -j 2"
+    run_test "-c zstd -C -b 4096 -j 2"
+    run_test "-c zstd -d -l -B 4096"
+    run_test "-c zstd -d -l -B 4096 -Q 4"
+    read_test "-B 4096 -Q 4"
+fi
+
+if $USF2USF -c help | grep -q lz4; then
+    run_test "-c lz4"
+    run_test "-c lz4 -d"
+    run_test "-c lz4 -d -L -4"
+    run_test "-c lz4 -d -L 9"
+    run_test "-c lz4 -z"
+    run_test "-c lz4 -d -b 4096 -j 3"
+    run_test "-c lz4 -l"
+    run_test "-c lz4 -d -l"
+    run_test "-c lz4 -d -l -j 2"
+    run_test "-c lz4 -d -l -B 4096"
+fi
+
+if $USF2USF -c help | grep -q xz; then
+    run_test "-c xz"
+    run_test "-c xz -d"
+    run_test "-c xz -d -L 9"
+    run_test "-c xz -z"
+    run_test "-c xz -d -b 4096 -j 3"
+    run_test "-c xz -l"
+    run_test "-c xz -d -l"
+    run_test "-c xz -d -l -j 2"
+    run_test "-c xz -d -l -B 4096 -j 2"
+
+    $USF2USF -c xz -L 10 $USFFILE $TMPFILE1 2> /dev/null
+    if [ "$?" == "0" ]; then
+        echo "FAILED: xz level 10"
+        RETVAL=1
+    fi
+fi
+
+pipe_test "-c none"
+pipe_test "-c bzip2 -d -l"
+pipe_test "-c bzip2 -z -t -s -b 4096 -j 2"
+pipe_test "-c none -C -b 4096"
+
+if command -v bzip2 > /dev/null; then
+    multistream_test bzip2 bzip2
+fi
+
+if $USF2USF -c help | grep -q xz && command -v xz > /dev/null; then
+    # Several xz blocks per stream exercise the threaded decoder
+    multistream_test xz "xz --block-size=4096"
+fi
+
+$SEEKTEST $TMPFILE1
+if [ "$?" != "0" ]; then
+    echo "FAILED: usf_seek_time"
+    RETVAL=1
+fi
+
+$APPENDTEST $TMPFILE1 > /dev/null
+if [ "$?" != "0" ]; then
+    echo "FAILED: concurrent appends"
+    RETVAL=1
+fi
+
+$STATSTEST $TMPFILE1
+if [ "$?" != "0" ]; then
+    echo "FAILED: statistics trailer"
+    RETVAL=1
+fi
+
+$MEMTEST $TMPFILE1
+if [ "$?" != "0" ]; then
+    echo "FAILED: descriptor and memory files"
+    RETVAL=1
+fi
+
+$IOTEST $TMPFILE1
+if [ "$?" != "0" ]; then
+    echo "FAILED: io_uring read ahead"
+    RETVAL=1
+fi
+
+# usfstats prints the same with and without the trailer
+for opts in "-c none" "-c bzip2 -z -t -b 4096 -j 2" "-c none -C -a 1"; do
+    $USF2USF -S $opts $USFFILE $TMPFILE1
+    $USFSTATS $USFFILE > $TMPFILE2
+    if ! $USFSTATS $TMPFILE1 | diff -q $TMPFILE2 - > /dev/null; then
+        echo "FAILED: usfstats $opts"
+        RETVAL=1
+    fi
+done
+
+$CODECBENCH -r 4 $USFFILE $TMPFILE1 > /dev/null
+if [ "$?" != "0" ]; then
+    echo "FAILED: codecbench"
+    RETVAL=1
+fi
+
+$CODECBENCH -g -t -s $USFFILE $TMPFILE1 > /dev/null
+if [ "$?" != "0" ]; then
+    echo "FAILED: codecbench (generic)"
+    RETVAL=1
+fi
+
+$SIMDBENCH -t 1000000 > /dev/null
+if [ "$?" != "0" ]; then
+    echo "FAILED: simdbench"
+    RETVAL=1
+fi
 
 exit $RETVAL
@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <uart/usf.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "testutil.h"
+#include "usf_internal.h"
+#include "usf_io.h"
+#include "usf_uring.h"
+
+/*
+ * Checks that the io_uring backend reads ahead. Sequential reads
+ * have to keep the whole ring busy, a seek restarts with a single
+ * read.
+ */
+
+#define BUF_SIZE 4096
+#define DEPTH 4
+#define BUFFERS 64
+
+/* Byte at offset of the test file */
+static unsigned char
+pattern(uint64_t offset)
+{
+    return (offset * 7 + offset / BUF_SIZE) & 0xff;
+}
+
+static void
+create_file(const char *path)
+{
+    static const usf_options_t options;
+    unsigned char buf[BUF_SIZE];
+    usf_io_t *io;
+
+    C_E(usf_io_open(&io, path, USF_MODE_WRITE, &options));
+    for (uint64_t b = 0; b < BUFFERS; b++) {
+	for (size_t i = 0; i < BUF_SIZE; i++)
+	    buf[i] = pattern(b * BUF_SIZE + i);
+	C_E(usf_io_write(io, buf, BUF_SIZE));
+    }
+    C_E(usf_io_close(io));
+}
+
+/* Read count buffers from the current position and return the
+ * largest number of buffers queued at once */
+static unsigned
+read_buffers(usf_io_t *io, unsigned count)
+{
+    unsigned queued = 0;
+
+    for (unsigned b = 0; b < count; b++) {
+	uint64_t offset = usf_io_tell(io);
+	const char *data;
+	size_t len;
+
+	C_E(usf_io_peek(io, &data, &len));
+	if (len != BUF_SIZE) {
+	    fprintf(stderr, "Short buffer at %" PRIu64 ": %zu\n",
+		    offset, len);
+	    exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < len; i++) {
+	    if ((unsigned char)data[i] != pattern(offset + i)) {
+		fprintf(stderr, "Data differs at %" PRIu64 "\n", offset + i);
+		exit(EXIT_FAILURE);
+	    }
+	}
+
+	if (usf_io_queued(io) > queued)
+	    queued = usf_io_queued(io);
+	usf_io_consume(io, len);
+    }
+
+    return queued;
+}
+
+int
+main(int argc, char **argv)
+{
+    const usf_options_t options = {
+	.io_buffer_size = BUF_SIZE,
+	.io_depth = DEPTH
+    };
+    usf_uring_t *ring;
+    usf_io_t *io;
+    usf_error_t result;
+    unsigned queued;
+    char c;
+
+    if (argc != 2) {
+	fprintf(stderr, "%s FILE\n", argv[0]);
+	exit(EXIT_FAILURE);
+    }
+
+    result = usf_uring_create(&ring, DEPTH);
+    if (result == USF_ERROR_UNSUPPORTED) {
+	fprintf(stderr, "io_uring not supported, skipping\n");
+	return 0;
+    }
+    C_E(result);
+    usf_uring_destroy(ring);
+
+    create_file(argv[1]);
+    C_E(usf_io_open(&io, argv[1], USF_MODE_READ, &options));
+
+    queued = read_buffers(io, BUFFERS / 2);
+    if (queued != DEPTH) {
+	fprintf(stderr, "Sequential reads queued %u of %u buffers\n",
+		queued, DEPTH);
+	exit(EXIT_FAILURE);
+    }
+
+    C_E(usf_io_seek(io, 5 * BUF_SIZE));
+    if ((queued = read_buffers(io, 1)) != 1) {
+	fprintf(stderr, "A seek queued %u buffers\n", queued);
+	exit(EXIT_FAILURE);
+    }
+    if ((queued = read_buffers(io, 2)) != DEPTH) {
+	fprintf(stderr, "Reads after a seek queued %u of %u buffers\n",
+		queued, DEPTH);
+	exit(EXIT_FAILURE);
+    }
+
+    /* The ring runs dry at the end of the file */
+    read_buffers(io, BUFFERS - 8);
+    if (usf_io_read(io, &c, 1) != 0 || !usf_io_eof(io)) {
+	fprintf(stderr, "Expected the end of the file\n");
+	exit(EXIT_FAILURE);
+    }
+
+    C_E(usf_io_close(io));
+    return 0;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
@@ -0,0 +1,282 @@
+/* O_DIRECT */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <uart/usf.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "testutil.h"
+
+/* Large enough to span several blocks and fill a pipe */
+#define EVENTS 100000
+#define PREFIX "not a usf file"
+
+typedef struct {
+    usf_version_t version;
+    usf_compression_t compression;
+    usf_flags_t flags;
+} format_t;
+
+static const format_t formats[] = {
+    { USF_VERSION(0, 2), USF_COMPRESSION_NONE, USF_FLAG_DELTA },
+    { USF_VERSION(0, 2), USF_COMPRESSION_BZIP2, USF_FLAG_DELTA },
+    { USF_VERSION_CURRENT, USF_COMPRESSION_NONE, 0 },
+    { USF_VERSION_CURRENT, USF_COMPRESSION_BZIP2,
+      USF_FLAG_DELTA | USF_FLAG_VARINT | USF_FLAG_TID_CONTEXT },
+    { USF_VERSION_CURRENT, USF_COMPRESSION_NONE, USF_FLAG_COLUMNS },
+};
+
+typedef struct {
+    int fd;
+    const format_t *format;
+} writer_t;
+
+static void
+make_header(usf_header_t *header, const format_t *format)
+{
+    memset(header, 0, sizeof(*header));
+    header->version = format->version;
+    header->compression = format->compression;
+    header->flags = USF_FLAG_NATIVE_ENDIAN | USF_FLAG_TRACE | format->flags;
+    header->time_end = 2 * EVENTS;
+}
+
+static void
+append_events(usf_file_t *file)
+{
+    usf_event_t event;
+
+    memset(&event, 0, sizeof(event));
+    event.type = USF_EVENT_TRACE;
+    for (uint64_t i = 0; i < EVENTS; i++) {
+	make_access(&event.u.trace.access, i);
+	C_E(usf_append(file, &event));
+    }
+}
+
+/* Read the events from first on and check that the file ends after
+ * them */
+static void
+check_events(usf_file_t *file, uint64_t first)
+{
+    usf_event_t event;
+    usf_access_t ref;
+
+    for (uint64_t i = first; i < EVENTS; i++) {
+	C_E(usf_read(file, &event));
+	make_access(&ref, i);
+	if (event.type != USF_EVENT_TRACE ||
+	    !access_eq(&event.u.trace.access, &ref)) {
+	    fprintf(stderr, "Event %" PRIu64 " differs\n", i);
+	    exit(EXIT_FAILURE);
+	}
+    }
+
+    if (usf_read(file, &event) != USF_ERROR_EOF) {
+	fprintf(stderr, "Missing end of file\n");
+	exit(EXIT_FAILURE);
+    }
+}
+
+/* Seek around a seekable file and read it */
+static void
+check_file(usf_file_t *file, const format_t *format)
+{
+    const usf_stats_t *stats;
+    uint64_t pos;
+
+    C_E(usf_seek_time(file, EVENTS + 1));
+    C_E(usf_tell(file, &pos));
+    if (pos != EVENTS / 2 + 1) {
+	fprintf(stderr, "Seek to position %" PRIu64 "\n", pos);
+	exit(EXIT_FAILURE);
+    }
+    C_E(usf_seek_time(file, 0));
+    if (format->version != USF_VERSION(0, 2)) {
+	C_E(usf_file_stats(&stats, file));
+	if (stats->total.events[USF_EVENT_TRACE] != EVENTS) {
+	    fprintf(stderr, "Wrong statistics\n");
+	    exit(EXIT_FAILURE);
+	}
+    }
+    check_events(file, 0);
+}
+
+/* Write a file to memory and read it back in place */
+static void
+check_mem(const format_t *format)
+{
+    static const usf_options_t read_options[] = {
+	{ 0 }, { .threads = 2 }, { .prefetch = 2 }
+    };
+    const usf_options_t options = { .stats = 1, .block_size = 65536 };
+    usf_header_t header;
+    usf_event_t event;
+    usf_file_t *file;
+    void *data;
+    size_t size;
+
+    make_header(&header, format);
+    C_E(usf_create_mem(&file, &data, &size, &header, &options));
+    append_events(file);
+    C_E(usf_close(file));
+
+    for (int i = 0; i < 3; i++) {
+	C_E(usf_open_mem(&file, data, size, &read_options[i]));
+	if (read_options[i].prefetch)
+	    check_events(file, 0);
+	else
+	    check_file(file, format);
+	C_E(usf_close(file));
+    }
+
+    /* Truncated files are format errors */
+    C_E(usf_open_mem(&file, data, size / 2, NULL));
+    while (usf_read(file, &event) == USF_ERROR_OK)
+	;
+    C_E(usf_close(file));
+
+    free(data);
+}
+
+static void *
+pipe_writer(void *arg)
+{
+    writer_t *w = arg;
+    usf_header_t header;
+    usf_file_t *file;
+
+    make_header(&header, w->format);
+    C_E(usf_create_fd(&file, w->fd, &header, NULL));
+    append_events(file);
+    C_E(usf_close(file));
+    close(w->fd);
+
+    return NULL;
+}
+
+/* Stream a file through a pipe */
+static void
+check_pipe(const format_t *format)
+{
+    usf_file_t *file;
+    pthread_t thread;
+    writer_t w;
+    int fds[2];
+
+    if (pipe(fds)) {
+	perror("pipe");
+	exit(EXIT_FAILURE);
+    }
+
+    w.fd = fds[1];
+    w.format = format;
+    pthread_create(&thread, NULL, pipe_writer, &w);
+
+    C_E(usf_open_fd(&file, fds[0], NULL));
+    check_events(file, 0);
+    C_E(usf_close(file));
+    close(fds[0]);
+
+    pthread_join(thread, NULL);
+}
+
+/* Embed a file after a prefix in a regular file */
+static void
+check_fd(const char *path, const format_t *format)
+{
+    const usf_options_t options = { .stats = 1, .block_size = 65536 };
+    usf_header_t header;
+    usf_file_t *file;
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1 || write(fd, PREFIX, strlen(PREFIX)) != strlen(PREFIX)) {
+	perror(path);
+	exit(EXIT_FAILURE);
+    }
+
+    make_header(&header, format);
+    C_E(usf_create_fd(&file, fd, &header, &options));
+    append_events(file);
+    C_E(usf_close(file));
+
+    lseek(fd, strlen(PREFIX), SEEK_SET);
+    C_E(usf_open_fd(&file, fd, NULL));
+    check_file(file, format);
+    C_E(usf_close(file));
+    close(fd);
+}
+
+#ifdef O_DIRECT
+/* Write through a descriptor opened with O_DIRECT, which has to keep
+ * its flags although the tail of the file isn't aligned */
+static void
+check_direct_fd(const char *path, const format_t *format)
+{
+    const usf_options_t options = { .stats = 1, .block_size = 65536 };
+    usf_header_t header;
+    usf_file_t *file;
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+    if (fd == -1)
+	return; /* Not supported by the file system */
+
+    make_header(&header, format);
+    C_E(usf_create_fd(&file, fd, &header, &options));
+    append_events(file);
+    C_E(usf_close(file));
+    if (!(fcntl(fd, F_GETFL) & O_DIRECT)) {
+	fprintf(stderr, "O_DIRECT was cleared\n");
+	exit(EXIT_FAILURE);
+    }
+
+    lseek(fd, 0, SEEK_SET);
+    C_E(usf_open_fd(&file, fd, NULL));
+    check_file(file, format);
+    C_E(usf_close(file));
+    close(fd);
+}
+#endif
+
+int
+main(int argc, char **argv)
+{
+    if (argc != 2) {
+	fprintf(stderr, "%s FILE\n", argv[0]);
+	exit(EXIT_FAILURE);
+    }
+
+    for (size_t f = 0; f < sizeof(formats) / sizeof(*formats); f++) {
+	check_mem(&formats[f]);
+	check_pipe(&formats[f]);
+	check_fd(argv[1], &formats[f]);
+#ifdef O_DIRECT
+	check_direct_fd(argv[1], &formats[f]);
+#endif
+    }
+
+    return 0;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
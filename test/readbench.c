@@ -0,0 +1,442 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <uart/usf.h>
+/* Not part of the public API, reads without specialized decoders */
+void usf_events_generic(usf_file_t *file);
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "testutil.h"
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+#define DEFAULT_BATCH 4096
+#define PASSES 5
+
+/* Options used to open all files */
+static usf_options_t options;
+
+static int
+event_eq(const usf_event_t *a, const usf_event_t *b)
+{
+    if (a->type != b->type)
+	return 0;
+
+    switch (a->type) {
+    case USF_EVENT_SAMPLE:
+	return access_eq(&a->u.sample.begin, &b->u.sample.begin) &&
+	    access_eq(&a->u.sample.end, &b->u.sample.end) &&
+	    a->u.sample.line_size == b->u.sample.line_size;
+    case USF_EVENT_DANGLING:
+	return access_eq(&a->u.dangling.begin, &b->u.dangling.begin) &&
+	    a->u.dangling.line_size == b->u.dangling.line_size;
+    case USF_EVENT_BURST:
+	return a->u.burst.begin_time == b->u.burst.begin_time;
+    case USF_EVENT_TRACE:
+	return access_eq(&a->u.trace.access, &b->u.trace.access);
+    default:
+	return 0;
+    }
+}
+
+/* Read all events using usf_read() */
+static usf_event_t *
+read_single(const char *path, size_t *count)
+{
+    usf_file_t *file;
+    usf_event_t *events = NULL;
+    size_t size = 0;
+    usf_error_t error;
+
+    C_E(usf_open_opts(&file, path, &options));
+    *count = 0;
+    for (;;) {
+	if (*count == size) {
+	    size = size ? 2 * size : DEFAULT_BATCH;
+	    events = realloc(events, size * sizeof(*events));
+	    if (!events)
+		abort();
+	}
+
+	if ((error = usf_read(file, &events[*count])) != USF_ERROR_OK)
+	    break;
+	++*count;
+    }
+
+    if (error != USF_ERROR_EOF)
+	C_E(error);
+
+    C_E(usf_close(file));
+    return events;
+}
+
+/* Read all events using usf_read_batch() and compare them against a
+ * reference. */
+static void
+check_batch(const char *path, size_t batch,
+	    const usf_event_t *ref, size_t ref_count)
+{
+    usf_file_t *file;
+    usf_event_t *events;
+    usf_error_t error;
+    size_t count = 0;
+    size_t n;
+
+    events = malloc(batch * sizeof(*events));
+    if (!events)
+	abort();
+
+    C_E(usf_open_opts(&file, path, &options));
+    while ((error = usf_read_batch(file, events, batch, &n)) ==
+	   USF_ERROR_OK) {
+	for (size_t i = 0; i < n; i++, count++) {
+	    if (count >= ref_count || !event_eq(&events[i], &ref[count])) {
+		fprintf(stderr, "Event %zu differs (batch size %zu)\n",
+			count, batch);
+		exit(EXIT_FAILURE);
+	    }
+	}
+    }
+
+    if (error != USF_ERROR_EOF)
+	C_E(error);
+
+    if (n != 0 || count != ref_count) {
+	fprintf(stderr, "Event count mismatch: %zu != %zu\n",
+		count, ref_count);
+	exit(EXIT_FAILURE);
+    }
+
+    C_E(usf_close(file));
+    free(events);
+}
+
+/* Read all records using usf_read_raw_trace() and compare them
+ * against a reference. Only applicable to plain trace files read
+ * without prefetching. */
+static void
+check_raw(const char *path, size_t batch,
+	  const usf_event_t *ref, size_t ref_count)
+{
+    usf_file_t *file;
+    const usf_header_t *header;
+    const char *records;
+    usf_error_t error;
+    size_t count = 0;
+    size_t n;
+
+    C_E(usf_open_opts(&file, path, &options));
+    C_E(usf_header(&header, file));
+    if ((header->flags & (USF_FLAG_TRACE | USF_FLAG_DELTA)) !=
+	USF_FLAG_TRACE || options.prefetch) {
+	C_E(usf_close(file));
+	return;
+    }
+
+    while ((error = usf_read_raw_trace(file, (const void **)&records,
+				       batch, &n)) == USF_ERROR_OK) {
+	for (size_t i = 0; i < n; i++, count++) {
+	    const char *r = records + i * USF_RAW_ACCESS_SIZE;
+	    usf_event_t e;
+
+	    memset(&e, 0, sizeof(e));
+	    e.type = USF_EVENT_TRACE;
+	    memcpy(&e.u.trace.access.pc, r, 8);
+	    memcpy(&e.u.trace.access.addr, r + 8, 8);
+	    memcpy(&e.u.trace.access.time, r + 16, 8);
+	    memcpy(&e.u.trace.access.tid, r + 24, 2);
+	    memcpy(&e.u.trace.access.len, r + 26, 2);
+	    memcpy(&e.u.trace.access.type, r + 28, 1);
+
+	    if (count >= ref_count || !event_eq(&e, &ref[count])) {
+		fprintf(stderr, "Raw record %zu differs\n", count);
+		exit(EXIT_FAILURE);
+	    }
+	}
+    }
+
+    if (error != USF_ERROR_EOF)
+	C_E(error);
+
+    if (count != ref_count) {
+	fprintf(stderr, "Raw record count mismatch: %zu != %zu\n",
+		count, ref_count);
+	exit(EXIT_FAILURE);
+    }
+
+    C_E(usf_close(file));
+}
+
+/* Read all accesses using usf_read_columns() and compare them against
+ * a reference. Reads only the address and time if partial is set,
+ * and mixes in calls to usf_read(). */
+static void
+check_columns(const char *path, size_t batch, int partial,
+	      const usf_event_t *ref, size_t ref_count)
+{
+    usf_file_t *file;
+    const usf_header_t *header;
+    usf_columns_t columns;
+    usf_access_t *a;
+    usf_event_t e;
+    usf_error_t error;
+    size_t count = 0;
+    size_t n;
+    int calls = 0;
+
+    C_E(usf_open_opts(&file, path, &options));
+    C_E(usf_header(&header, file));
+    if (!(header->flags & USF_FLAG_TRACE)) {
+	C_E(usf_close(file));
+	return;
+    }
+
+    a = calloc(batch, sizeof(*a));
+    memset(&columns, 0, sizeof(columns));
+    columns.addr = calloc(batch, sizeof(*columns.addr));
+    columns.time = calloc(batch, sizeof(*columns.time));
+    if (!partial) {
+	columns.pc = calloc(batch, sizeof(*columns.pc));
+	columns.tid = calloc(batch, sizeof(*columns.tid));
+	columns.len = calloc(batch, sizeof(*columns.len));
+	columns.type = calloc(batch, sizeof(*columns.type));
+    }
+    if (!a || !columns.addr || !columns.time ||
+	(!partial && (!columns.pc || !columns.tid || !columns.len ||
+		      !columns.type)))
+	abort();
+
+    for (;;) {
+	if (partial && ++calls % 3 == 0) {
+	    if ((error = usf_read(file, &e)) != USF_ERROR_OK)
+		break;
+	    a[0] = e.u.trace.access;
+	    n = 1;
+	} else {
+	    if ((error = usf_read_columns(file, &columns, batch, &n)) !=
+		USF_ERROR_OK)
+		break;
+	    for (size_t i = 0; i < n; i++) {
+		a[i] = ref[count + i < ref_count ? count + i : 0].u.trace.access;
+		a[i].addr = columns.addr[i];
+		a[i].time = columns.time[i];
+		if (!partial) {
+		    a[i].pc = columns.pc[i];
+		    a[i].tid = columns.tid[i];
+		    a[i].len = columns.len[i];
+		    a[i].type = columns.type[i];
+		}
+	    }
+	}
+
+	for (size_t i = 0; i < n; i++, count++) {
+	    if (count >= ref_count ||
+		!access_eq(&a[i], &ref[count].u.trace.access)) {
+		fprintf(stderr, "Column access %zu differs\n", count);
+		exit(EXIT_FAILURE);
+	    }
+	}
+    }
+
+    if (error != USF_ERROR_EOF)
+	C_E(error);
+
+    if (count != ref_count) {
+	fprintf(stderr, "Column access count mismatch: %zu != %zu\n",
+		count, ref_count);
+	exit(EXIT_FAILURE);
+    }
+
+    C_E(usf_close(file));
+    free(a);
+    free(columns.pc);
+    free(columns.addr);
+    free(columns.time);
+    free(columns.tid);
+    free(columns.len);
+    free(columns.type);
+}
+
+static double
+time_single(const char *path, size_t *count)
+{
+    usf_file_t *file;
+    usf_event_t event;
+    usf_error_t error;
+    double start = now();
+
+    *count = 0;
+    C_E(usf_open_opts(&file, path, &options));
+    while ((error = usf_read(file, &event)) == USF_ERROR_OK)
+	++*count;
+    if (error != USF_ERROR_EOF)
+	C_E(error);
+    C_E(usf_close(file));
+
+    return now() - start;
+}
+
+static double
+time_batch(const char *path, size_t batch, int generic, size_t *count)
+{
+    usf_file_t *file;
+    usf_event_t *events;
+    usf_error_t error;
+    size_t n;
+    double start;
+
+    events = malloc(batch * sizeof(*events));
+    if (!events)
+	abort();
+
+    start = now();
+    *count = 0;
+    C_E(usf_open_opts(&file, path, &options));
+    if (generic)
+	usf_events_generic(file);
+    while ((error = usf_read_batch(file, events, batch, &n)) ==
+	   USF_ERROR_OK)
+	*count += n;
+    if (error != USF_ERROR_EOF)
+	C_E(error);
+    C_E(usf_close(file));
+
+    start = now() - start;
+    free(events);
+    return start;
+}
+
+/* Time reading the address and time of all accesses */
+static double
+time_columns(const char *path, size_t batch, size_t *count)
+{
+    usf_file_t *file;
+    usf_columns_t columns;
+    usf_error_t error;
+    size_t n;
+    double start;
+
+    memset(&columns, 0, sizeof(columns));
+    columns.addr = malloc(batch * sizeof(*columns.addr));
+    columns.time = malloc(batch * sizeof(*columns.time));
+    if (!columns.addr || !columns.time)
+	abort();
+
+    start = now();
+    *count = 0;
+    C_E(usf_open_opts(&file, path, &options));
+    while ((error = usf_read_columns(file, &columns, batch, &n)) ==
+	   USF_ERROR_OK)
+	*count += n;
+    if (error != USF_ERROR_EOF)
+	C_E(error);
+    C_E(usf_close(file));
+
+    start = now() - start;
+    free(columns.addr);
+    free(columns.time);
+    return start;
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *path;
+    size_t batch = DEFAULT_BATCH;
+    int check_only = 0;
+    int is_trace;
+    int argi = 1;
+    usf_event_t *ref;
+    size_t ref_count;
+    size_t count;
+    double t;
+
+    for (; argi < argc && argv[argi][0] == '-'; argi++) {
+	if (!strcmp(argv[argi], "-c"))
+	    check_only = 1;
+	else if (!strcmp(argv[argi], "-j") && argi + 1 < argc)
+	    options.threads = strtoul(argv[++argi], NULL, 0);
+	else if (!strcmp(argv[argi], "-P") && argi + 1 < argc)
+	    options.prefetch = strtoul(argv[++argi], NULL, 0);
+	else if (!strcmp(argv[argi], "-B") && argi + 1 < argc)
+	    options.io_buffer_size = strtoul(argv[++argi], NULL, 0);
+	else if (!strcmp(argv[argi], "-Q") && argi + 1 < argc)
+	    options.io_depth = strtoul(argv[++argi], NULL, 0);
+	else if (!strcmp(argv[argi], "-D"))
+	    options.direct = 1;
+	else
+	    break;
+    }
+
+    if (argi >= argc || argc - argi > 2) {
+	fprintf(stderr, "%s [-c] [-j THREADS] [-P BATCHES] [-B SIZE] "
+		"[-Q DEPTH] [-D] FILE [BATCH]\n", argv[0]);
+	exit(EXIT_FAILURE);
+    }
+
+    path = argv[argi];
+    if (argi + 1 < argc)
+	batch = strtoul(argv[argi + 1], NULL, 0);
+    if (!batch) {
+	fprintf(stderr, "Invalid batch size\n");
+	exit(EXIT_FAILURE);
+    }
+
+    ref = read_single(path, &ref_count);
+    check_batch(path, batch, ref, ref_count);
+    check_raw(path, batch, ref, ref_count);
+    check_columns(path, batch, 0, ref, ref_count);
+    check_columns(path, batch, 1, ref, ref_count);
+    is_trace = ref_count && ref[0].type == USF_EVENT_TRACE;
+    free(ref);
+
+    if (check_only)
+	return 0;
+
+    /* Report the best of a couple of passes to hide cold cache
+     * effects. */
+    t = time_single(path, &count);
+    for (int i = 1; i < PASSES; i++)
+	t = MIN(t, time_single(path, &count));
+    printf("usf_read:       %zu events, %.3f s, %.2f Mevents/s\n",
+	   count, t, count / t * 1E-6);
+
+    t = time_batch(path, batch, 0, &count);
+    for (int i = 1; i < PASSES; i++)
+	t = MIN(t, time_batch(path, batch, 0, &count));
+    printf("usf_read_batch: %zu events, %.3f s, %.2f Mevents/s "
+	   "(batch size %zu)\n",
+	   count, t, count / t * 1E-6, batch);
+
+    /* The same without the decoders specialized for the file format */
+    t = time_batch(path, batch, 1, &count);
+    for (int i = 1; i < PASSES; i++)
+	t = MIN(t, time_batch(path, batch, 1, &count));
+    printf("usf_read_batch (generic): %zu events, %.3f s, %.2f Mevents/s\n",
+	   count, t, count / t * 1E-6);
+
+    if (is_trace) {
+	t = time_columns(path, batch, &count);
+	for (int i = 1; i < PASSES; i++)
+	    t = MIN(t, time_columns(path, batch, &count));
+	printf("usf_read_columns (addr, time): %zu events, %.3f s, "
+	       "%.2f Mevents/s\n", count, t, count / t * 1E-6);
+    }
+
+    return 0;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
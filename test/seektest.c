@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <uart/usf.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "testutil.h"
+
+/* Large enough to span several blocks */
+#define EVENTS 200000
+
+static void
+create_file(const char *path, usf_version_t version,
+	    usf_compression_t compression, usf_flags_t flags)
+{
+    usf_file_t *file;
+    usf_event_t event;
+    usf_header_t header = {
+	version,
+	compression,
+	USF_FLAG_NATIVE_ENDIAN | USF_FLAG_TRACE | flags,
+	0,
+	2 * EVENTS,
+	0,
+	0,
+	NULL
+    };
+
+    memset(&event, 0, sizeof(event));
+    event.type = USF_EVENT_TRACE;
+
+    C_E(usf_create(&file, path, &header));
+    for (uint64_t i = 0; i < EVENTS; i++) {
+	make_access(&event.u.trace.access, i);
+	C_E(usf_append(file, &event));
+    }
+    C_E(usf_close(file));
+}
+
+/* Seek to time and check that the next event is expected */
+static void
+check_seek(usf_file_t *file, usf_atime_t time, uint64_t expected)
+{
+    usf_event_t event;
+    usf_access_t ref;
+    usf_error_t result;
+    uint64_t pos;
+
+    result = usf_seek_time(file, time);
+    if (expected >= EVENTS) {
+	if (result != USF_ERROR_EOF ||
+	    usf_read(file, &event) != USF_ERROR_EOF) {
+	    fprintf(stderr, "Seek to %" PRIu64 " didn't hit EOF\n", time);
+	    exit(EXIT_FAILURE);
+	}
+	return;
+    }
+
+    C_E(result);
+    C_E(usf_tell(file, &pos));
+    if (pos != expected) {
+	fprintf(stderr, "Seek to %" PRIu64 ": position %" PRIu64
+		", expected %" PRIu64 "\n", time, pos, expected);
+	exit(EXIT_FAILURE);
+    }
+
+    /* Read a couple of events to make sure the decoder state is
+     * correct after the seek. */
+    for (uint64_t i = expected; i < expected + 3 && i < EVENTS; i++) {
+	C_E(usf_read(file, &event));
+	make_access(&ref, i);
+	if (event.type != USF_EVENT_TRACE ||
+	    !access_eq(&event.u.trace.access, &ref)) {
+	    fprintf(stderr, "Seek to %" PRIu64 ": event %" PRIu64
+		    " differs\n", time, i);
+	    exit(EXIT_FAILURE);
+	}
+    }
+
+    C_E(usf_tell(file, &pos));
+    if (pos != (expected + 3 < EVENTS ? expected + 3 : EVENTS)) {
+	fprintf(stderr, "Position %" PRIu64 " after reading\n", pos);
+	exit(EXIT_FAILURE);
+    }
+}
+
+static void
+check_file(const char *path, unsigned threads, unsigned prefetch,
+	   unsigned io_depth)
+{
+    usf_options_t options = {
+	.threads = threads,
+	.prefetch = prefetch,
+	/* Small buffers to keep several reads in flight */
+	.io_buffer_size = io_depth ? 16384 : 0,
+	.io_depth = io_depth
+    };
+    usf_file_t *file;
+
+    C_E(usf_open_opts(&file, path, &options));
+    check_seek(file, 1001, 501);
+    check_seek(file, 1000, 500);
+    /* Backwards */
+    check_seek(file, 0, 0);
+    check_seek(file, 2 * EVENTS - 2, EVENTS - 1);
+    check_seek(file, 2 * EVENTS - 1, EVENTS);
+    check_seek(file, 150001, 75001);
+    check_seek(file, 300000, 150000);
+    check_seek(file, 7, 4);
+    C_E(usf_close(file));
+}
+
+int
+main(int argc, char **argv)
+{
+    static const usf_version_t versions[] = {
+	USF_VERSION(0, 2), USF_VERSION_CURRENT
+    };
+    static const usf_compression_t compressions[] = {
+	USF_COMPRESSION_NONE, USF_COMPRESSION_BZIP2
+    };
+    static const usf_flags_t deltas[] = {
+	0, USF_FLAG_DELTA, USF_FLAG_DELTA | USF_FLAG_VARINT,
+	USF_FLAG_DELTA | USF_FLAG_TID_CONTEXT,
+	USF_FLAG_DELTA | USF_FLAG_VARINT | USF_FLAG_TID_CONTEXT,
+	USF_FLAG_DELTA | USF_FLAG_STRIDE,
+	USF_FLAG_DELTA | USF_FLAG_VARINT | USF_FLAG_TID_CONTEXT |
+	USF_FLAG_STRIDE,
+	USF_FLAG_DELTA | USF_FLAG_PC_DICT,
+	USF_FLAG_DELTA | USF_FLAG_VARINT | USF_FLAG_TID_CONTEXT |
+	USF_FLAG_STRIDE | USF_FLAG_PC_DICT,
+	USF_FLAG_COLUMNS
+    };
+
+    if (argc != 2) {
+	fprintf(stderr, "%s FILE\n", argv[0]);
+	exit(EXIT_FAILURE);
+    }
+
+    for (int v = 0; v < 2; v++) {
+	for (int c = 0; c < 2; c++) {
+	    for (int d = 0; d < 10; d++) {
+		/* Only plain deltas work without the block container */
+		if ((deltas[d] & ~USF_FLAG_DELTA) &&
+		    versions[v] == USF_VERSION(0, 2))
+		    continue;
+
+		create_file(argv[1], versions[v], compressions[c],
+			    deltas[d]);
+		check_file(argv[1], 0, 0, 0);
+		check_file(argv[1], 2, 0, 0);
+		check_file(argv[1], 0, 2, 0);
+		check_file(argv[1], 0, 0, 4);
+	    }
+	}
+    }
+
+    return 0;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
@@ -0,0 +1,135 @@
+/*
+ * Micro-benchmark for the column decoding kernels. Runs the prefix
+ * sum and skip kernels of every SIMD level the CPU supports over
+ * random deltas of every width, checks the results against the
+ * scalar kernels and reports decoded values per second on one core.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "usf_simd.h"
+
+/* Keeps the benchmark loops from being optimized away */
+static volatile uint64_t sink;
+
+static double
+now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1E-9;
+}
+
+static uint64_t
+rnd(uint64_t *state)
+{
+    /* xorshift64 */
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+int
+main(int argc, char **argv)
+{
+    static const unsigned widths[] = { 1, 2, 4, 8 };
+    size_t count = 4096;
+    size_t total = 200000000;
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    uint64_t *ref, *values;
+    char *src;
+    int argi = 1, ret = EXIT_SUCCESS;
+
+    for (; argi < argc && argv[argi][0] == '-'; argi++) {
+	if (!strcmp(argv[argi], "-n") && argi + 1 < argc)
+	    count = strtoul(argv[++argi], NULL, 0);
+	else if (!strcmp(argv[argi], "-t") && argi + 1 < argc)
+	    total = strtoul(argv[++argi], NULL, 0);
+	else
+	    break;
+    }
+
+    if (argi != argc || !count) {
+	fprintf(stderr, "%s [-n BLOCK VALUES] [-t TOTAL VALUES]\n", argv[0]);
+	exit(EXIT_FAILURE);
+    }
+
+    src = malloc(count * sizeof(uint64_t));
+    ref = malloc(count * sizeof(uint64_t));
+    values = malloc(count * sizeof(uint64_t));
+    if (!src || !ref || !values) {
+	fprintf(stderr, "Out of memory\n");
+	exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < count * sizeof(uint64_t); i++)
+	src[i] = (char)rnd(&state);
+
+    printf("%-7s %5s %14s %14s\n", "kernel", "width",
+	   "decode Me/s", "skip Me/s");
+
+    for (int w = 0; w < 4; w++) {
+	const usf_simd_kernels_t *scalar = usf_simd_kernels(USF_SIMD_SCALAR);
+	scalar->prefix_sum[w](ref, src, count, 42);
+
+	for (int level = 0; level < USF_SIMD_COUNT; level++) {
+	    const usf_simd_kernels_t *k = usf_simd_kernels(level);
+	    const size_t rounds = total / count ? total / count : 1;
+	    double t_decode, t_skip;
+	    uint64_t acc = 0;
+
+	    if (!k)
+		continue;
+
+	    /* Check all lengths up to a few vectors for the tail
+	     * handling, then the whole buffer */
+	    for (size_t n = 0; n <= count; n = n < 17 ? n + 1 : count) {
+		memset(values, 0, n * sizeof(uint64_t));
+		if (k->prefix_sum[w](values, src, n, 42) !=
+		    (n ? ref[n - 1] : 42) ||
+		    memcmp(values, ref, n * sizeof(uint64_t)) ||
+		    k->sum[w](src, n, 42) != (n ? ref[n - 1] : 42)) {
+		    fprintf(stderr, "%s: width %u: mismatch at %zu values\n",
+			    k->name, widths[w], n);
+		    ret = EXIT_FAILURE;
+		}
+		if (n == count)
+		    break;
+	    }
+
+	    t_decode = now();
+	    for (size_t r = 0; r < rounds; r++)
+		acc = k->prefix_sum[w](values, src, count, acc);
+	    t_decode = now() - t_decode;
+
+	    t_skip = now();
+	    for (size_t r = 0; r < rounds; r++)
+		acc = k->sum[w](src, count, acc);
+	    t_skip = now() - t_skip;
+	    sink = acc;
+
+	    printf("%-7s %5u %14.1f %14.1f\n", k->name, widths[w],
+		   rounds * count / t_decode * 1E-6,
+		   rounds * count / t_skip * 1E-6);
+	}
+    }
+
+    free(src);
+    free(ref);
+    free(values);
+    return ret;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
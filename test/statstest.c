@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <uart/usf.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "testutil.h"
+
+/* Large enough to span several blocks */
+#define EVENTS 200000
+#define TIDS 5
+#define BURSTS 20
+
+/* Like make_access(), but starting at time 100 and spread over TIDS
+ * threads */
+static void
+make_stats_access(usf_access_t *a, uint64_t i)
+{
+    make_access(a, i);
+    a->time += 100;
+    a->tid = (i * 7) % TIDS;
+}
+
+/* Event i of a sample file, every 10000th event is a burst */
+static void
+make_event(usf_event_t *event, uint64_t i, int trace)
+{
+    memset(event, 0, sizeof(*event));
+    if (trace) {
+	event->type = USF_EVENT_TRACE;
+	make_stats_access(&event->u.trace.access, i);
+    } else if (i % (EVENTS / BURSTS) == 1) {
+	event->type = USF_EVENT_BURST;
+	event->u.burst.begin_time = 2 * i;
+    } else if (i % 3) {
+	event->type = USF_EVENT_SAMPLE;
+	make_stats_access(&event->u.sample.begin, i);
+	make_stats_access(&event->u.sample.end, i + 1000);
+	event->u.sample.line_size = 6;
+    } else {
+	event->type = USF_EVENT_DANGLING;
+	make_stats_access(&event->u.dangling.begin, i);
+	event->u.dangling.line_size = i % 2 ? 6 : 7;
+    }
+}
+
+static void
+create_file(const char *path, usf_version_t version,
+	    usf_compression_t compression, usf_flags_t flags,
+	    const usf_options_t *options)
+{
+    usf_file_t *file;
+    usf_event_t event;
+    usf_header_t header = {
+	version,
+	compression,
+	USF_FLAG_NATIVE_ENDIAN | flags,
+	0,
+	2 * EVENTS,
+	(1 << 6) | (1 << 7),
+	0,
+	NULL
+    };
+
+    C_E(usf_create_opts(&file, path, &header, options));
+    for (uint64_t i = 0; i < EVENTS; i++) {
+	make_event(&event, i, flags & USF_FLAG_TRACE);
+	C_E(usf_append(file, &event));
+    }
+    C_E(usf_close(file));
+}
+
+static void
+count(usf_stats_count_t *c, size_t i, usf_event_type_t type)
+{
+    c[i].events[type]++;
+}
+
+/* Compare the statistics with the ones of the events in the file */
+static void
+check_stats(const usf_stats_t *stats, int trace)
+{
+    usf_stats_count_t total, tid[TIDS], burst[BURSTS + 1];
+    uint64_t line_sizes[USF_STATS_LINE_SIZES];
+    size_t bursts = 1;
+    usf_event_t event;
+
+    memset(&total, 0, sizeof(total));
+    memset(tid, 0, sizeof(tid));
+    memset(burst, 0, sizeof(burst));
+    memset(line_sizes, 0, sizeof(line_sizes));
+    for (uint64_t i = 0; i < EVENTS; i++) {
+	make_event(&event, i, trace);
+	if (event.type == USF_EVENT_BURST)
+	    bursts++;
+	count(&total, 0, event.type);
+	count(burst, bursts - 1, event.type);
+	switch (event.type) {
+	case USF_EVENT_SAMPLE:
+	    count(tid, event.u.sample.begin.tid, event.type);
+	    line_sizes[event.u.sample.line_size]++;
+	    break;
+	case USF_EVENT_DANGLING:
+	    count(tid, event.u.dangling.begin.tid, event.type);
+	    line_sizes[event.u.dangling.line_size]++;
+	    break;
+	case USF_EVENT_TRACE:
+	    count(tid, event.u.trace.access.tid, event.type);
+	    break;
+	}
+    }
+
+    if (memcmp(&stats->total, &total, sizeof(total)) ||
+	stats->tids != TIDS ||
+	memcmp(stats->tid, tid, sizeof(tid)) ||
+	stats->bursts != bursts ||
+	memcmp(stats->burst, burst, bursts * sizeof(*burst)) ||
+	memcmp(stats->line_sizes, line_sizes, sizeof(line_sizes))) {
+	fprintf(stderr, "Event counts differ\n");
+	exit(EXIT_FAILURE);
+    }
+
+    if (stats->min_time != 100 ||
+	stats->max_time != 2 * (EVENTS - 1 + (trace ? 0 : 1000)) + 100 ||
+	stats->min_addr != 0x10000000 ||
+	stats->max_addr != 0x10000000 + 65536 - 8) {
+	fprintf(stderr, "Ranges differ: %" PRIu64 "-%" PRIu64
+		" 0x%" PRIx64 "-0x%" PRIx64 "\n",
+		stats->min_time, stats->max_time,
+		stats->min_addr, stats->max_addr);
+	exit(EXIT_FAILURE);
+    }
+}
+
+static void
+check_file(const char *path, int trace, unsigned threads, unsigned prefetch)
+{
+    usf_options_t options = { .threads = threads, .prefetch = prefetch };
+    const usf_stats_t *stats;
+    usf_event_t event, ref;
+    usf_file_t *file;
+
+    C_E(usf_open_opts(&file, path, &options));
+    C_E(usf_file_stats(&stats, file));
+    check_stats(stats, trace);
+
+    /* Reading the statistics doesn't move the read position */
+    for (uint64_t i = 0; i < EVENTS; i++) {
+	C_E(usf_read(file, &event));
+	make_event(&ref, i, trace);
+	if (event.type != ref.type) {
+	    fprintf(stderr, "Event %" PRIu64 " differs\n", i);
+	    exit(EXIT_FAILURE);
+	}
+    }
+    C_E(usf_file_stats(&stats, file));
+    C_E(usf_close(file));
+}
+
+static void
+check_none(const char *path)
+{
+    const usf_stats_t *stats;
+    usf_file_t *file;
+
+    C_E(usf_open(&file, path));
+    if (usf_file_stats(&stats, file) != USF_ERROR_UNSUPPORTED) {
+	fprintf(stderr, "Statistics in a file without them\n");
+	exit(EXIT_FAILURE);
+    }
+    C_E(usf_close(file));
+}
+
+int
+main(int argc, char **argv)
+{
+    static const struct {
+	usf_compression_t compression;
+	usf_flags_t flags;
+	usf_options_t options;
+    } formats[] = {
+	{ USF_COMPRESSION_NONE, 0, { .stats = 1 } },
+	{ USF_COMPRESSION_BZIP2, USF_FLAG_DELTA | USF_FLAG_VARINT |
+	  USF_FLAG_TID_CONTEXT, { .stats = 1, .threads = 2 } },
+	{ USF_COMPRESSION_NONE, USF_FLAG_TRACE | USF_FLAG_DELTA,
+	  { .stats = 1, .async = 2 } },
+	{ USF_COMPRESSION_BZIP2, USF_FLAG_TRACE | USF_FLAG_COLUMNS,
+	  { .stats = 1, .block_size = 65536 } },
+    };
+    static const usf_options_t no_stats;
+
+    if (argc != 2) {
+	fprintf(stderr, "%s FILE\n", argv[0]);
+	exit(EXIT_FAILURE);
+    }
+
+    for (size_t f = 0; f < sizeof(formats) / sizeof(*formats); f++) {
+	const int trace = formats[f].flags & USF_FLAG_TRACE;
+
+	create_file(argv[1], USF_VERSION_CURRENT, formats[f].compression,
+		    formats[f].flags, &formats[f].options);
+	check_file(argv[1], trace, 0, 0);
+	check_file(argv[1], trace, 2, 0);
+	check_file(argv[1], trace, 0, 2);
+    }
+
+    /* Only requested statistics are stored, and only in block files */
+    create_file(argv[1], USF_VERSION_CURRENT, USF_COMPRESSION_NONE, 0,
+		&no_stats);
+    check_none(argv[1]);
+    create_file(argv[1], USF_VERSION(0, 2), USF_COMPRESSION_BZIP2,
+		USF_FLAG_DELTA, &formats[0].options);
+    check_none(argv[1]);
+
+    return 0;
+}
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
@@ -0,0 +1,65 @@
+#ifndef TESTUTIL_H
+#define TESTUTIL_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <uart/usf.h>
+
+/* Helpers shared by the tests and benchmarks */
+
+#define C_E(e)						\
+    do {						\
+        usf_error_t result = (e);			\
+        if (result != USF_ERROR_OK) {			\
+            fprintf(stderr,				\
+		    "USF error: %s\n",			\
+		    usf_strerror(result));		\
+	    abort();					\
+	}						\
+    } while(0)
+
+static inline double
+now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1E-9;
+}
+
+/* Access i of a test trace. Event i is accessed at time 2 * i, i.e.
+ * odd times fall between events. */
+static inline void
+make_access(usf_access_t *a, uint64_t i)
+{
+    a->pc = 0x400000 + (i % 97) * 4;
+    a->addr = 0x10000000 + (i * 8) % 65536;
+    a->time = 2 * i;
+    a->tid = i % 3;
+    a->len = 8;
+    a->type = i % 5 ? USF_ATYPE_RD : USF_ATYPE_WR;
+}
+
+static inline int
+access_eq(const usf_access_t *a, const usf_access_t *b)
+{
+    return a->pc == b->pc &&
+	a->addr == b->addr &&
+	a->time == b->time &&
+	a->tid == b->tid &&
+	a->len == b->len &&
+	a->type == b->type;
+}
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c
+ * c-basic-offset: 4
+ * indent-tabs-mode: nil
+ * c-file-style: "k&r"
+ * End:
+ */
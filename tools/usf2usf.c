@@ -39,24 +39,41 @@
 
 #include <uart/usf.h>
 usf_error_t usf_open_hidden(usf_file_t **file,
-                            const char *path, usf_compression_t override);
+                            const char *path, usf_compression_t override,
+                            const usf_options_t *options);
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
+
+#define BATCH_SIZE 1024
      
 typedef struct {
     int delta;
+    int varint;
+    int tid_context;
+    int stride;
+    int pc_dict;
+    int columns;
+    int legacy;
     usf_compression_t compression;
     usf_compression_t override;
+    usf_options_t options;
     char *input;
     char *output;
 } conf_t;
 
 conf_t conf = {
     .delta = 0,
+    .varint = 0,
+    .tid_context = 0,
+    .stride = 0,
+    .pc_dict = 0,
+    .columns = 0,
+    .legacy = 0,
     .compression = -1,
     .override = -1,
+    .options = { 0 },
     .input = NULL,
     .output = NULL
 };
@@ -70,16 +87,47 @@ const char *argp_program_bug_address =
     PACKAGE_BUGREPORT;
 
 static char doc[] =
-    "Decodes a USF file and writes the results to a new USF file.";
+    "Decodes a USF file and writes the results to a new USF file. "
+    "Reads from standard input if INPUT is '-'.";
 
 static char args_doc[] = "INPUT OUTPUT";
 
 static struct argp_option options[] = {
     {"delta", 'd', NULL, 0, "Delta compress output" },
+    {"varint", 'z', NULL, 0,
+     "Delta compress output using variable length deltas" },
+    {"tid-context", 't', NULL, 0,
+     "Delta compress output using one context per thread" },
+    {"stride", 's', NULL, 0,
+     "Delta compress output using per-pc address prediction" },
+    {"pc-dict", 'p', NULL, 0,
+     "Delta compress output using a pc dictionary" },
+    {"columns", 'C', NULL, 0,
+     "Store the output trace in columns (implies no delta compression)" },
+    {"legacy", 'l', NULL, 0,
+     "Write a USF 0.2 file without a block index" },
     {"compression", 'c', "ALGORITHM", 0,
      "Set compression algorithm. Use 'help' for a list of valid algorithms." },
     {"override", 'o', "ALGORITHM", 0,
      "Override input compression (use at your own risk)"},
+    {"threads", 'j', "N", 0,
+     "Compress and decompress using N threads" },
+    {"block-size", 'b', "BYTES", 0,
+     "Set the uncompressed block size" },
+    {"level", 'L', "LEVEL", 0,
+     "Set the compression level" },
+    {"async", 'a', "BUFFERS", 0,
+     "Write from a background thread, queueing up to BUFFERS buffers" },
+    {"prefetch", 'P', "BATCHES", 0,
+     "Decode ahead in a background thread, queueing up to BATCHES batches" },
+    {"io-buffer", 'B', "BYTES", 0,
+     "Set the size of the file I/O buffers" },
+    {"direct", 'D', NULL, 0,
+     "Bypass the page cache (O_DIRECT)" },
+    {"io-depth", 'Q', "N", 0,
+     "Keep N I/O buffers in flight using io_uring" },
+    {"stats", 'S', NULL, 0,
+     "Store a statistics trailer in the output" },
     { 0 }
 };
 
@@ -87,17 +135,17 @@ static usf_compression_t
 parse_compression(const char *arg)
 {
     usf_compression_t compression;
+    const char *name;
 
-    if (!strcmp("none", arg))
-        compression = USF_COMPRESSION_NONE;
-    else if (!strcmp("bzip2", arg))
-        compression = USF_COMPRESSION_BZIP2;
-    else if (!strcmp("help", arg)) {
+    if (!strcmp("help", arg)) {
         printf("Supported compression types:\n");
-        printf("\tnone\tDisable compression\n");
-        printf("\tbzip2\n");
+        for (compression = 0; (name = usf_namecompr(compression));
+             compression++) {
+            if (usf_hascompr(compression))
+                printf("\t%s\t%s\n", name, usf_strcompr(compression));
+        }
         exit(0);
-    } else {
+    } else if (usf_parsecompr(&compression, arg) != USF_ERROR_OK) {
         fprintf(stderr, "Unsupported compression '%s'.\n", arg);
         exit(EXIT_FAILURE);
     }
@@ -117,12 +165,61 @@ parse_opt (int key, char *arg, struct argp_state *state)
     case 'd':
 	conf->delta = 1;
 	break;
+    case 'z':
+	conf->delta = 1;
+	conf->varint = 1;
+	break;
+    case 't':
+	conf->delta = 1;
+	conf->tid_context = 1;
+	break;
+    case 's':
+	conf->delta = 1;
+	conf->stride = 1;
+	break;
+    case 'p':
+	conf->delta = 1;
+	conf->pc_dict = 1;
+	break;
+    case 'C':
+	conf->columns = 1;
+	break;
+    case 'l':
+	conf->legacy = 1;
+	break;
     case 'c':
         conf->compression = parse_compression(arg);
 	break;
     case 'o':
         conf->override = parse_compression(arg);
         break;
+    case 'j':
+        conf->options.threads = strtoul(arg, NULL, 0);
+        break;
+    case 'b':
+        conf->options.block_size = strtoul(arg, NULL, 0);
+        break;
+    case 'L':
+        conf->options.level = strtol(arg, NULL, 0);
+        break;
+    case 'a':
+        conf->options.async = strtoul(arg, NULL, 0);
+        break;
+    case 'P':
+        conf->options.prefetch = strtoul(arg, NULL, 0);
+        break;
+    case 'B':
+        conf->options.io_buffer_size = strtoul(arg, NULL, 0);
+        break;
+    case 'D':
+        conf->options.direct = 1;
+        break;
+    case 'Q':
+        conf->options.io_depth = strtoul(arg, NULL, 0);
+        break;
+    case 'S':
+        conf->options.stats = 1;
+        break;
 
     case ARGP_KEY_ARG:
 	switch (state->arg_num) {
@@ -161,7 +258,8 @@ main(int argc, char **argv)
     usf_file_t *output;
     usf_header_t *header_in;
     usf_header_t header_out;
-    usf_event_t event;
+    usf_event_t events[BATCH_SIZE];
+    size_t n;
     usf_compression_t in_compression = -1;
 
     /* Parse our arguments; every option seen by parse_opt will
@@ -171,8 +269,10 @@ main(int argc, char **argv)
     if (conf.override != (usf_compression_t)-1)
         in_compression = conf.override;
 
-    if ((error = usf_open_hidden(&input, conf.input,
-                                 in_compression)) != USF_ERROR_OK) {
+    if ((error = usf_open_hidden(&input,
+                                 strcmp(conf.input, "-") ? conf.input : NULL,
+                                 in_compression,
+                                 &conf.options)) != USF_ERROR_OK) {
 	fprintf(stderr, "Unable to open input file: %s\n",
 		usf_strerror(error));
 	return EXIT_FAILURE;
@@ -186,23 +286,33 @@ main(int argc, char **argv)
     }
 
     header_out = *header_in;
+    header_out.version = conf.legacy ?
+        USF_VERSION(0, 2) : USF_VERSION_CURRENT;
 
     /* Setup flags from command line arguments */
-    header_out.flags &= ~(USF_FLAG_DELTA);
+    header_out.flags &= ~(USF_FLAG_DELTA | USF_FLAG_VARINT |
+                          USF_FLAG_TID_CONTEXT | USF_FLAG_STRIDE |
+                          USF_FLAG_PC_DICT | USF_FLAG_COLUMNS);
     header_out.flags |= conf.delta ? USF_FLAG_DELTA : 0;
+    header_out.flags |= conf.varint ? USF_FLAG_VARINT : 0;
+    header_out.flags |= conf.tid_context ? USF_FLAG_TID_CONTEXT : 0;
+    header_out.flags |= conf.stride ? USF_FLAG_STRIDE : 0;
+    header_out.flags |= conf.pc_dict ? USF_FLAG_PC_DICT : 0;
+    header_out.flags |= conf.columns ? USF_FLAG_COLUMNS : 0;
 
     if (conf.compression != (usf_compression_t)-1) 
         header_out.compression = conf.compression;
 
-    if ((error = usf_create(&output, conf.output, &header_out))
-	!= USF_ERROR_OK) {
+    if ((error = usf_create_opts(&output, conf.output, &header_out,
+                                 &conf.options)) != USF_ERROR_OK) {
 	fprintf(stderr, "Unable to create output file: %s\n",
 		usf_strerror(error));
 	return EXIT_FAILURE;
     }
 
-    while ((error = usf_read(input, &event)) == USF_ERROR_OK) {
-	if ((error = usf_append(output, &event)) != USF_ERROR_OK) {
+    while ((error = usf_read_batch(input, events, BATCH_SIZE, &n)) ==
+           USF_ERROR_OK) {
+	if ((error = usf_append_batch(output, events, n)) != USF_ERROR_OK) {
 	    fprintf(stderr, "Unable to write event: %s\n",
 		    usf_strerror(error));
 	    return EXIT_FAILURE;
@@ -215,7 +325,12 @@ main(int argc, char **argv)
 	return EXIT_FAILURE;
     }
 
-    usf_close(output);
+    if ((error = usf_close(output)) != USF_ERROR_OK) {
+	fprintf(stderr, "Failed to close output file: %s\n",
+		usf_strerror(error));
+	return EXIT_FAILURE;
+    }
+
     usf_close(input);
     return 0;
 }
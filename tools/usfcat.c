@@ -36,6 +36,8 @@
 #include <getopt.h>
 #include <uart/usf.h>
 
+#define BATCH_SIZE 1024
+
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 
@@ -61,6 +63,11 @@ static char *usage_str =
     "  -h, --help\t\tdisplay this help and exit\n"
     "  -c, --compression\tSet compression algorithm\n"
     "  -d, --delta\t\tEnable delta compression\n"
+    "  -z, --varint\t\tEnable variable length delta compression\n"
+    "  -t, --tid-context\tEnable per-thread delta compression\n"
+    "  -s, --stride\t\tEnable per-pc address prediction\n"
+    "  -p, --pc-dict\t\tEnable pc dictionary compression\n"
+    "  -C, --columns\t\tStore traces in columns\n"
     "  -f, --force\t\tForce concatenation\n";
 
 typedef struct {
@@ -69,6 +76,11 @@ typedef struct {
 
     usf_compression_t compression;
     int delta;
+    int varint;
+    int tid_context;
+    int stride;
+    int pc_dict;
+    int columns;
     int force;
 } args_t;
 
@@ -92,26 +104,32 @@ parse_args(args_t *args, int argc, char **argv)
         {"help", no_argument, NULL, 'h'},
         {"compression", required_argument, NULL, 'c'},
         {"delta", no_argument, NULL, 'd'},
+        {"varint", no_argument, NULL, 'z'},
+        {"tid-context", no_argument, NULL, 't'},
+        {"stride", no_argument, NULL, 's'},
+        {"pc-dict", no_argument, NULL, 'p'},
+        {"columns", no_argument, NULL, 'C'},
         {"force", no_argument, NULL, 'f'},
         { NULL, 0, NULL, 0 }
     };
 
     args->compression = (usf_compression_t)-1;
     args->delta = 0;
+    args->varint = 0;
+    args->tid_context = 0;
+    args->stride = 0;
+    args->pc_dict = 0;
+    args->columns = 0;
     args->force = 0;
 
-    while ((c = getopt_long(argc, argv, "hc:df", long_opts, NULL)) != -1) {
+    while ((c = getopt_long(argc, argv, "hc:dztspCf", long_opts, NULL)) != -1) {
         switch (c) {
         case 'h':
             printf("%s\n", usage_str);
             exit(EXIT_SUCCESS);
 
         case 'c':
-            if (!strcmp("none", optarg))
-                args->compression = USF_COMPRESSION_NONE;
-            else if (!strcmp("bzip2", optarg))
-                args->compression = USF_COMPRESSION_BZIP2;
-            else
+            if (usf_parsecompr(&args->compression, optarg) != USF_ERROR_OK)
                 print_and_exit("Unknown compression\n\n%s\n", usage_str);
             break;
 
@@ -119,6 +137,30 @@ parse_args(args_t *args, int argc, char **argv)
             args->delta = 1;
             break;
 
+        case 'z':
+            args->delta = 1;
+            args->varint = 1;
+            break;
+
+        case 't':
+            args->delta = 1;
+            args->tid_context = 1;
+            break;
+
+        case 's':
+            args->delta = 1;
+            args->stride = 1;
+            break;
+
+        case 'p':
+            args->delta = 1;
+            args->pc_dict = 1;
+            break;
+
+        case 'C':
+            args->columns = 1;
+            break;
+
         case 'f':
             args->force = 1;
             break;
@@ -232,7 +274,9 @@ make_header(usf_file_t    **usf_ifile_list,
     }
 
     outheader->flags &= ~USF_FLAG_FOREIGN_ENDIAN;
-    outheader->flags &= ~USF_FLAG_DELTA;
+    outheader->flags &= ~(USF_FLAG_DELTA | USF_FLAG_VARINT |
+                          USF_FLAG_TID_CONTEXT | USF_FLAG_STRIDE |
+                          USF_FLAG_PC_DICT | USF_FLAG_COLUMNS);
 }
 
 static void
@@ -277,15 +321,27 @@ main(int argc, char **argv)
 
     if (args.delta)
         header.flags |= USF_FLAG_DELTA;
+    if (args.varint)
+        header.flags |= USF_FLAG_VARINT;
+    if (args.tid_context)
+        header.flags |= USF_FLAG_TID_CONTEXT;
+    if (args.stride)
+        header.flags |= USF_FLAG_STRIDE;
+    if (args.pc_dict)
+        header.flags |= USF_FLAG_PC_DICT;
+    if (args.columns)
+        header.flags |= USF_FLAG_COLUMNS;
 
     error = usf_create(&usf_ofile, NULL, &header);
     E_USF(error, "usf_create");
 
     for (int i = 0; i < usf_ifile_list_len; i++) {
-        usf_event_t event;
-        while (usf_read(usf_ifile_list[i], &event) == USF_ERROR_OK) {
-            error = usf_append(usf_ofile, &event);
-            E_USF(error, "usf_append");
+        usf_event_t events[BATCH_SIZE];
+        size_t n;
+        while (usf_read_batch(usf_ifile_list[i], events, BATCH_SIZE, &n) ==
+               USF_ERROR_OK) {
+            error = usf_append_batch(usf_ofile, events, n);
+            E_USF(error, "usf_append_batch");
         }
     }
 
@@ -45,11 +45,17 @@
 typedef struct {
     int verbose;
     char *file;
+    int has_from;
+    usf_atime_t from;
+    int has_to;
+    usf_atime_t to;
 } conf_t;
 
 conf_t conf = {
     .verbose = 0,
-    .file = NULL
+    .file = NULL,
+    .has_from = 0,
+    .has_to = 0
 };
 
 struct {
@@ -59,6 +65,11 @@ struct {
     { USF_FLAG_TRACE, "trace" },
     { USF_FLAG_BURST, "burst" },
     { USF_FLAG_DELTA, "delta compression"},
+    { USF_FLAG_VARINT, "varint deltas"},
+    { USF_FLAG_TID_CONTEXT, "per-thread deltas"},
+    { USF_FLAG_STRIDE, "address prediction"},
+    { USF_FLAG_PC_DICT, "pc dictionary"},
+    { USF_FLAG_COLUMNS, "columns"},
     { USF_FLAG_INSTRUCTIONS, "instructions" },
     { USF_FLAG_NATIVE_ENDIAN, "native endian" },
     { USF_FLAG_FOREIGN_ENDIAN, "foreign endian" },
@@ -112,6 +123,23 @@ print_event(const usf_event_t *e)
     }
 }
 
+static usf_atime_t
+event_time(const usf_event_t *e)
+{
+    switch (e->type) {
+    case USF_EVENT_SAMPLE:
+        return e->u.sample.begin.time;
+    case USF_EVENT_DANGLING:
+        return e->u.dangling.begin.time;
+    case USF_EVENT_BURST:
+        return e->u.burst.begin_time;
+    case USF_EVENT_TRACE:
+        return e->u.trace.access.time;
+    default:
+        abort();
+    }
+}
+
 static void
 print_line_sizes(usf_line_size_mask_t line_sizes)
 {
@@ -190,8 +218,21 @@ real_main()
 
     print_header(header);
 
-    while ((error = usf_read(file, &event)) == USF_ERROR_OK)
+    if (conf.has_from) {
+        error = usf_seek_time(file, conf.from);
+        if (error != USF_ERROR_OK && error != USF_ERROR_EOF) {
+            fprintf(stderr, "Failed to seek: %s\n", usf_strerror(error));
+            return EXIT_FAILURE;
+        }
+    }
+
+    while ((error = usf_read(file, &event)) == USF_ERROR_OK) {
+        if (conf.has_to && event_time(&event) >= conf.to) {
+            error = USF_ERROR_EOF;
+            break;
+        }
 	print_event(&event);
+    }
 
     if (error != USF_ERROR_EOF) {
 	fprintf(stderr, "Failed to read event: %s\n",
@@ -219,8 +260,23 @@ static char args_doc[] = "FILE";
 
 static struct argp_option options[] = {
     {"verbose", 'v', 0, 0, "Produce verbose output" },
+    {"from", 'f', "TIME", 0, "Start at the first event at or after TIME" },
+    {"to", 't', "TIME", 0, "Stop at the first event at or after TIME" },
     { 0 }
 };
+
+static usf_atime_t
+parse_time(const char *arg, struct argp_state *state)
+{
+    char *end;
+    unsigned long long time;
+
+    time = strtoull(arg, &end, 0);
+    if (*arg == '\0' || *end != '\0')
+        argp_error(state, "Invalid time: %s", arg);
+
+    return time;
+}
      
 static error_t
 parse_opt (int key, char *arg, struct argp_state *state)
@@ -235,6 +291,16 @@ parse_opt (int key, char *arg, struct argp_state *state)
 	conf->verbose = 1;
 	break;
 
+    case 'f':
+        conf->has_from = 1;
+        conf->from = parse_time(arg, state);
+        break;
+
+    case 't':
+        conf->has_to = 1;
+        conf->to = parse_time(arg, state);
+        break;
+
     case ARGP_KEY_ARG:
 	if (state->arg_num >= 1)
 	    /* Too many arguments. */
@@ -46,6 +46,8 @@ using namespace std;
 } while (0)
 
 
+#define BATCH_SIZE 1024
+
 static const char *usage_str = 
     "usfsort [OPTION...] INPUT OUTPUT";
 
@@ -128,7 +130,8 @@ main(int argc, char **argv)
     usf_file_t *usf_ofile;
     usf_header_t *header_in;
     usf_header_t header_out;
-    usf_event_t event;
+    usf_event_t events[BATCH_SIZE];
+    size_t n;
     usf_error_t error;
 
     parse_args(args, argc, argv);
@@ -142,8 +145,11 @@ main(int argc, char **argv)
     E(error, "usf_header");
     header_out = *header_in;
 
-    while ((error = usf_read(usf_ifile, &event)) == USF_ERROR_OK)
-        pqueue.push(event);
+    while ((error = usf_read_batch(usf_ifile, events, BATCH_SIZE, &n)) ==
+           USF_ERROR_OK) {
+        for (size_t i = 0; i < n; i++)
+            pqueue.push(events[i]);
+    }
 
     error = usf_close(usf_ifile);
     E(error, "usf_close");
@@ -152,9 +158,13 @@ main(int argc, char **argv)
     E(error, "usf_create");
 
     while (!pqueue.empty()) {
-        error = usf_append(usf_ofile, &pqueue.top());
-        E(error, "usf_append");
-        pqueue.pop();
+        for (n = 0; n < BATCH_SIZE && !pqueue.empty(); n++) {
+            events[n] = pqueue.top();
+            pqueue.pop();
+        }
+
+        error = usf_append_batch(usf_ofile, events, n);
+        E(error, "usf_append_batch");
     }
 
     error = usf_close(usf_ofile);
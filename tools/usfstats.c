@@ -32,9 +32,9 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
-#include <strings.h>
 #include <stdarg.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <uart/usf.h>
 
 #define E_USF(e, name) do {                                     \
@@ -43,33 +43,14 @@
             print_and_exit("%s: %s\n", name, usf_strerror(_e)); \
     } while (0)
 
-static char *usage_str = "Usage: usfstats [INFILE]";
+static char *usage_str = "Usage: usfstats [-s] [INFILE]\n"
+    "  -s  Decode all events even if the file has a statistics trailer";
 
 typedef struct {
     char *file_name;
+    int scan;
 } args_t;
 
-typedef unsigned long stats_t[USF_EVENT_TRACE + 1];
-#define STATS_CLS(s)    bzero(s, sizeof(stats_t))
-#define STATS_INC(s, t) s[t]++ 
-
-static inline void
-STATS_PRINT(stats_t s)
-{
-    printf("events:     %lu\n", s[USF_EVENT_SAMPLE] +
-           s[USF_EVENT_DANGLING] +
-           s[USF_EVENT_TRACE]);
-    printf("samples:    %lu\n", s[USF_EVENT_SAMPLE]);
-    printf("danglings:  %lu\n", s[USF_EVENT_DANGLING]);
-    printf("traces:     %lu\n", s[USF_EVENT_TRACE]);
-}
-
-static inline void
-stats_inc(stats_t s, usf_event_type_t type)
-{
-    s[type]++;
-}
-
 static void __attribute__ ((format (printf, 1, 2)))
 print_and_exit(char *fmt, ...)
 {
@@ -84,10 +65,141 @@ print_and_exit(char *fmt, ...)
 static void
 parse_args(args_t *args, int argc, char **argv)
 {
-    if (argc != 2) 
+    int c;
+
+    args->scan = 0;
+    while ((c = getopt(argc, argv, "s")) != -1) {
+        switch (c) {
+        case 's':
+            args->scan = 1;
+            break;
+        default:
+            print_and_exit("%s\n", usage_str);
+        }
+    }
+
+    if (argc - optind != 1)
         print_and_exit("%s\n", usage_str);
 
-    args->file_name = argv[1];
+    args->file_name = argv[optind];
+}
+
+/** Get an entry in a table of counts, growing it if necessary */
+static usf_stats_count_t *
+count_at(usf_stats_count_t **counts, size_t *len, size_t i)
+{
+    if (i >= *len) {
+        usf_stats_count_t *c = realloc(*counts, (i + 1) * sizeof(*c));
+
+        if (!c)
+            print_and_exit("Out of memory\n");
+        memset(c + *len, 0, (i + 1 - *len) * sizeof(*c));
+        *counts = c;
+        *len = i + 1;
+    }
+
+    return &(*counts)[i];
+}
+
+static void
+scan_access(usf_stats_t *stats, const usf_access_t *access)
+{
+    if (access->time < stats->min_time)
+        stats->min_time = access->time;
+    if (access->time > stats->max_time)
+        stats->max_time = access->time;
+    if (access->addr < stats->min_addr)
+        stats->min_addr = access->addr;
+    if (access->addr > stats->max_addr)
+        stats->max_addr = access->addr;
+}
+
+/** Compute the statistics of files without a trailer */
+static void
+scan_file(usf_stats_t *stats, usf_file_t *usf_file)
+{
+    usf_event_t event;
+    const usf_access_t *access;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->min_time = (usf_atime_t)-1;
+    stats->min_addr = (usf_addr_t)-1;
+    count_at(&stats->burst, &stats->bursts, 0);
+
+    while (usf_read(usf_file, &event) == USF_ERROR_OK) {
+        access = NULL;
+        switch (event.type) {
+        case USF_EVENT_SAMPLE:
+            access = &event.u.sample.begin;
+            scan_access(stats, &event.u.sample.end);
+            if (event.u.sample.line_size < USF_STATS_LINE_SIZES)
+                stats->line_sizes[event.u.sample.line_size]++;
+            break;
+        case USF_EVENT_DANGLING:
+            access = &event.u.dangling.begin;
+            if (event.u.dangling.line_size < USF_STATS_LINE_SIZES)
+                stats->line_sizes[event.u.dangling.line_size]++;
+            break;
+        case USF_EVENT_BURST:
+            count_at(&stats->burst, &stats->bursts, stats->bursts);
+            break;
+        case USF_EVENT_TRACE:
+            access = &event.u.trace.access;
+            break;
+        }
+
+        stats->total.events[event.type]++;
+        stats->burst[stats->bursts - 1].events[event.type]++;
+        if (access) {
+            scan_access(stats, access);
+            count_at(&stats->tid, &stats->tids,
+                     access->tid)->events[event.type]++;
+        }
+    }
+}
+
+static void
+print_count(const usf_stats_count_t *c)
+{
+    printf("events:     %" PRIu64 "\n", c->events[USF_EVENT_SAMPLE] +
+           c->events[USF_EVENT_DANGLING] +
+           c->events[USF_EVENT_TRACE]);
+    printf("samples:    %" PRIu64 "\n", c->events[USF_EVENT_SAMPLE]);
+    printf("danglings:  %" PRIu64 "\n", c->events[USF_EVENT_DANGLING]);
+    printf("traces:     %" PRIu64 "\n", c->events[USF_EVENT_TRACE]);
+}
+
+static void
+print_stats(const usf_stats_t *stats)
+{
+    for (size_t i = 0; i < stats->bursts; i++) {
+        printf("=== Burst stats [%zu] === \n", i);
+        print_count(&stats->burst[i]);
+    }
+
+    printf("\n=== Global stats ===\n");
+    print_count(&stats->total);
+    if (stats->min_time <= stats->max_time) {
+        printf("time:       %" PRIu64 "-%" PRIu64 "\n",
+               stats->min_time, stats->max_time);
+        printf("addresses:  0x%" PRIx64 "-0x%" PRIx64 "\n",
+               stats->min_addr, stats->max_addr);
+    }
+    for (int i = 0; i < USF_STATS_LINE_SIZES; i++) {
+        if (stats->line_sizes[i])
+            printf("line size %lu: %" PRIu64 "\n", 1UL << i,
+                   stats->line_sizes[i]);
+    }
+
+    for (size_t i = 0; i < stats->tids; i++) {
+        const usf_stats_count_t *c = &stats->tid[i];
+
+        if (c->events[USF_EVENT_SAMPLE] || c->events[USF_EVENT_DANGLING] ||
+            c->events[USF_EVENT_TRACE]) {
+            printf("\n=== Thread stats [%zu] ===\n", i);
+            print_count(c);
+        }
+    }
 }
 
 int
@@ -95,37 +207,29 @@ main(int argc, char **argv)
 {
     args_t args;
     usf_file_t *usf_file;
-    usf_event_t event;
     usf_error_t error;
-    stats_t stats_burst;
-    stats_t stats_global;
-    unsigned long  burst_id = 0;
+    const usf_stats_t *stats;
+    usf_stats_t scanned;
 
     parse_args(&args, argc, argv);
 
     error = usf_open(&usf_file, args.file_name);
     E_USF(error, "usf_open");
 
-    STATS_CLS(stats_burst);
-    STATS_CLS(stats_global);
-    while (usf_read(usf_file, &event) == USF_ERROR_OK) {
-        STATS_INC(stats_burst, event.type);
-        STATS_INC(stats_global, event.type);
-        if (event.type == USF_EVENT_BURST) {
-            printf("=== Burst stats [%lu] === \n", burst_id++);
-            STATS_PRINT(stats_burst);
-            STATS_CLS(stats_burst);
-        }
+    /* Files written with a statistics trailer don't have to be
+     * decoded */
+    error = args.scan ? USF_ERROR_UNSUPPORTED :
+        usf_file_stats(&stats, usf_file);
+    if (error == USF_ERROR_UNSUPPORTED) {
+        scan_file(&scanned, usf_file);
+        print_stats(&scanned);
+        free(scanned.tid);
+        free(scanned.burst);
+    } else {
+        E_USF(error, "usf_file_stats");
+        print_stats(stats);
     }
 
-    /* Assuming that the laste event is not a burst */
-    printf("=== Burst stats [%lu] === \n", burst_id++);
-    STATS_PRINT(stats_burst);
-
-
-    printf("\n=== Global stats ===\n");
-    STATS_PRINT(stats_global);
-
     error = usf_close(usf_file);
     E_USF(error, "usf_close");
     return 0;